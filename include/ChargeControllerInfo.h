@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include <time.h>
+#include <functional>
 #include <WString.h>
 
 struct ChargeControllerInfo
@@ -49,9 +51,32 @@ struct ChargeControllerInfo
 
 typedef struct 
 {
-	bool received;
+	bool received;                   //read during the current gather cycle
 	int address;
 	int numberOfRegisters;
-	std::function<void(uint8_t *data)> func;
+	unsigned long pollRate;          //ms between reads, MODBUS_POLL_ONCE to read it only once, MODBUS_POLL_LIVE to follow the adaptive live rate
+	unsigned long lastPollMillis;    //when the data that was last received for the bank was requested
 } ModbusRegisterBank;
 
+#define CHARGER_DATA_VALUES 64 //one per bit of changedFields
+
+/**
+ * Thsi data structure contains the values that can be used for automatically controlling the relays.
+ * If additional measures are needed, create an entry here and then set the value in the code where
+ * the other values are being set. The measures then can be used in the code to automatically control
+ * the relays.
+ */
+struct chargerDataForRelayControl
+{
+   uint32_t sequence = 0;  //goes up by one each time new data is published, see chargerDataSequence()
+   unsigned long gatherMillis = 0;
+   time_t timeDataWasGathered = 0;
+   uint8_t controllers = 0; //charge controllers whose readings were combined into these, see combineChargerInfo()
+   uint64_t changedFields = 0; //ClassicFieldSet of the registers that changed since the previous sequence
+   int SOC = 0;
+   double BatVoltage = -1;
+   double BatCurrent = -1;
+   double PVVoltage = -1;
+   double PVCurrent = -1;
+   float values[CHARGER_DATA_VALUES] = {0}; //every numeric ClassicField, then the DerivedFields, indexed by their change bit
+};
@@ -0,0 +1,78 @@
+/**
+ * Thin Arduino layer for the native (host) environment. Enough of the core for the sources that do not
+ * touch the hardware or the network: AutoData, the register map decoders, the read planner, the timer wheel
+ * and friends.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include "WString.h"
+
+using std::abs;
+using std::max;
+using std::min;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define IRAM_ATTR
+#define PROGMEM
+#define snprintf_P snprintf
+#define sprintf_P sprintf
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+//FreeRTOS critical sections, the host runs everything on the one thread
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+/**
+ * Serial writes to stdout, point output somewhere else (or at NULL to drop it) when it gets in the way.
+ */
+class HardwareSerial
+{
+public:
+   FILE *output = stdout;
+
+   void begin(unsigned long baud) {}
+   size_t print(const char *s) { return write("%s", s); }
+   size_t print(const String &s) { return write("%s", s.c_str()); }
+   size_t print(char c) { return write("%c", c); }
+   size_t print(int n) { return write("%d", n); }
+   size_t print(unsigned int n) { return write("%u", n); }
+   size_t print(long n) { return write("%ld", n); }
+   size_t print(unsigned long n) { return write("%lu", n); }
+   size_t print(long long n) { return write("%lld", n); }
+   size_t print(unsigned long long n) { return write("%llu", n); }
+   size_t print(double n, int digits = 2) { return write("%.*f", digits, n); }
+   template <typename T> size_t println(const T &value) { return print(value) + println(); }
+   size_t println() { return write("\n"); }
+
+   template <typename... Args> size_t printf(const char *format, Args... args) { return write(format, args...); }
+
+private:
+   template <typename... Args> size_t write(const char *format, Args... args)
+   {
+      if (output == NULL) return 0;
+      int n = fprintf(output, format, args...);
+      return n < 0 ? 0 : n;
+   }
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,98 @@
+/**
+ * Host stand-in for the Arduino String class, backed by std::string. Only what the firmware sources and
+ * ArduinoJson (ARDUINOJSON_ENABLE_ARDUINO_STRING) use is provided.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+
+#define DEC 10
+#define HEX 16
+
+class String
+{
+public:
+   String() {}
+   String(const char *cstr) : _s(cstr ? cstr : "") {}
+   String(const std::string &str) : _s(str) {}
+   String(char c) : _s(1, c) {}
+   String(int value, unsigned char base = DEC) { fromInteger((long long)value, base); }
+   String(unsigned int value, unsigned char base = DEC) { fromUnsigned(value, base); }
+   String(long value, unsigned char base = DEC) { fromInteger(value, base); }
+   String(unsigned long value, unsigned char base = DEC) { fromUnsigned(value, base); }
+   String(long long value, unsigned char base = DEC) { fromInteger(value, base); }
+   String(unsigned long long value, unsigned char base = DEC) { fromUnsigned(value, base); }
+   String(float value, unsigned int decimalPlaces = 2) { fromDouble(value, decimalPlaces); }
+   String(double value, unsigned int decimalPlaces = 2) { fromDouble(value, decimalPlaces); }
+
+   String &operator=(const char *cstr) { _s = cstr ? cstr : ""; return *this; }
+
+   const char *c_str() const { return _s.c_str(); }
+   unsigned int length() const { return _s.length(); }
+   bool isEmpty() const { return _s.empty(); }
+   unsigned char reserve(unsigned int size) { _s.reserve(size); return 1; }
+
+   unsigned char concat(const String &str) { _s += str._s; return 1; }
+   unsigned char concat(const char *cstr) { if (cstr == NULL) return 0; _s += cstr; return 1; }
+   unsigned char concat(const char *cstr, unsigned int length) { if (cstr == NULL) return 0; _s.append(cstr, length); return 1; }
+   unsigned char concat(char c) { _s += c; return 1; }
+
+   String &operator+=(const String &rhs) { concat(rhs); return *this; }
+   String &operator+=(const char *cstr) { concat(cstr); return *this; }
+   String &operator+=(char c) { concat(c); return *this; }
+
+   bool equals(const String &s) const { return _s == s._s; }
+   bool operator==(const String &rhs) const { return _s == rhs._s; }
+   bool operator==(const char *cstr) const { return _s == (cstr ? cstr : ""); }
+   bool operator!=(const String &rhs) const { return !(*this == rhs); }
+   bool operator!=(const char *cstr) const { return !(*this == cstr); }
+   bool operator<(const String &rhs) const { return _s < rhs._s; }
+   bool startsWith(const String &prefix) const { return _s.compare(0, prefix._s.size(), prefix._s) == 0; }
+
+   char operator[](unsigned int index) const { return index < _s.size() ? _s[index] : 0; }
+   char charAt(unsigned int index) const { return (*this)[index]; }
+   int indexOf(char c, unsigned int from = 0) const { size_t p = _s.find(c, from); return p == std::string::npos ? -1 : (int)p; }
+   int indexOf(const String &str, unsigned int from = 0) const { size_t p = _s.find(str._s, from); return p == std::string::npos ? -1 : (int)p; }
+   String substring(unsigned int beginIndex) const { return beginIndex < _s.size() ? String(_s.substr(beginIndex)) : String(); }
+   String substring(unsigned int beginIndex, unsigned int endIndex) const { return beginIndex < _s.size() && endIndex > beginIndex ? String(_s.substr(beginIndex, endIndex - beginIndex)) : String(); }
+   void trim()
+   {
+      size_t b = _s.find_first_not_of(" \t\r\n");
+      size_t e = _s.find_last_not_of(" \t\r\n");
+      _s = (b == std::string::npos) ? "" : _s.substr(b, e - b + 1);
+   }
+
+   long toInt() const { return atol(_s.c_str()); }
+   float toFloat() const { return (float)atof(_s.c_str()); }
+   double toDouble() const { return atof(_s.c_str()); }
+
+   friend String operator+(const String &lhs, const String &rhs) { return String(lhs._s + rhs._s); }
+   friend String operator+(const String &lhs, const char *rhs) { return String(lhs._s + (rhs ? rhs : "")); }
+   friend String operator+(const char *lhs, const String &rhs) { return String((lhs ? lhs : "") + rhs._s); }
+   friend String operator+(const String &lhs, char rhs) { return String(lhs._s + rhs); }
+
+private:
+   std::string _s;
+
+   void fromInteger(long long value, unsigned char base)
+   {
+      if (base == DEC || value >= 0) fromUnsigned(value < 0 ? -(unsigned long long)value : (unsigned long long)value, base);
+      else fromUnsigned((unsigned long long)value, base);
+      if (base == DEC && value < 0) _s.insert(0, 1, '-');
+   }
+   void fromUnsigned(unsigned long long value, unsigned char base)
+   {
+      char buf[66];
+      snprintf(buf, sizeof(buf), base == HEX ? "%llx" : "%llu", value);
+      _s = buf;
+   }
+   void fromDouble(double value, unsigned int decimalPlaces)
+   {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value);
+      _s = buf;
+   }
+};
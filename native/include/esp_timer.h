@@ -0,0 +1,8 @@
+/**
+ * The esp_timer clock of the native environment, microseconds since the program started.
+ */
+#pragma once
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time();
@@ -0,0 +1,33 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <chrono>
+#include <thread>
+
+HardwareSerial Serial;
+
+static const std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+   return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _start).count();
+}
+
+unsigned long micros()
+{
+   return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+}
+
+int64_t esp_timer_get_time()
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+}
+
+void delay(unsigned long ms)
+{
+   std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield()
+{
+   std::this_thread::yield();
+}
@@ -0,0 +1,127 @@
+/**
+ * Micro-benchmarks of the control and decoding core, run on the host with
+ *    pio run -e native && .pio/build/native/program
+ * Each one prints the time per call so a change can be compared before and after. Left out of the
+ * pio test -e native build, which brings its own main().
+ */
+#ifndef PIO_UNIT_TESTING
+
+#include <Arduino.h>
+#include <chrono>
+#include "AutoData.h"
+#include "ClassicRegisterMap.h"
+#include "ModbusPlanner.h"
+#include "LatencyHistogram.h"
+#include "TimeSeries.h"
+
+//Keeps the optimiser from throwing away the work being timed
+static volatile double _sink;
+
+template <typename F>
+static void bench(const char *name, long iterations, F body)
+{
+   auto start = std::chrono::steady_clock::now();
+   for (long i = 0; i < iterations; i++) body(i);
+   double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+   printf("%-32s %10ld calls %10.1f ns/call\n", name, iterations, ns / iterations);
+}
+
+#define BENCH_BANK(bank, rate) {false, classicBankStart(bank), classicBankCount(bank), rate, 0}
+
+int main(int argc, char **argv)
+{
+   long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+   FILE *devNull = fopen("/dev/null", "w");
+
+   //A live bank response: 13.2V, 48.0V PV, 10.5A, ...
+   uint8_t live[2 * classicBankCount(BANK_LIVE)];
+   for (unsigned i = 0; i < sizeof(live); i += 2)
+   {
+      live[i] = 0x00;
+      live[i + 1] = (uint8_t)(100 + i);
+   }
+   ChargeControllerInfo info;
+   bench("decodeClassicBank<BANK_LIVE>", iterations, [&](long i) {
+      live[1] = (uint8_t)i;
+      decodeClassicBank<BANK_LIVE>(live, info);
+      _sink = info.BatVoltage;
+   });
+
+   uint8_t whizbang[2 * classicBankCount(BANK_WHIZBANG)] = {};
+   bench("decodeClassicBank<BANK_WHIZBANG>", iterations, [&](long i) {
+      whizbang[17] = (uint8_t)i;
+      decodeClassicBank<BANK_WHIZBANG>(whizbang, info);
+      _sink = info.SOC;
+   });
+
+   uint8_t image[2 * classicImageRegisters] = {};
+   bench("classicFieldDecoders[SOC]", iterations, [&](long i) {
+      image[2 * classicImageOffset(BANK_WHIZBANG) + 17] = (uint8_t)i;
+      classicFieldDecoders[CLASSIC_FIELD_SOC](image, info);
+      _sink = info.SOC;
+   });
+
+   ModbusRegisterBank banks[] = {
+      BENCH_BANK(BANK_IDENTITY, 0), BENCH_BANK(BANK_LIVE, 1), BENCH_BANK(BANK_TEMPERATURE, 1),
+      BENCH_BANK(BANK_MPPT, 0), BENCH_BANK(BANK_SETPOINTS, 1), BENCH_BANK(BANK_WHIZBANG, 1),
+      BENCH_BANK(BANK_VERSION, 0)};
+   ModbusReadSpan spans[CLASSIC_BANK_COUNT];
+   bench("planModbusReads (all banks)", iterations, [&](long i) {
+      _sink = planModbusReads(banks, CLASSIC_BANK_COUNT, 0x7F, spans, CLASSIC_BANK_COUNT);
+   });
+
+   AutoData ad;
+   ad.measure = BATVOLT;
+   ad.value = 12.2;
+   ad.restoreValue = 13.1;
+   Serial.output = devNull;
+   bench("autoAdjustSingleRelay", iterations, [&](long i) {
+      _sink = autoAdjustSingleRelay(12.0 + (i % 20) * 0.1, i & 1, ad);
+   });
+
+   chargerDataForRelayControl cd;
+   cd.BatVoltage = 13.2;
+   bench("measureValue", iterations, [&](long i) {
+      _sink = measureValue((AutoMeasure)(i % IGNORE), cd);
+   });
+
+   AutoData ruled;
+   ruled.rule.compile("SOC > 80 ~ 5 AND (PVCURRENT > 10 OR BATPOWER > 500) FOR 5m");
+   bench("RelayRule::evaluate", iterations, [&](long i) {
+      cd.values[CLASSIC_FIELD_SOC] = 75 + (i % 10);
+      _sink = ruled.rule.evaluate(cd, i * 1000);
+   });
+
+   bench("asRawJson/fromJson", iterations / 10, [&](long i) {
+      _sink = fromJson(asRawJson(ad)).value;
+   });
+   Serial.output = stdout;
+
+   LatencyHistogram histogram;
+   bench("LatencyHistogram::record", iterations, [&](long i) {
+      histogram.record(i % 400);
+   });
+   bench("LatencyHistogram::percentile", iterations, [&](long i) {
+      _sink = histogram.percentile(99);
+   });
+
+   TimeSeries history;
+   history.begin();
+   bench("TimeSeries::append", iterations, [&](long i) {
+      info.BatVoltage = 13.0f + (i % 7) * 0.1f;
+      info.PVCurrent = (i % 50) * 0.1f;
+      history.append(TimeSeries::sampleOf(1700000000 + 4 * i, info));
+   });
+   printf("%-32s %10u samples %10.1f bytes/sample\n", "TimeSeries", history.sampleCount(), (double)history.bytesInUse() / history.sampleCount());
+   bench("TimeSeries::query (all)", 100, [&](long i) {
+      history.query(0, UINT32_MAX, [&](const TimeSeriesSample &sample) {
+         _sink = sample.values[TS_BATVOLTAGE];
+         return true;
+      });
+   });
+
+   fclose(devNull);
+   return 0;
+}
+
+#endif
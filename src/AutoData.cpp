@@ -7,7 +7,9 @@ Initialize the array that stores the information for the automatic control syste
 This will turn on and off certain relays based on the values gathered from the Solar Controller
 */
 AutoData* AutoControlAllocate(int numberOfRelays){
-    return (AutoData*)malloc(sizeof(AutoData) * numberOfRelays);
+    AutoData *data = (AutoData*)malloc(sizeof(AutoData) * numberOfRelays);
+    for (int i=0; i<numberOfRelays; i++) new (&data[i]) AutoData(); //no rule and IGNORE until the config is read
+    return data;
 }
 
 void AutoControlFree(AutoData* data){
@@ -32,6 +34,13 @@ String asRawJson(AutoData item){
     ad["me"] = autoMeasureInfo[item.measure].shortName;
     ad["vl"] = round2(item.value);
     ad["rv"] = round2(item.restoreValue);
+    if (item.nearMargin >= 0) ad["nm"] = round2(item.nearMargin);
+    if (!item.rule.empty()) ad["ru"] = item.rule.text();
+    if (item.onAt >= 0) ad["on"] = item.onAt;
+    if (item.offAt >= 0) ad["of"] = item.offAt;
+    if (item.minOnSeconds > 0) ad["mn"] = item.minOnSeconds;
+    if (item.minOffSeconds > 0) ad["mf"] = item.minOffSeconds;
+    if (item.maxSwitchesPerHour > 0) ad["mh"] = item.maxSwitchesPerHour;
 
     String returnString;
     doc.shrinkToFit(); 
@@ -53,6 +62,16 @@ AutoData fromJson(String rawJson){
         newAd.measure = fromString(autodata["me"]);
         newAd.value = autodata["vl"];
         newAd.restoreValue = autodata["rv"];
+        newAd.nearMargin = autodata["nm"] | -1.0;
+        newAd.onAt = autodata["on"] | -1;
+        newAd.offAt = autodata["of"] | -1;
+        newAd.minOnSeconds = autodata["mn"] | 0;
+        newAd.minOffSeconds = autodata["mf"] | 0;
+        newAd.maxSwitchesPerHour = autodata["mh"] | 0;
+        const char *rule = autodata["ru"].as<const char*>();
+        if (!newAd.rule.compile(rule ? rule : "")) {
+            Serial.printf("Relay rule \"%s\" not used, %s at %d\n", newAd.rule.text(), newAd.rule.error(), newAd.rule.errorAt());
+        }
 
     } else {
         Serial.println("Error, required value numberOfRelays not present aborting.");
@@ -61,31 +80,207 @@ AutoData fromJson(String rawJson){
     return newAd;
 }
 
-bool autoAdjustSingleRelay(double currentVal, bool currentState, AutoData thisAutoData){
+/*
+"HH:MM" for the time inputs of the config page, empty for -1 and anything else that is not a time of day.
+*/
+String minuteOfDayText(int16_t minuteOfDay){
+  if (minuteOfDay < 0 || minuteOfDay >= 24 * 60) return "";
+  char text[6];
+  snprintf(text, sizeof(text), "%02d:%02d", minuteOfDay / 60, minuteOfDay % 60);
+  return text;
+}
+
+/*
+Minutes past midnight of an "HH:MM" time, -1 when it is empty or not a time.
+*/
+int16_t minuteOfDayFromText(String text){
+  int hour, minute;
+  if (sscanf(text.c_str(), "%d:%d", &hour, &minute) != 2) return -1;
+  if (hour < 0 || hour > 23 || minute < 0 || minute > 59) return -1;
+  return hour * 60 + minute;
+}
+
+bool autoAdjustSingleRelay(double currentVal, bool currentState, const AutoData &thisAutoData){
   bool retVal = false;  
   bool opposite = false;  //is this a 'normal' where resVal is greater than val or opposite?
 
   if (thisAutoData.restoreValue < thisAutoData.value) {
     opposite = true;
   }
-  String info = "autoAdjustSingleRelay: currentVal="; 
-  info += String(currentVal);
-  info += " currentState="; 
-  info += currentState?"on val=":"off val="; 
-  info += String(thisAutoData.value); 
-  info += " resVal="; 
-  info += String(thisAutoData.restoreValue); 
-  info += opposite?" opposite=true":" opposite=false";
-
-  Serial.println(info);
-
   if (currentState){ //If the relay is ON
     retVal = (opposite?!(currentVal >= thisAutoData.value):(currentVal >= thisAutoData.value));
   } else { //the relay is currently off
     retVal = (opposite?!(currentVal >= thisAutoData.restoreValue):(currentVal >= thisAutoData.restoreValue));
   }
-  Serial.print("Returning ");
-  Serial.println(retVal?"true":"false");
   return retVal;
 }
 
+
+/*
+The margin of the relay when it has one, else the measure's.
+*/
+double relayNearMargin(const AutoData &thisAutoData, AutoMeasure measure){
+  return thisAutoData.nearMargin >= 0 ? thisAutoData.nearMargin : autoMeasureInfo[measure].nearMargin;
+}
+
+/*
+Is the reading within the margin of either threshold of the relay?
+*/
+bool nearThreshold(double currentVal, const AutoData &thisAutoData){
+  double margin = relayNearMargin(thisAutoData, thisAutoData.measure);
+  return abs(currentVal - thisAutoData.value) <= margin || abs(currentVal - thisAutoData.restoreValue) <= margin;
+}
+
+/*
+Does the relay switch by itself, on a rule or on a measure? A rule that did not compile leaves it alone.
+*/
+bool isAutomatic(const AutoData &thisAutoData){
+  if (!thisAutoData.rule.empty()) return thisAutoData.rule.active();
+  return thisAutoData.measure != IGNORE;
+}
+
+/*
+The state the relay should be in for the charger data, from its rule or else from its measure.
+*/
+bool autoAdjustRelay(AutoData &thisAutoData, const chargerDataForRelayControl &cd, bool currentState, unsigned long now){
+  if (!thisAutoData.rule.empty()) return thisAutoData.rule.evaluate(cd, now);
+  return autoAdjustSingleRelay(measureValue(thisAutoData.measure, cd), currentState, thisAutoData);
+}
+
+bool autoNearThreshold(const AutoData &thisAutoData, const chargerDataForRelayControl &cd){
+  if (!thisAutoData.rule.empty()) return thisAutoData.rule.near(cd, thisAutoData.nearMargin);
+  return nearThreshold(measureValue(thisAutoData.measure, cd), thisAutoData);
+}
+
+/*
+The reading from the charger data that the measure tests, looked up through the table.
+*/
+double measureValue(AutoMeasure measure, const chargerDataForRelayControl &cd){
+  return cd.values[autoMeasureInfo[measure].changeBit];
+}
+
+
+/*
+Is this a switch that was not already being held back? Auto control asks again on every sample until it is allowed.
+*/
+static bool newlyHeld(RelayGuard &guard, bool newState, uint32_t nowSecond, uint32_t holdOff){
+  bool counted = guard.heldState == newState && nowSecond < guard.heldUntil;
+  guard.heldState = newState;
+  guard.heldUntil = nowSecond + holdOff;
+  return !counted;
+}
+
+/*
+May auto control switch the relay to newState now? Returns 0 when it may, and counts the switch against the
+hour's allowance. Otherwise returns the seconds until it may and counts the switch as suppressed, once however
+often it is asked again while it is held back. byDwell tells whether the dwell time or the switches per hour
+held it back.
+*/
+uint32_t relaySwitchHoldOff(AutoData &thisAutoData, bool newState, uint32_t nowSecond, bool &byDwell){
+  RelayGuard &guard = thisAutoData.guard;
+  byDwell = false;
+  //Going on ends an off period and going off ends an on period
+  uint32_t dwell = newState ? thisAutoData.minOffSeconds : thisAutoData.minOnSeconds;
+  uint32_t inState = nowSecond - guard.lastSwitch;
+  if (guard.switched && inState < dwell) {
+    if (newlyHeld(guard, newState, nowSecond, dwell - inState)) guard.suppressedDwell++;
+    byDwell = true;
+    return dwell - inState;
+  }
+
+  if (thisAutoData.maxSwitchesPerHour > 0) {
+    float perSecond = thisAutoData.maxSwitchesPerHour / 3600.0;
+    if (guard.allowance < 0) {
+      guard.allowance = thisAutoData.maxSwitchesPerHour;
+    } else {
+      guard.allowance = min((float)thisAutoData.maxSwitchesPerHour, guard.allowance + (nowSecond - guard.allowanceSecond) * perSecond);
+    }
+    guard.allowanceSecond = nowSecond;
+    if (guard.allowance < 1) {
+      uint32_t holdOff = (uint32_t)ceil((1 - guard.allowance) / perSecond);
+      if (newlyHeld(guard, newState, nowSecond, holdOff)) guard.suppressedRate++;
+      return holdOff;
+    }
+    guard.allowance -= 1;
+  }
+  guard.heldUntil = 0;
+  guard.switches++;
+  return 0;
+}
+
+/*
+The relay was set, by auto control or otherwise. The dwell times run from when it last changed state.
+*/
+void relaySwitched(AutoData &thisAutoData, bool on, uint32_t nowSecond){
+  RelayGuard &guard = thisAutoData.guard;
+  if (guard.switched && guard.on == on) return;
+  guard.lastSwitch = nowSecond;
+  guard.on = on;
+  guard.switched = true;
+  guard.heldUntil = 0;
+}
+
+String relayGuardsAsJson(const AutoData *autoData, int numberOfRelays){
+  JsonDocument doc;
+  JsonArray relays = doc["relays"].to<JsonArray>();
+  for (int i=0; i<numberOfRelays; i++){
+    const AutoData &ad = autoData[i];
+    JsonObject entry = relays.add<JsonObject>();
+    entry["relay"] = i;
+    entry["minOn"] = ad.minOnSeconds;
+    entry["minOff"] = ad.minOffSeconds;
+    entry["maxPerHour"] = ad.maxSwitchesPerHour;
+    entry["switches"] = ad.guard.switches;
+    entry["suppressedDwell"] = ad.guard.suppressedDwell;
+    entry["suppressedRate"] = ad.guard.suppressedRate;
+  }
+  String returnString;
+  serializeJson(doc, returnString);
+  return returnString;
+}
+
+/*
+The charger fields the relay tests, it only has to be looked at again when one of them changes.
+*/
+ClassicFieldSet relayFields(const AutoData &thisAutoData){
+  if (!thisAutoData.rule.empty()) return thisAutoData.rule.fields();
+  if (thisAutoData.measure == IGNORE) return 0;
+  return (ClassicFieldSet)1 << autoMeasureInfo[thisAutoData.measure].changeBit;
+}
+
+/*
+The relays whose rules are timing a FOR. They have to be looked at again on the next data even when none of their
+measures moved.
+*/
+uint32_t autoRulesWaiting(const AutoData *autoData, int numberOfRelays){
+  uint32_t waiting = 0;
+  for (int i=0; i<numberOfRelays && i<AUTO_MAX_RELAYS; i++){
+    if (autoData[i].rule.waiting()) waiting |= 1UL << i;
+  }
+  return waiting;
+}
+
+void AutoControlIndex::build(const AutoData *autoData, int numberOfRelays){
+  *this = AutoControlIndex();
+  if (numberOfRelays > AUTO_MAX_RELAYS) {
+    Serial.printf("Only the first %d relays can be automatic\n", AUTO_MAX_RELAYS);
+    numberOfRelays = AUTO_MAX_RELAYS;
+  }
+  for (int i=0; i<numberOfRelays; i++){
+    if (!isAutomatic(autoData[i])) continue;
+    _automatic |= 1UL << i;
+    ClassicFieldSet fields = relayFields(autoData[i]);
+    _fields |= fields;
+    for (; fields != 0; fields &= fields - 1){
+      _relaysOf[__builtin_ctzll(fields)] |= 1UL << i;
+    }
+  }
+}
+
+uint32_t AutoControlIndex::relaysFor(ClassicFieldSet changed) const{
+  uint32_t relays = 0;
+  for (changed &= _fields; changed != 0; changed &= changed - 1){
+    relays |= _relaysOf[__builtin_ctzll(changed)];
+  }
+  return relays;
+}
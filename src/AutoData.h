@@ -2,35 +2,102 @@
  * Author:      Matthew C. Sargent
  * Created:     10/18/2024
  * Description: This is intended to group the data structures and code needed to implement the automatic control of the relays
- * based on the data gathered from the Midnite Classic solar controller. Currently, the only parameters that are collected are 
- * listed in the enum "AutoMeasure" but this could be modified to include other measures. If you modify the possible
- * automatic measures, you will need to modify the chargerDataForRelayControl that is gathered by the ModbusStuff code.
+ * based on the data gathered from the Midnite Classic solar controller. The measures a relay can test are listed
+ * in AUTO_MEASURE_MAP, any numeric field of ChargeControllerInfo is published in chargerDataForRelayControl::values,
+ * so making another one available is a line in the map.
+ * When more than one Classic is configured the measures are their combined readings: the PV current is the total,
+ * the voltages are averaged and the SOC is the lowest reported. Battery power, net amp hours and the rates of change
+ * are worked out from those readings by DerivedMeasures.
  * 
  * (c) Copyright by Matthew C. Sargent.
  **/
 
 #include <Arduino.h>
+#include "ChargeControllerInfo.h"
+#include "ClassicRegisterMap.h"
+#include "DerivedMeasures.h"
+#include "RelayRule.h"
 
 #ifndef AUTOMEASURE_H
 #define AUTOMEASURE_H
 
-enum AutoMeasure {
-    SOC=0, BATVOLT=1, BATCURRENT=2, PVVOLT=3, PVCURRENT=4, IGNORE=5 };
+/**
+ * Every reading a relay can be driven by: X(measure, shortName, longName, nearMargin, source). source is the
+ * ClassicField or DerivedField the reading is published as, its index into chargerDataForRelayControl::values
+ * and its bit in changedFields. The shortName is what the relay config stores, so existing ones must not change.
+ * nearMargin is how close a reading has to come to a relay's value or restoreValue to poll faster, 0 for
+ * states and modes that are only ever equal or not. It is the default, a relay can set its own.
+ */
+#define AUTO_MEASURE_MAP(X) \
+    X(SOC,           "SOC",         "SOC",                             2.0,   CLASSIC_FIELD_SOC) \
+    X(BATVOLT,       "BATVOLT",     "Battery Voltage",                 0.3,   CLASSIC_FIELD_BatVoltage) \
+    X(BATCURRENT,    "BATCURRENT",  "Battery Current",                 2.0,   CLASSIC_FIELD_WhizbangBatCurrent) \
+    X(PVVOLT,        "PVVOLT",      "PV Voltage",                      5.0,   CLASSIC_FIELD_PVVoltage) \
+    X(PVCURRENT,     "PVCURRENT",   "PV Current",                      2.0,   CLASSIC_FIELD_PVCurrent) \
+    X(BATPOWER,      "BATPOWER",    "Battery Power (W)",               100.0, DERIVED_FIELD_BatPower) \
+    X(NETAMPHOURS,   "NETAH",       "Net Amp Hours Today",             2.0,   DERIVED_FIELD_NetAmpHours) \
+    X(BATVOLTSLOPE,  "BATVSLOPE",   "Battery Voltage Change (V/h)",    0.2,   DERIVED_FIELD_BatVoltageSlope) \
+    X(SOCSLOPE,      "SOCSLOPE",    "SOC Change (%/h)",                2.0,   DERIVED_FIELD_SOCSlope) \
+    X(CHARGECURRENT, "CHGCURRENT",  "Charge Current",                  2.0,   CLASSIC_FIELD_BatCurrent) \
+    X(POWER,         "POWER",       "Charge Power (W)",                100.0, CLASSIC_FIELD_Power) \
+    X(ENERGYTODAY,   "ENERGYTODAY", "Energy Today (kWh)",              0.2,   CLASSIC_FIELD_EnergyToday) \
+    X(TOTALENERGY,   "TOTALENERGY", "Total Energy (kWh)",              1.0,   CLASSIC_FIELD_TotalEnergy) \
+    X(LASTVOC,       "LASTVOC",     "Last PV Open Circuit Voltage",    5.0,   CLASSIC_FIELD_lastVOC) \
+    X(CHARGESTATE,   "CHARGESTATE", "Charge State",                    0,     CLASSIC_FIELD_ChargeState) \
+    X(RESTREASON,    "RESTREASON",  "Reason For Resting",              0,     CLASSIC_FIELD_ReasonForResting) \
+    X(MPPTMODE,      "MPPTMODE",    "MPPT Mode",                       0,     CLASSIC_FIELD_mpptMode) \
+    X(AUX1,          "AUX1",        "Aux 1 (0/1)",                     0,     CLASSIC_FIELD_Aux1) \
+    X(AUX2,          "AUX2",        "Aux 2 (0/1)",                     0,     CLASSIC_FIELD_Aux2) \
+    X(BATTEMP,       "BATTEMP",     "Battery Temperature",             2.0,   CLASSIC_FIELD_BatTemperature) \
+    X(FETTEMP,       "FETTEMP",     "FET Temperature",                 2.0,   CLASSIC_FIELD_FETTemperature) \
+    X(PCBTEMP,       "PCBTEMP",     "PCB Temperature",                 2.0,   CLASSIC_FIELD_PCBTemperature) \
+    X(SHUNTTEMP,     "SHUNTTEMP",   "Shunt Temperature",               2.0,   CLASSIC_FIELD_ShuntTemperature) \
+    X(FLOATTIME,     "FLOATTIME",   "Float Time Today (s)",            300,   CLASSIC_FIELD_FloatTimeTodaySeconds) \
+    X(ABSORBTIME,    "ABSORBTIME",  "Absorb Time Remaining (s)",       300,   CLASSIC_FIELD_AbsorbTime) \
+    X(EQUALIZETIME,  "EQTIME",      "Equalize Time Remaining (s)",     300,   CLASSIC_FIELD_EqualizeTime) \
+    X(REGVOLT,       "REGVOLT",     "Battery Regulation Voltage",      0.3,   CLASSIC_FIELD_VbattRegSetPTmpComp) \
+    X(ENDINGAMPS,    "ENDINGAMPS",  "Ending Amps",                     1.0,   CLASSIC_FIELD_endingAmps) \
+    X(POSAMPHOURS,   "POSAH",       "Positive Amp Hours",              5.0,   CLASSIC_FIELD_PositiveAmpHours) \
+    X(NEGAMPHOURS,   "NEGAH",       "Negative Amp Hours",              5.0,   CLASSIC_FIELD_NegativeAmpHours) \
+    X(REMAININGAH,   "REMAININGAH", "Remaining Amp Hours",             5.0,   CLASSIC_FIELD_RemainingAmpHours) \
+    X(TOTALAH,       "TOTALAH",     "Total Amp Hours",                 5.0,   CLASSIC_FIELD_TotalAmpHours)
+
+#define AUTO_MEASURE_ENUM(measure, shortName, longName, nearMargin, source) measure,
+enum AutoMeasure { AUTO_MEASURE_MAP(AUTO_MEASURE_ENUM) IGNORE };
+#undef AUTO_MEASURE_ENUM
 
 struct AutoMeasureMatrixItem
 {
     AutoMeasure autoMeasure;
     String shortName;
     String longName;
+    double nearMargin; //a reading this close to a relay's value or restoreValue is near enough to poll faster
+    uint8_t changeBit; //a ClassicField or DerivedField, the reading is chargerDataForRelayControl::values[changeBit]
 };
 
+#define AUTO_MEASURE_INFO(measure, shortName, longName, nearMargin, source) {measure, shortName, longName, nearMargin, source},
 const AutoMeasureMatrixItem autoMeasureInfo[] {
-    {SOC, "SOC","SOC"}, 
-    {BATVOLT, "BATVOLT","Battery Voltage"}, 
-    {BATCURRENT, "BATCURRENT","Battery Current"}, 
-    {PVVOLT,"PVVOLT","PV Voltage"}, 
-    {PVCURRENT, "PVCURRENT","PV Current"},
-    {IGNORE, "IGNORE", "Ignore"}};
+    AUTO_MEASURE_MAP(AUTO_MEASURE_INFO)
+    {IGNORE, "IGNORE", "Ignore", 0, CLASSIC_FIELD_SOC}};
+#undef AUTO_MEASURE_INFO
+
+/**
+ * What keeps an automatic relay from switching too often, and how often it has had to. The counters are
+ * what the hysteresis and dwell settings can be tuned from, see relayGuardsAsJson().
+ */
+struct RelayGuard
+{
+   uint32_t lastSwitch = 0;         //monotonic seconds the relay last changed state, whatever switched it
+   bool switched = false;           //the dwell times only count from a switch made since boot
+   bool on = false;                 //state it was switched to
+   float allowance = -1;            //switches left of maxSwitchesPerHour, refilled as the hour goes by, -1 until first used
+   uint32_t allowanceSecond = 0;    //when allowance was last refilled
+   uint32_t switches = 0;           //switches made by auto control
+   uint32_t suppressedDwell = 0;    //switches held back by minOnSeconds or minOffSeconds
+   uint32_t suppressedRate = 0;     //switches held back by maxSwitchesPerHour
+   uint32_t heldUntil = 0;          //a switch to heldState is held back until then, it is only counted once
+   bool heldState = false;
+};
 
 //Structure to contain the Automated features for each Relay.
 struct AutoData
@@ -38,12 +105,53 @@ struct AutoData
    AutoMeasure measure = IGNORE; //Which measure to test
    double value = 0; //if (relayState = ON and reading >= Value) then relayState reamins On, else relayState = Off
    double restoreValue = 0; //If (relayState = Off AND reading >= restoreValue) then relayState = ON, else relayState remains OFF
+   double nearMargin = -1; //how close the reading has to come to value or restoreValue to poll faster, -1 for the measure's nearMargin
+   RelayRule rule; //when it has a rule the relay follows that instead of measure, value and restoreValue
+   int16_t onAt = -1; //minutes past local midnight the relay is switched on every day, -1 for none
+   int16_t offAt = -1; //minutes past local midnight the relay is switched off every day, -1 for none
+   uint16_t minOnSeconds = 0; //auto control leaves the relay on for at least this long once it is on
+   uint16_t minOffSeconds = 0; //and off for at least this long once it is off
+   uint8_t maxSwitchesPerHour = 0; //0 for no limit
+   RelayGuard guard;
 };
 
 AutoData* AutoControlAllocate(int numberOfRelays);
 AutoMeasure fromString(String theMeasure);
 String asRawJson(AutoData item);
 AutoData fromJson(String rawJson);
-bool autoAdjustSingleRelay(double currentVal, bool currentState, AutoData thisAutoData);
+String minuteOfDayText(int16_t minuteOfDay);
+int16_t minuteOfDayFromText(String text);
+bool autoAdjustSingleRelay(double currentVal, bool currentState, const AutoData &thisAutoData);
+double relayNearMargin(const AutoData &thisAutoData, AutoMeasure measure);
+bool nearThreshold(double currentVal, const AutoData &thisAutoData);
+bool isAutomatic(const AutoData &thisAutoData);
+bool autoAdjustRelay(AutoData &thisAutoData, const chargerDataForRelayControl &cd, bool currentState, unsigned long now);
+bool autoNearThreshold(const AutoData &thisAutoData, const chargerDataForRelayControl &cd);
+double measureValue(AutoMeasure measure, const chargerDataForRelayControl &cd);
+uint32_t relaySwitchHoldOff(AutoData &thisAutoData, bool newState, uint32_t nowSecond, bool &byDwell);
+void relaySwitched(AutoData &thisAutoData, bool on, uint32_t nowSecond);
+String relayGuardsAsJson(const AutoData *autoData, int numberOfRelays);
+ClassicFieldSet relayFields(const AutoData &thisAutoData);
+uint32_t autoRulesWaiting(const AutoData *autoData, int numberOfRelays);
+
+#define AUTO_MAX_RELAYS 32 //relays the dependency index has a bit for
+
+/**
+ * Which relays read which measures, so a sample only has to look at the relays whose inputs changed. Rebuilt
+ * whenever the relay settings change.
+ */
+class AutoControlIndex
+{
+public:
+   void build(const AutoData *autoData, int numberOfRelays);
+   uint32_t relaysFor(ClassicFieldSet changed) const; //relays that read any of the changed fields
+   uint32_t automatic() const { return _automatic; }  //relays that switch by themselves
+   ClassicFieldSet fields() const { return _fields; } //every field a relay reads
+
+private:
+   uint32_t _relaysOf[64] = {0};                       //per change bit, one bit per relay
+   uint32_t _automatic = 0;
+   ClassicFieldSet _fields = 0;
+};
 
 #endif
@@ -0,0 +1,333 @@
+/**
+ * Register map of the Midnite Classic. Every value that is decoded into ChargeControllerInfo is one line of
+ * CLASSIC_REGISTER_MAP, everything else (the size of the register banks that get read, the decoder of each bank)
+ * is worked out from the table at compile time.
+ *
+ * X(bank, address, type, scale, field)
+ *   bank    - register bank the value is read with, see ClassicBank. Each bank is polled at its own rate, so put a
+ *             new value in the bank that changes about as often as it does.
+ *   address - holding register address as it is requested (the Classic documentation numbers them from 1, so this is one less)
+ *   type    - decoder for the raw big-endian words, see the Reg* types below
+ *   scale   - the raw value is divided by this, 1 for none
+ *   field   - member of ChargeControllerInfo that receives the value
+ */
+
+#ifndef CLASSICREGISTERMAP_H
+#define CLASSICREGISTERMAP_H
+
+#include <Arduino.h>
+#include <type_traits>
+#include "ChargeControllerInfo.h"
+
+enum ClassicBank : uint8_t {
+    BANK_IDENTITY = 0,      //model, build date, MAC, unit id
+    BANK_LIVE = 1,          //battery and PV volts/amps, power, charge state
+    BANK_TEMPERATURE = 2,   //temperatures and charge stage timers
+    BANK_MPPT = 3,          //MPPT mode and aux functions (whizbang jr. fitted)
+    BANK_SETPOINTS = 4,     //battery set points, reason for resting
+    BANK_WHIZBANG = 5,      //whizbang jr. SOC, current and amp hours
+    BANK_VERSION = 6,       //firmware versions
+    CLASSIC_BANK_COUNT = 7 };
+
+#define CLASSIC_REGISTER_MAP(X) \
+    X(BANK_IDENTITY,    4100,  RegModel,        1,    model) \
+    X(BANK_IDENTITY,    4101,  RegBuildDate,    1,    buildDate) \
+    X(BANK_IDENTITY,    4105,  RegMacAddress,   1,    macAddress) \
+    X(BANK_IDENTITY,    4110,  RegU32,          1,    unitID) \
+    X(BANK_LIVE,        4114,  RegS16,          10.0, BatVoltage) \
+    X(BANK_LIVE,        4115,  RegS16,          10.0, PVVoltage) \
+    X(BANK_LIVE,        4116,  RegS16,          10.0, BatCurrent) \
+    X(BANK_LIVE,        4117,  RegS16,          10.0, EnergyToday) \
+    X(BANK_LIVE,        4118,  RegS16,          1,    Power) \
+    X(BANK_LIVE,        4119,  RegMSB,          1,    ChargeState) \
+    X(BANK_LIVE,        4120,  RegS16,          10.0, PVCurrent) \
+    X(BANK_LIVE,        4121,  RegS16,          10.0, lastVOC) \
+    X(BANK_LIVE,        4125,  RegU32,          10.0, TotalEnergy) \
+    X(BANK_LIVE,        4129,  RegU32,          1,    InfoFlagsBits) \
+    X(BANK_LIVE,        4129,  RegFlag<0x4000>, 1,    Aux1) \
+    X(BANK_LIVE,        4129,  RegFlag<0x8000>, 1,    Aux2) \
+    X(BANK_TEMPERATURE, 4131,  RegS16,          10.0, BatTemperature) \
+    X(BANK_TEMPERATURE, 4132,  RegS16,          10.0, FETTemperature) \
+    X(BANK_TEMPERATURE, 4133,  RegS16,          10.0, PCBTemperature) \
+    X(BANK_TEMPERATURE, 4137,  RegU16,          1,    FloatTimeTodaySeconds) \
+    X(BANK_TEMPERATURE, 4138,  RegU16,          1,    AbsorbTime) \
+    X(BANK_TEMPERATURE, 4142,  RegU16,          1,    EqualizeTime) \
+    X(BANK_MPPT,        4163,  RegU16,          1,    mpptMode) \
+    X(BANK_MPPT,        4164,  RegWhizbang,     1,    hasWhizbang) \
+    X(BANK_SETPOINTS,   4243,  RegS16,          10.0, VbattRegSetPTmpComp) \
+    X(BANK_SETPOINTS,   4244,  RegU16,          1,    nominalBatteryVoltage) \
+    X(BANK_SETPOINTS,   4245,  RegS16,          10.0, endingAmps) \
+    X(BANK_SETPOINTS,   4274,  RegU16,          1,    ReasonForResting) \
+    X(BANK_WHIZBANG,    4364,  RegU32,          1,    PositiveAmpHours) \
+    X(BANK_WHIZBANG,    4366,  RegAbsU32,       1,    NegativeAmpHours) \
+    X(BANK_WHIZBANG,    4370,  RegS16,          10.0, WhizbangBatCurrent) \
+    X(BANK_WHIZBANG,    4371,  RegShuntTemp,    1,    ShuntTemperature) \
+    X(BANK_WHIZBANG,    4372,  RegU16,          1,    SOC) \
+    X(BANK_WHIZBANG,    4376,  RegU16,          1,    RemainingAmpHours) \
+    X(BANK_WHIZBANG,    4380,  RegU16,          1,    TotalAmpHours) \
+    X(BANK_VERSION,     16386, RegVersion,      1,    appVersion) \
+    X(BANK_VERSION,     16388, RegVersion,      1,    netVersion)
+
+inline uint16_t regWord(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+//32 bit values are sent low word first.
+inline uint32_t regDWord(const uint8_t *p)
+{
+    return (uint32_t)regWord(p + 2) << 16 | regWord(p);
+}
+
+struct RegU16
+{
+    static constexpr uint8_t words = 1;
+    template <typename T> static void decode(T &field, const uint8_t *p, float scale) { field = (scale == 1) ? (T)regWord(p) : (T)(regWord(p) / scale); }
+};
+
+struct RegS16
+{
+    static constexpr uint8_t words = 1;
+    template <typename T> static void decode(T &field, const uint8_t *p, float scale) { field = (int16_t)regWord(p) / scale; }
+};
+
+struct RegU32
+{
+    static constexpr uint8_t words = 2;
+    template <typename T> static void decode(T &field, const uint8_t *p, float scale) { field = (scale == 1) ? (T)regDWord(p) : (T)(regDWord(p) / scale); }
+};
+
+struct RegAbsU32
+{
+    static constexpr uint8_t words = 2;
+    template <typename T> static void decode(T &field, const uint8_t *p, float scale) { field = abs((int32_t)regDWord(p)); }
+};
+
+//Most significant byte only
+struct RegMSB
+{
+    static constexpr uint8_t words = 1;
+    template <typename T> static void decode(T &field, const uint8_t *p, float scale) { field = p[0]; }
+};
+
+template <uint16_t MASK>
+struct RegFlag
+{
+    static constexpr uint8_t words = 1;
+    static void decode(bool &field, const uint8_t *p, float scale) { field = (regWord(p) & MASK) != 0; }
+};
+
+//Whizbang Jr. fitted when the Aux 1/2 function in the high byte is 18
+struct RegWhizbang
+{
+    static constexpr uint8_t words = 1;
+    static void decode(bool &field, const uint8_t *p, float scale) { field = ((regWord(p) & 0x3f00) >> 8) == 18; }
+};
+
+//Low byte is the temperature + 50
+struct RegShuntTemp
+{
+    static constexpr uint8_t words = 1;
+    static void decode(float &field, const uint8_t *p, float scale) { field = (regWord(p) & 0x00ff) - 50.0f; }
+};
+
+struct RegModel
+{
+    static constexpr uint8_t words = 1;
+    static void decode(String &field, const uint8_t *p, float scale)
+    {
+        uint16_t reg = regWord(p);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "Classic %d (rev %d)", reg & 0x00ff, reg >> 8);
+        field = buf;
+    }
+};
+
+//Year followed by month (high byte) and day (low byte)
+struct RegBuildDate
+{
+    static constexpr uint8_t words = 2;
+    static void decode(String &field, const uint8_t *p, float scale)
+    {
+        uint16_t buildMonthDay = regWord(p + 2);
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d%02d%02d", regWord(p), (buildMonthDay >> 8), (buildMonthDay & 0x00ff));
+        field = buf;
+    }
+};
+
+//Three words, last word holds the first two bytes of the MAC
+struct RegMacAddress
+{
+    static constexpr uint8_t words = 3;
+    static void decode(String &field, const uint8_t *p, float scale)
+    {
+        char mac[32];
+        snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x", p[4], p[5], p[2], p[3], p[0], p[1]);
+        field = mac;
+    }
+};
+
+struct RegVersion
+{
+    static constexpr uint8_t words = 2;
+    static void decode(String &field, const uint8_t *p, float scale)
+    {
+        char unit[16];
+        snprintf(unit, sizeof(unit), "%d", (int32_t)regDWord(p));
+        field = unit;
+    }
+};
+
+/**
+ * The address and size of each table entry, used to work out the extent of the register banks.
+ */
+struct ClassicRegisterDescriptor
+{
+    uint8_t bank;
+    uint16_t address;
+    uint8_t words;
+};
+
+#define CLASSIC_REGISTER_DESCRIPTOR(bank, address, type, scale, field) {bank, address, type::words},
+constexpr ClassicRegisterDescriptor classicRegisterDescriptors[] = {CLASSIC_REGISTER_MAP(CLASSIC_REGISTER_DESCRIPTOR)};
+#undef CLASSIC_REGISTER_DESCRIPTOR
+
+constexpr int classicRegisterCount = sizeof(classicRegisterDescriptors) / sizeof(classicRegisterDescriptors[0]);
+
+//First register of a bank
+constexpr uint16_t classicBankStart(uint8_t bank)
+{
+    uint16_t start = 0xFFFF;
+    for (int i = 0; i < classicRegisterCount; i++)
+    {
+        if (classicRegisterDescriptors[i].bank == bank && classicRegisterDescriptors[i].address < start) start = classicRegisterDescriptors[i].address;
+    }
+    return start;
+}
+
+//Number of registers from the first to the end of the last value in a bank
+constexpr uint16_t classicBankCount(uint8_t bank)
+{
+    uint16_t end = 0;
+    for (int i = 0; i < classicRegisterCount; i++)
+    {
+        const ClassicRegisterDescriptor &r = classicRegisterDescriptors[i];
+        if (r.bank == bank && r.address + r.words > end) end = r.address + r.words;
+    }
+    return end - classicBankStart(bank);
+}
+
+//Where a bank's registers sit in the register image, the banks are laid out one after the other in ClassicBank order
+constexpr uint16_t classicImageOffset(uint8_t bank)
+{
+    uint16_t offset = 0;
+    for (uint8_t b = 0; b < bank; b++) offset += classicBankCount(b);
+    return offset;
+}
+
+constexpr uint16_t classicImageRegisters = classicImageOffset(CLASSIC_BANK_COUNT);
+
+/**
+ * One value per entry of CLASSIC_REGISTER_MAP, named after the ChargeControllerInfo member it is decoded into.
+ * A ClassicFieldSet has a bit for each, so what has been decoded can be tracked field by field.
+ */
+#define CLASSIC_FIELD_ENUM(bank, address, type, scale, field) CLASSIC_FIELD_##field,
+enum ClassicField : uint8_t { CLASSIC_REGISTER_MAP(CLASSIC_FIELD_ENUM) CLASSIC_FIELD_COUNT };
+#undef CLASSIC_FIELD_ENUM
+static_assert(CLASSIC_FIELD_COUNT <= 64, "a ClassicFieldSet has one bit per field");
+
+typedef uint64_t ClassicFieldSet;
+
+constexpr ClassicFieldSet classicFieldBit(ClassicField field)
+{
+    return (ClassicFieldSet)1 << field;
+}
+
+constexpr ClassicFieldSet classicAllFields = (CLASSIC_FIELD_COUNT == 64) ? ~(ClassicFieldSet)0 : classicFieldBit(CLASSIC_FIELD_COUNT) - 1;
+
+//The fields read with a bank, the descriptors are in ClassicField order
+constexpr ClassicFieldSet classicBankFields(uint8_t bank)
+{
+    ClassicFieldSet fields = 0;
+    for (int i = 0; i < classicRegisterCount; i++)
+    {
+        if (classicRegisterDescriptors[i].bank == bank) fields |= classicFieldBit((ClassicField)i);
+    }
+    return fields;
+}
+
+/**
+ * The fields of a bank whose registers differ between two copies of the bank. Fields that share a register
+ * (the flags of InfoFlagsBits) all count as changed when the register does.
+ */
+inline ClassicFieldSet classicChangedFields(uint8_t bank, const uint8_t *before, const uint8_t *after)
+{
+    if (memcmp(before, after, 2 * classicBankCount(bank)) == 0) return 0;
+    uint16_t start = classicBankStart(bank);
+    ClassicFieldSet changed = 0;
+    for (int i = 0; i < classicRegisterCount; i++)
+    {
+        const ClassicRegisterDescriptor &r = classicRegisterDescriptors[i];
+        uint16_t offset = 2 * (r.address - start);
+        if (r.bank == bank && memcmp(before + offset, after + offset, 2 * r.words) != 0) changed |= classicFieldBit((ClassicField)i);
+    }
+    return changed;
+}
+
+#define CLASSIC_FIELD_NAME(bank, address, type, scale, field) #field,
+constexpr const char *classicFieldNames[] = {CLASSIC_REGISTER_MAP(CLASSIC_FIELD_NAME)};
+#undef CLASSIC_FIELD_NAME
+
+/**
+ * The value of a field as a number, for the fields that are numbers (the identity and version strings are not).
+ */
+typedef double (*ClassicFieldValue)(const ChargeControllerInfo &info);
+
+template <typename T>
+inline double classicNumber(const T &value)
+{
+    if constexpr (std::is_arithmetic<T>::value) return value;
+    else return 0;
+}
+
+#define CLASSIC_FIELD_VALUE(bank, address, type, scale, field) \
+    [](const ChargeControllerInfo &info) -> double { return classicNumber(info.field); },
+constexpr ClassicFieldValue classicFieldValues[] = {CLASSIC_REGISTER_MAP(CLASSIC_FIELD_VALUE)};
+#undef CLASSIC_FIELD_VALUE
+
+#define CLASSIC_FIELD_NUMERIC(bank, address, type, scale, field) \
+    | (std::is_arithmetic<decltype(ChargeControllerInfo::field)>::value ? classicFieldBit(CLASSIC_FIELD_##field) : 0)
+constexpr ClassicFieldSet classicNumericFields = 0 CLASSIC_REGISTER_MAP(CLASSIC_FIELD_NUMERIC);
+#undef CLASSIC_FIELD_NUMERIC
+
+/**
+ * Decoder for a single field, reads its registers straight out of a register image laid out by
+ * classicImageOffset(). Used to decode only the fields that are asked for, when they are asked for.
+ */
+typedef void (*ClassicFieldDecoder)(const uint8_t *image, ChargeControllerInfo &info);
+
+#define CLASSIC_FIELD_DECODER(bank, address, type, scale, field)                                     \
+    [](const uint8_t *image, ChargeControllerInfo &info) {                                          \
+        type::decode(info.field, image + 2 * (classicImageOffset(bank) + address - classicBankStart(bank)), scale); \
+    },
+constexpr ClassicFieldDecoder classicFieldDecoders[] = {CLASSIC_REGISTER_MAP(CLASSIC_FIELD_DECODER)};
+#undef CLASSIC_FIELD_DECODER
+
+/**
+ * Decoder for one register bank, generated from CLASSIC_REGISTER_MAP. Only the entries of the bank are
+ * compiled in, so the response is decoded in a single pass with no lookups.
+ */
+template <uint8_t BANK>
+void decodeClassicBank(const uint8_t *data, ChargeControllerInfo &info)
+{
+#define DECODE_REGISTER(bank, address, type, scale, field)                                    \
+    if constexpr (bank == BANK)                                                               \
+    {                                                                                         \
+        type::decode(info.field, data + 2 * (address - classicBankStart(BANK)), scale);       \
+    }
+    CLASSIC_REGISTER_MAP(DECODE_REGISTER)
+#undef DECODE_REGISTER
+}
+
+#endif
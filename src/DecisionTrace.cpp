@@ -0,0 +1,61 @@
+#include <Arduino.h>
+#include <time.h>
+#include "DecisionTrace.h"
+
+static_assert((DECISION_TRACE_RECORDS & (DECISION_TRACE_RECORDS - 1)) == 0, "DECISION_TRACE_RECORDS has to be a power of two");
+
+DecisionTrace decisionTrace;
+
+void DecisionTrace::record(DecisionRecord &record)
+{
+   portENTER_CRITICAL(&_lock);
+   record.number = _next;
+   _records[_next & (DECISION_TRACE_RECORDS - 1)] = record;
+   _next = _next + 1;
+   portEXIT_CRITICAL(&_lock);
+}
+
+DecisionTraceHeader DecisionTrace::header(uint32_t since) const
+{
+   DecisionTraceHeader h;
+   h.magic = DECISION_TRACE_MAGIC;
+   h.version = DECISION_TRACE_VERSION;
+   h.recordSize = sizeof(DecisionRecord);
+   uint32_t next = _next;
+   uint32_t oldest = next > DECISION_TRACE_RECORDS ? next - DECISION_TRACE_RECORDS : 0;
+   h.first = constrain(since, oldest, next);
+   h.count = next - h.first;
+   h.millis = millis();
+   time_t now = time(NULL);
+   h.time = now > 1000000000 ? (uint32_t)now : 0;
+   return h;
+}
+
+size_t DecisionTrace::read(const DecisionTraceHeader &header, size_t offset, uint8_t *buffer, size_t maxLen) const
+{
+   size_t total = sizeof(header) + (size_t)header.count * sizeof(DecisionRecord);
+   size_t copied = 0;
+   while (copied < maxLen && offset < total)
+   {
+      size_t n;
+      if (offset < sizeof(header))
+      {
+         n = min(maxLen - copied, sizeof(header) - offset);
+         memcpy(buffer + copied, (const uint8_t *)&header + offset, n);
+      }
+      else
+      {
+         //A record at a time, so the lock is only held for the copy of one
+         size_t at = offset - sizeof(header);
+         uint32_t number = header.first + at / sizeof(DecisionRecord);
+         size_t within = at % sizeof(DecisionRecord);
+         n = min(maxLen - copied, sizeof(DecisionRecord) - within);
+         portENTER_CRITICAL(&_lock);
+         memcpy(buffer + copied, (const uint8_t *)&_records[number & (DECISION_TRACE_RECORDS - 1)] + within, n);
+         portEXIT_CRITICAL(&_lock);
+      }
+      copied += n;
+      offset += n;
+   }
+   return copied;
+}
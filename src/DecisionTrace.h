@@ -0,0 +1,90 @@
+/**
+ * What auto control decided for each relay it looked at, kept in a fixed ring of binary records so the control
+ * path does no formatting and no I/O: recording one is a copy into the ring under a short lock. The ring is
+ * read through /decisiontrace as the raw records and decoded off the device, tools/decision_trace/decision_trace.py does it.
+ *
+ * The stream is a DecisionTraceHeader followed by its count of DecisionRecords, little endian and packed as
+ * declared. The records are numbered as they are made, a reader that is overtaken by the writer gets newer
+ * records than it asked for in some places, their numbers tell it which.
+ */
+
+#ifndef DECISIONTRACE_H
+#define DECISIONTRACE_H
+
+#include <Arduino.h>
+
+#ifndef DECISION_TRACE_RECORDS
+#define DECISION_TRACE_RECORDS 256          //power of two, the decisions kept
+#endif
+#define DECISION_TRACE_MAGIC 0x43525444     //"DTRC"
+#define DECISION_TRACE_VERSION 1
+#define DECISION_MEASURE_RULE 0xFF          //DecisionRecord::measure of a relay that follows a rule
+
+enum DecisionOutcome : uint8_t {
+    DECISION_KEPT = 0,                      //already in the state it should be in
+    DECISION_SWITCHED = 1,
+    DECISION_HELD_DWELL = 2,                //held back by minOnSeconds or minOffSeconds
+    DECISION_HELD_RATE = 3 };               //held back by maxSwitchesPerHour
+
+#define DECISION_STATE_BEFORE 0x01          //DecisionRecord::state bits
+#define DECISION_STATE_WANTED 0x02
+#define DECISION_STATE_AFTER 0x04
+
+struct DecisionRecord
+{
+   uint32_t number;                         //count of the decisions made before it
+   uint32_t millis;                         //ms since boot
+   float reading;                           //of the measure, NAN for a rule
+   float value;                             //the relay's value and restoreValue, NAN for a rule
+   float restoreValue;
+   uint32_t holdOff;                        //seconds until a held back switch is allowed
+   uint8_t relay;
+   uint8_t measure;                         //AutoMeasure, or DECISION_MEASURE_RULE
+   uint8_t state;                           //DECISION_STATE_ bits
+   uint8_t outcome;                         //DecisionOutcome
+};
+
+struct DecisionTraceHeader
+{
+   uint32_t magic;
+   uint16_t version;
+   uint16_t recordSize;                     //sizeof(DecisionRecord)
+   uint32_t first;                          //number of the first record that follows
+   uint32_t count;
+   uint32_t millis;                         //ms since boot when it was read, lines the records up with time
+   uint32_t time;                           //seconds since 1970 at the same moment, 0 before the clock is set
+};
+
+static_assert(sizeof(DecisionRecord) == 28, "the decoder expects 28 byte records");
+static_assert(sizeof(DecisionTraceHeader) == 24, "the decoder expects a 24 byte header");
+
+class DecisionTrace
+{
+public:
+   /**
+    * Numbers record and copies it into the ring over the oldest one. Safe from any task.
+    */
+   void record(DecisionRecord &record);
+
+   uint32_t recorded() const { return _next; }         //decisions made since boot
+
+   /**
+    * Header for the records from number since on, as many of them as the ring still holds.
+    */
+   DecisionTraceHeader header(uint32_t since) const;
+
+   /**
+    * Copies up to maxLen bytes of the stream that starts with header, from byte offset on. Returns the bytes
+    * copied, 0 past the end. Made to be called piece by piece as a response is sent.
+    */
+   size_t read(const DecisionTraceHeader &header, size_t offset, uint8_t *buffer, size_t maxLen) const;
+
+private:
+   DecisionRecord _records[DECISION_TRACE_RECORDS];
+   volatile uint32_t _next = 0;             //number the next record gets
+   mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+extern DecisionTrace decisionTrace;
+
+#endif
@@ -0,0 +1,78 @@
+#include <Arduino.h>
+#include <math.h>
+#include <time.h>
+#include "DerivedMeasures.h"
+
+void WeightedSlope::add(double seconds, double value)
+{
+   if (_samples > 0)
+   {
+      //Move the time origin to the new sample, then age everything that was there before it
+      _sumTT -= 2 * seconds * _sumT - seconds * seconds * _weight;
+      _sumTX -= seconds * _sumX;
+      _sumT -= seconds * _weight;
+      double decay = exp(-seconds / DERIVED_SLOPE_WINDOW);
+      _weight *= decay;
+      _sumT *= decay;
+      _sumTT *= decay;
+      _sumX *= decay;
+      _sumTX *= decay;
+   }
+   _weight += 1;
+   _sumX += value;
+   _samples++;
+}
+
+double WeightedSlope::perHour() const
+{
+   double spread = _weight * _sumTT - _sumT * _sumT;
+   if (_samples < 2 || spread <= 1e-9) return 0;
+   return 3600 * (_weight * _sumTX - _sumT * _sumX) / spread;
+}
+
+void WeightedSlope::clear()
+{
+   *this = WeightedSlope();
+}
+
+//Stores the value and sets its change bit if it moved since it was last published
+static inline void setDerived(chargerDataForRelayControl &cd, DerivedField field, float value, float last)
+{
+   cd.values[field] = value;
+   if (value != last) cd.changedFields |= (ClassicFieldSet)1 << field;
+}
+
+void DerivedMeasures::update(chargerDataForRelayControl &cd)
+{
+   double seconds = _started ? (cd.gatherMillis - _lastMillis) / 1000.0 : 0;
+
+   //Net amp hours run from local midnight, like the Classic's energy today
+   struct tm local;
+   localtime_r(&cd.timeDataWasGathered, &local);
+   if (local.tm_year > (2016 - 1900))
+   {
+      int day = local.tm_yday;
+      if (_day != -1 && day != _day) _netAmpHours = 0;
+      _day = day;
+   }
+   if (_started && seconds <= DERIVED_MAX_GAP)
+   {
+      _netAmpHours += (_lastCurrent + cd.BatCurrent) / 2 * seconds / 3600;
+   }
+   _batVoltage.add(seconds, cd.BatVoltage);
+   _soc.add(seconds, cd.SOC);
+   _lastCurrent = cd.BatCurrent;
+   _lastMillis = cd.gatherMillis;
+   _started = true;
+
+   setDerived(cd, DERIVED_FIELD_BatPower, cd.BatVoltage * cd.BatCurrent, _last[DERIVED_FIELD_BatPower - CLASSIC_FIELD_COUNT]);
+   setDerived(cd, DERIVED_FIELD_NetAmpHours, _netAmpHours, _last[DERIVED_FIELD_NetAmpHours - CLASSIC_FIELD_COUNT]);
+   setDerived(cd, DERIVED_FIELD_BatVoltageSlope, _batVoltage.perHour(), _last[DERIVED_FIELD_BatVoltageSlope - CLASSIC_FIELD_COUNT]);
+   setDerived(cd, DERIVED_FIELD_SOCSlope, _soc.perHour(), _last[DERIVED_FIELD_SOCSlope - CLASSIC_FIELD_COUNT]);
+   memcpy(_last, &cd.values[CLASSIC_FIELD_COUNT], sizeof(_last));
+}
+
+void DerivedMeasures::clear()
+{
+   *this = DerivedMeasures();
+}
@@ -0,0 +1,76 @@
+/**
+ * Measures worked out from the published charger data rather than read from a register: battery power, the
+ * net amp hours that went into the battery today and how fast the battery voltage and the SOC are moving.
+ * Each sample updates them in constant time, nothing is kept but a few running sums.
+ *
+ * The slopes are least squares fits over the recent samples, weighted so a sample counts for less the older
+ * it is (1/e at DERIVED_SLOPE_WINDOW). That keeps a single noisy reading from swinging them while still
+ * following a change of trend within a few minutes.
+ */
+
+#ifndef DERIVEDMEASURES_H
+#define DERIVEDMEASURES_H
+
+#include <Arduino.h>
+#include "ChargeControllerInfo.h"
+#include "ClassicRegisterMap.h"
+
+#define DERIVED_SLOPE_WINDOW 900            //seconds, age at which a sample weighs 1/e in the slopes
+#define DERIVED_MAX_GAP 600                 //seconds, the battery current is not integrated over a longer gap between samples
+
+/**
+ * Change bits of the derived measures in chargerDataForRelayControl::changedFields, after those of the
+ * Classic's fields.
+ */
+enum DerivedField : uint8_t {
+    DERIVED_FIELD_BatPower = CLASSIC_FIELD_COUNT,
+    DERIVED_FIELD_NetAmpHours,
+    DERIVED_FIELD_BatVoltageSlope,
+    DERIVED_FIELD_SOCSlope,
+    DERIVED_FIELD_END };
+static_assert(DERIVED_FIELD_END <= 64 && DERIVED_FIELD_END <= CHARGER_DATA_VALUES, "the derived measures need a bit each in a ClassicFieldSet");
+
+constexpr ClassicFieldSet derivedFields = (DERIVED_FIELD_END == 64 ? ~(ClassicFieldSet)0 : ((ClassicFieldSet)1 << DERIVED_FIELD_END) - 1) & ~classicAllFields;
+
+/**
+ * Exponentially weighted least squares slope of a value against time. Times are kept relative to the newest
+ * sample so the sums stay small however long it runs.
+ */
+class WeightedSlope
+{
+public:
+   void add(double seconds, double value);  //seconds since the previous sample
+   double perHour() const;
+   void clear();
+
+private:
+   double _weight = 0;
+   double _sumT = 0;
+   double _sumTT = 0;
+   double _sumX = 0;
+   double _sumTX = 0;
+   uint32_t _samples = 0;
+};
+
+class DerivedMeasures
+{
+public:
+   /**
+    * Works the derived measures out from the sample in cd and fills in their entries of cd.values, setting
+    * the change bit of each one that moved.
+    */
+   void update(chargerDataForRelayControl &cd);
+   void clear();
+
+private:
+   WeightedSlope _batVoltage;
+   WeightedSlope _soc;
+   double _netAmpHours = 0;
+   double _lastCurrent = 0;
+   unsigned long _lastMillis = 0;
+   int _day = -1;                           //local day of the year the net amp hours are for, -1 before the clock is set
+   bool _started = false;
+   float _last[DERIVED_FIELD_END - CLASSIC_FIELD_COUNT] = {0}; //derived values as last published
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <esp_rom_crc.h>
+#include "Log.h"
+#include "FlashLog.h"
+#include "TimeSeries.h"
+
+FlashLog flashLog;
+
+//Records start on a 4 byte boundary so a FLASHLOG_SAMPLES payload can be read in place as a TimeSeriesBlock
+static inline uint32_t recordSize(uint16_t length)
+{
+   return (sizeof(FlashLogRecord) + length + 3) & ~3u;
+}
+
+static uint32_t recordCrc(const FlashLogRecord &r, const void *payload)
+{
+   uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&r, offsetof(FlashLogRecord, crc));
+   return esp_rom_crc32_le(crc, (const uint8_t *)payload, r.length);
+}
+
+static uint32_t headerCrc(const FlashLogSegmentHeader &h)
+{
+   return esp_rom_crc32_le(0, (const uint8_t *)&h, offsetof(FlashLogSegmentHeader, crc));
+}
+
+//Time of the last thing the record covers, a block of samples runs on past the time it was started
+static uint32_t recordEndTime(const FlashLogRecord &r, const uint8_t *payload)
+{
+   if (r.type == FLASHLOG_SAMPLES) return ((const TimeSeriesBlock *)payload)->endTime;
+   return r.time;
+}
+
+const FlashLogSegmentHeader *FlashLog::header(uint16_t segment) const
+{
+   return (const FlashLogSegmentHeader *)(_base + (uint32_t)segment * FLASHLOG_SEGMENT_SIZE);
+}
+
+bool FlashLog::headerValid(uint16_t segment) const
+{
+   const FlashLogSegmentHeader *h = header(segment);
+   return h->magic == FLASHLOG_SEGMENT_MAGIC && h->crc == headerCrc(*h);
+}
+
+bool FlashLog::begin()
+{
+   if (_base != NULL) return true;
+   if (_lock == NULL) _lock = xSemaphoreCreateMutex();
+
+   _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)FLASHLOG_PARTITION_SUBTYPE, FLASHLOG_PARTITION_LABEL);
+   if (_partition == NULL)
+   {
+      loge("No %s partition, history will not be kept over a restart", FLASHLOG_PARTITION_LABEL);
+      _error = "no history partition in the partition table, it is only changed by flashing over USB";
+      return false;
+   }
+   _segments = _partition->size / FLASHLOG_SEGMENT_SIZE;
+   if (_segments < 2)
+   {
+      loge("The %s partition is too small", FLASHLOG_PARTITION_LABEL);
+      _error = "history partition too small";
+      return false;
+   }
+   const void *mapped;
+   esp_err_t err = esp_partition_mmap(_partition, 0, (uint32_t)_segments * FLASHLOG_SEGMENT_SIZE, SPI_FLASH_MMAP_DATA, &mapped, &_mmapHandle);
+   if (err != ESP_OK)
+   {
+      loge("Not able to map the %s partition, err=%d", FLASHLOG_PARTITION_LABEL, err);
+      _error = "history partition could not be mapped";
+      return false;
+   }
+   _base = (const uint8_t *)mapped;
+   _error = NULL;
+
+   //The segment with the highest sequence was being written when we went down.
+   bool found = false;
+   for (uint16_t s = 0; s < _segments; s++)
+   {
+      if (!headerValid(s)) continue;
+      const FlashLogSegmentHeader *h = header(s);
+      if (!found || h->sequence > _sequence)
+      {
+         _current = s;
+         _sequence = h->sequence;
+         found = true;
+      }
+      if (h->eraseCount > _maxEraseCount) _maxEraseCount = h->eraseCount;
+   }
+
+   xSemaphoreTake(_lock, portMAX_DELAY);
+   bool ok = true;
+   if (!found)
+   {
+      ok = startSegment(0);
+   }
+   else
+   {
+      bool torn = false;
+      _offset = scanSegment(_current, torn);
+      if (torn)
+      {
+         //Whatever follows the bad record can not be written over without an erase, carry on in the next segment.
+         _recovered++;
+         logd("Torn record in history segment %d at %d, moving on", _current, _offset);
+         ok = startSegment((_current + 1) % _segments);
+      }
+   }
+   xSemaphoreGive(_lock);
+   logd("History log: %d segments, current %d, sequence %d, offset %d", _segments, _current, _sequence, _offset);
+   return ok;
+}
+
+/**
+ * Erases the segment and writes its header. Called with _lock held.
+ */
+bool FlashLog::startSegment(uint16_t segment)
+{
+   FlashLogSegmentHeader h;
+   h.magic = FLASHLOG_SEGMENT_MAGIC;
+   h.sequence = _sequence + 1;
+   h.eraseCount = headerValid(segment) ? header(segment)->eraseCount + 1 : 1;
+   h.crc = headerCrc(h);
+
+   uint32_t address = (uint32_t)segment * FLASHLOG_SEGMENT_SIZE;
+   esp_err_t err = esp_partition_erase_range(_partition, address, FLASHLOG_SEGMENT_SIZE);
+   if (err == ESP_OK) err = esp_partition_write(_partition, address, &h, sizeof(h));
+   if (err != ESP_OK)
+   {
+      loge("Not able to start history segment %d, err=%d", segment, err);
+      return false;
+   }
+   _current = segment;
+   _sequence = h.sequence;
+   _offset = sizeof(FlashLogSegmentHeader);
+   if (h.eraseCount > _maxEraseCount) _maxEraseCount = h.eraseCount;
+   return true;
+}
+
+/**
+ * Offset just past the last good record of the segment. torn is set when it ends on a record that
+ * does not check out rather than on erased flash.
+ */
+uint32_t FlashLog::scanSegment(uint16_t segment, bool &torn) const
+{
+   const uint8_t *base = _base + (uint32_t)segment * FLASHLOG_SEGMENT_SIZE;
+   uint32_t offset = sizeof(FlashLogSegmentHeader);
+   torn = false;
+   while (offset + sizeof(FlashLogRecord) <= FLASHLOG_SEGMENT_SIZE)
+   {
+      const FlashLogRecord *r = (const FlashLogRecord *)(base + offset);
+      if (r->length == 0xFFFF && r->type == 0xFF) break;
+      uint32_t size = recordSize(r->length);
+      if (offset + size > FLASHLOG_SEGMENT_SIZE || r->crc != recordCrc(*r, r + 1))
+      {
+         torn = true;
+         break;
+      }
+      offset += size;
+   }
+   return offset;
+}
+
+bool FlashLog::append(FlashLogRecordType type, uint32_t time, const void *payload, uint16_t length)
+{
+   if (_base == NULL) return false;
+   uint32_t size = recordSize(length);
+   if (size > FLASHLOG_SEGMENT_SIZE - sizeof(FlashLogSegmentHeader)) return false;
+
+   FlashLogRecord r;
+   r.length = length;
+   r.type = type;
+   r.reserved = 0;
+   r.time = time;
+   r.crc = recordCrc(r, payload);
+
+   xSemaphoreTake(_lock, portMAX_DELAY);
+   bool ok = true;
+   if (_offset + size > FLASHLOG_SEGMENT_SIZE)
+   {
+      ok = startSegment((_current + 1) % _segments);
+   }
+   if (ok)
+   {
+      uint32_t address = (uint32_t)_current * FLASHLOG_SEGMENT_SIZE + _offset;
+      esp_err_t err = esp_partition_write(_partition, address, &r, sizeof(r));
+      if (err == ESP_OK) err = esp_partition_write(_partition, address + sizeof(r), payload, length);
+      //Move past it even when the write failed, the bytes may be half programmed.
+      _offset += size;
+      if (err != ESP_OK)
+      {
+         loge("History write failed, err=%d", err);
+         ok = false;
+      }
+   }
+   xSemaphoreGive(_lock);
+   return ok;
+}
+
+uint32_t FlashLog::query(FlashLogRecordType type, uint32_t from, uint32_t to, std::function<bool(const FlashLogRecord &, const uint8_t *payload)> func)
+{
+   if (_base == NULL) return 0;
+   uint32_t visited = 0;
+   xSemaphoreTake(_lock, portMAX_DELAY);
+   //Segments are written in ring order, the one after the current is the oldest.
+   for (uint16_t n = 1; n <= _segments; n++)
+   {
+      uint16_t segment = (_current + n) % _segments;
+      if (!headerValid(segment)) continue;
+      const uint8_t *base = _base + (uint32_t)segment * FLASHLOG_SEGMENT_SIZE;
+      uint32_t end = (segment == _current) ? _offset : FLASHLOG_SEGMENT_SIZE;
+      uint32_t offset = sizeof(FlashLogSegmentHeader);
+      while (offset + sizeof(FlashLogRecord) <= end)
+      {
+         const FlashLogRecord *r = (const FlashLogRecord *)(base + offset);
+         if (r->length == 0xFFFF && r->type == 0xFF) break;
+         uint32_t size = recordSize(r->length);
+         if (offset + size > end || r->crc != recordCrc(*r, r + 1)) break;
+         offset += size;
+
+         const uint8_t *payload = (const uint8_t *)(r + 1);
+         if (r->type != type || r->time > to || recordEndTime(*r, payload) < from) continue;
+         visited++;
+         if (!func(*r, payload))
+         {
+            xSemaphoreGive(_lock);
+            return visited;
+         }
+      }
+   }
+   xSemaphoreGive(_lock);
+   return visited;
+}
+
+String relayLogAsJson(uint32_t from, uint32_t to, uint32_t maxEntries){
+   JsonDocument doc;
+   doc["segments"] = flashLog.segmentCount();
+   doc["segmentSize"] = FLASHLOG_SEGMENT_SIZE;
+   doc["maxEraseCount"] = flashLog.maxEraseCount();
+   doc["recovered"] = flashLog.recoveredSegments();
+   JsonArray transitions = doc["transitions"].to<JsonArray>();
+   //The newest maxEntries of them, the log can only be walked from the oldest so count them first
+   uint32_t inRange = flashLog.query(FLASHLOG_RELAY, from, to, [](const FlashLogRecord &r, const uint8_t *payload) { return true; });
+   uint32_t skip = inRange > maxEntries ? inRange - maxEntries : 0;
+   doc["skipped"] = skip;
+   flashLog.query(FLASHLOG_RELAY, from, to, [&](const FlashLogRecord &r, const uint8_t *payload) {
+      if (skip > 0)
+      {
+         skip--;
+         return true;
+      }
+      const FlashLogRelayTransition *t = (const FlashLogRelayTransition *)payload;
+      JsonObject entry = transitions.add<JsonObject>();
+      entry["time"] = r.time;
+      entry["relay"] = t->relay;
+      entry["state"] = t->state;
+      return transitions.size() < maxEntries;
+   });
+
+   String returnString;
+   serializeJson(doc, returnString);
+   return returnString;
+}
@@ -0,0 +1,97 @@
+/**
+ * Append only log in its own flash partition ("history" in partitions_history.csv) so the charger history
+ * and the relay transitions survive a reset. The partition is split into segments that are written one
+ * after the other and erased only when the log wraps around to them, every sector sees the same number
+ * of erases whatever the write pattern is.
+ *
+ * Each segment starts with a header holding a sequence number, the newest segment is the one with the
+ * highest. Records carry a CRC, after a crash the log carries on in a fresh segment from the first record
+ * that does not check out. Reads go straight through the memory mapped partition, nothing is copied.
+ */
+
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include <Arduino.h>
+#include <functional>
+#include <esp_partition.h>
+
+#define FLASHLOG_PARTITION_LABEL "history"
+#define FLASHLOG_PARTITION_SUBTYPE 0x40     //custom data subtype of the partition
+#define FLASHLOG_SEGMENT_SIZE (16 * 1024)   //multiple of the 4K flash sector
+#define FLASHLOG_SEGMENT_MAGIC 0x474F4C46   //"FLOG"
+#define FLASHLOG_FLUSH_INTERVAL 300         //seconds, longest the open history block waits before it is written
+
+enum FlashLogRecordType : uint8_t {
+    FLASHLOG_SAMPLES = 1,                   //a TimeSeriesBlock, cut to TimeSeries::blockBytes()
+    FLASHLOG_RELAY = 2 };                   //FlashLogRelayTransition
+
+struct FlashLogSegmentHeader
+{
+   uint32_t magic;
+   uint32_t sequence;                       //one more than the segment written before it
+   uint32_t eraseCount;                     //times the segment has been erased
+   uint32_t crc;                            //of the fields above
+};
+
+struct FlashLogRecord
+{
+   uint16_t length;                         //payload bytes, 0xFFFF where nothing has been written yet
+   uint8_t type;                            //FlashLogRecordType
+   uint8_t reserved;
+   uint32_t time;                           //seconds
+   uint32_t crc;                            //of the payload and the fields above
+};
+
+struct FlashLogRelayTransition
+{
+   uint8_t relay;
+   uint8_t state;
+   uint16_t reserved;
+};
+
+class FlashLog
+{
+public:
+   bool begin();
+   bool isOpen() const { return _base != NULL; }
+   const char *error() const { return _error; }                 //why it is not open, NULL once it is
+
+   bool append(FlashLogRecordType type, uint32_t time, const void *payload, uint16_t length);
+
+   /**
+    * Calls func for every record of type whose time is inside [from, to], oldest segment first,
+    * until it returns false. payload points into the mapped flash.
+    */
+   uint32_t query(FlashLogRecordType type, uint32_t from, uint32_t to, std::function<bool(const FlashLogRecord &, const uint8_t *payload)> func);
+
+   uint16_t segmentCount() const { return _segments; }
+   uint32_t maxEraseCount() const { return _maxEraseCount; }
+   uint32_t recoveredSegments() const { return _recovered; }
+   size_t partitionSize() const { return _partition ? _partition->size : 0; }
+
+private:
+   const esp_partition_t *_partition = NULL;
+   const uint8_t *_base = NULL;             //partition mapped into the data address space
+   spi_flash_mmap_handle_t _mmapHandle = 0;
+   SemaphoreHandle_t _lock = NULL;
+   uint16_t _segments = 0;
+   uint16_t _current = 0;                   //segment being appended to
+   uint32_t _offset = 0;                    //next free byte in the current segment
+   uint32_t _sequence = 0;                  //of the current segment
+   uint32_t _maxEraseCount = 0;
+   uint32_t _recovered = 0;                 //segments closed early because of a torn record
+   const char *_error = "not started";
+
+   const FlashLogSegmentHeader *header(uint16_t segment) const;
+   bool headerValid(uint16_t segment) const;
+   bool startSegment(uint16_t segment);
+   uint32_t scanSegment(uint16_t segment, bool &torn) const;
+};
+
+extern FlashLog flashLog;
+
+//The newest maxEntries relay transitions inside [from, to]
+String relayLogAsJson(uint32_t from, uint32_t to, uint32_t maxEntries);
+
+#endif
@@ -0,0 +1,53 @@
+#include <Arduino.h>
+#include "LatencyHistogram.h"
+
+//Upper bound (inclusive) in ms of each bucket, the last one catches everything above.
+static const uint32_t _bucketUpperBound[LATENCY_HISTOGRAM_BUCKETS] = {
+	2, 5, 10, 20, 35, 50, 75, 100, 150, 200, 300, 500, 750, 1000, 2000, 5000, 10000, UINT32_MAX};
+
+void LatencyHistogram::record(uint32_t latencyMillis)
+{
+	int b = 0;
+	while (latencyMillis > _bucketUpperBound[b]) b++;
+	buckets[b]++;
+
+	if (count == 0 || latencyMillis < minMillis) minMillis = latencyMillis;
+	if (latencyMillis > maxMillis) maxMillis = latencyMillis;
+	sumMillis += latencyMillis;
+	count++;
+}
+
+uint32_t LatencyHistogram::percentile(uint8_t pct) const
+{
+	if (count == 0) return 0;
+
+	//rank of the sample we are looking for, rounded up so p100 is the last sample.
+	uint32_t rank = (uint32_t)(((uint64_t)count * pct + 99) / 100);
+	if (rank == 0) rank = 1;
+
+	uint32_t seen = 0;
+	for (int b = 0; b < LATENCY_HISTOGRAM_BUCKETS; b++)
+	{
+		seen += buckets[b];
+		if (seen >= rank)
+		{
+			//Never report more than was actually seen.
+			return min(_bucketUpperBound[b], maxMillis);
+		}
+	}
+	return maxMillis;
+}
+
+uint32_t LatencyHistogram::average() const
+{
+	return count == 0 ? 0 : (uint32_t)(sumMillis / count);
+}
+
+void LatencyHistogram::reset()
+{
+	memset(buckets, 0, sizeof(buckets));
+	count = 0;
+	minMillis = 0;
+	maxMillis = 0;
+	sumMillis = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <Arduino.h>
+
+#define LATENCY_HISTOGRAM_BUCKETS 18
+
+/**
+ * Fixed size histogram of latencies in ms. The buckets get wider as the latency goes up so that
+ * the percentiles stay meaningful from a few ms on the LAN up to the multi second timeouts.
+ * Percentiles are reported as the upper bound of the bucket that holds them.
+ */
+struct LatencyHistogram
+{
+   uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS] = {0};
+   uint32_t count = 0;
+   uint32_t minMillis = 0;
+   uint32_t maxMillis = 0;
+   uint64_t sumMillis = 0;
+
+   void record(uint32_t latencyMillis);
+   uint32_t percentile(uint8_t pct) const;
+   uint32_t average() const;
+   void reset();
+};
+
+#endif
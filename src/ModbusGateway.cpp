@@ -0,0 +1,185 @@
+#include <Arduino.h>
+#include "ModbusGateway.h"
+#include "ModbusPlanner.h"
+
+/**
+ * How long a range stays good, the shortest TTL of the rules it overlaps applies.
+ */
+struct ModbusGatewayTtlRule
+{
+   uint16_t first;
+   uint16_t last;
+   uint32_t ttl;
+};
+
+static const ModbusGatewayTtlRule _ttlRules[] = {
+    {4100, 4199, 2000},         //live values and status
+    {4200, 4399, 60000},        //set points, aux configuration, whizbang
+    {16384, 16399, 3600000},    //firmware versions
+};
+
+static ModbusGatewayEntry _entries[MODBUS_GATEWAY_ENTRIES];
+static ModbusGatewayStats _gatewayStats;
+
+uint32_t gatewayTtl(uint16_t address, uint16_t count)
+{
+   uint32_t ttl = 0;
+   for (const ModbusGatewayTtlRule &rule : _ttlRules)
+   {
+      if (address <= rule.last && address + count - 1 >= rule.first && (ttl == 0 || rule.ttl < ttl)) ttl = rule.ttl;
+   }
+   return ttl == 0 ? MODBUS_GATEWAY_DEFAULT_TTL : ttl;
+}
+
+static inline bool covers(const ModbusGatewayEntry &e, uint8_t controller, uint16_t address, uint16_t count)
+{
+   return e.controller == controller && address >= e.address && address + count <= e.address + e.count;
+}
+
+static bool addWaiter(ModbusGatewayEntry &e, uint16_t address, uint16_t count, ModbusGatewayCallback &callback)
+{
+   if (e.waiterCount >= MODBUS_GATEWAY_WAITERS) return false;
+   e.waiters[e.waiterCount++] = {address, count, callback};
+   return true;
+}
+
+/**
+ * Looks for the registers in the cache. A hit is copied to out and CACHE_OK returned, otherwise the
+ * request waits on a read that is already going upstream or a new one is queued and callback is called
+ * with the answer (CACHE_PENDING).
+ */
+ModbusCacheStatus gatewayRead(uint8_t controller, uint16_t address, uint16_t count, uint8_t *out, ModbusGatewayCallback callback, unsigned long now)
+{
+   ModbusGatewayEntry *slot = NULL;
+   ModbusGatewayEntry *oldest = NULL;
+   for (ModbusGatewayEntry &e : _entries)
+   {
+      if (e.state == GATEWAY_VALID && covers(e, controller, address, count) && now - e.stateMillis < e.ttl)
+      {
+         memcpy(out, e.data + 2 * (address - e.address), 2 * count);
+         _gatewayStats.hits++;
+         return CACHE_OK;
+      }
+   }
+   for (ModbusGatewayEntry &e : _entries)
+   {
+      if ((e.state == GATEWAY_QUEUED || e.state == GATEWAY_IN_FLIGHT) && covers(e, controller, address, count))
+      {
+         if (!addWaiter(e, address, count, callback)) continue;
+         _gatewayStats.coalesced++;
+         return CACHE_PENDING;
+      }
+   }
+   for (ModbusGatewayEntry &e : _entries)
+   {
+      //Not sent yet, grow it to take this request in too when the two overlap or touch
+      if (e.state != GATEWAY_QUEUED || e.controller != controller || address > e.address + e.count || address + count < e.address) continue;
+      uint16_t first = min(address, e.address);
+      uint16_t end = max(address + count, e.address + e.count);
+      if (end - first > MODBUS_MAX_READ_REGISTERS || !addWaiter(e, address, count, callback)) continue;
+      e.address = first;
+      e.count = end - first;
+      _gatewayStats.coalesced++;
+      return CACHE_PENDING;
+   }
+   for (ModbusGatewayEntry &e : _entries)
+   {
+      if (e.state == GATEWAY_FREE || (e.state == GATEWAY_VALID && now - e.stateMillis >= e.ttl))
+      {
+         if (slot == NULL) slot = &e;
+      }
+      else if (e.state == GATEWAY_VALID && (oldest == NULL || e.stateMillis < oldest->stateMillis))
+      {
+         oldest = &e;
+      }
+   }
+   if (slot == NULL && oldest != NULL)
+   {
+      slot = oldest;
+      _gatewayStats.evictions++;
+   }
+   if (slot == NULL)
+   {
+      _gatewayStats.full++;
+      return CACHE_FULL;
+   }
+   slot->state = GATEWAY_QUEUED;
+   slot->controller = controller;
+   slot->address = address;
+   slot->count = count;
+   slot->stateMillis = now;
+   slot->waiterCount = 0;
+   addWaiter(*slot, address, count, callback);
+   _gatewayStats.misses++;
+   return CACHE_PENDING;
+}
+
+//Index of an entry waiting to be sent to the controller, -1 when there is none
+int gatewayNextQueued(uint8_t controller)
+{
+   for (int i = 0; i < MODBUS_GATEWAY_ENTRIES; i++)
+   {
+      if (_entries[i].state == GATEWAY_QUEUED && _entries[i].controller == controller) return i;
+   }
+   return -1;
+}
+
+const ModbusGatewayEntry &gatewayEntry(int entry)
+{
+   return _entries[entry];
+}
+
+void gatewayIssued(int entry, unsigned long now)
+{
+   _entries[entry].state = GATEWAY_IN_FLIGHT;
+   _entries[entry].stateMillis = now;
+   _gatewayStats.upstreamReads++;
+}
+
+/**
+ * The upstream read is done, data holds the registers of the entry when errorCode is 0. Every waiter gets its slice.
+ */
+void gatewayComplete(int entry, const uint8_t *data, uint8_t errorCode, unsigned long now)
+{
+   ModbusGatewayEntry &e = _entries[entry];
+   if (e.state != GATEWAY_IN_FLIGHT) return;
+   if (errorCode == 0)
+   {
+      memcpy(e.data, data, 2 * e.count);
+      e.state = GATEWAY_VALID;
+      e.ttl = gatewayTtl(e.address, e.count);
+   }
+   else
+   {
+      e.state = GATEWAY_FREE;
+      _gatewayStats.upstreamErrors++;
+   }
+   e.stateMillis = now;
+   for (uint8_t i = 0; i < e.waiterCount; i++)
+   {
+      ModbusGatewayWaiter &w = e.waiters[i];
+      if (errorCode == 0) w.callback(CACHE_OK, e.data + 2 * (w.address - e.address));
+      else w.callback(CACHE_UPSTREAM_ERROR, NULL);
+      w.callback = nullptr;
+   }
+   e.waiterCount = 0;
+}
+
+/**
+ * Gives up on reads that never came back, the transaction they were in may have been cleared.
+ */
+void gatewayExpire(unsigned long now)
+{
+   for (int i = 0; i < MODBUS_GATEWAY_ENTRIES; i++)
+   {
+      if (_entries[i].state == GATEWAY_IN_FLIGHT && now - _entries[i].stateMillis >= MODBUS_GATEWAY_TIMEOUT)
+      {
+         gatewayComplete(i, NULL, 0xE0, now);
+      }
+   }
+}
+
+ModbusGatewayStats &gatewayStats()
+{
+   return _gatewayStats;
+}
@@ -0,0 +1,86 @@
+/**
+ * Cache in front of the Classics for registers outside the banks that are polled. Downstream reads (the Modbus
+ * server) that miss are queued and the acquisition task sends them upstream over the same esp32ModbusTCP
+ * connection as the bank reads of that Classic, so they share its pipeline window and its load stays bounded.
+ * Entries belong to one charge controller, a range of one Classic never answers a read of another.
+ *
+ * Reads of a range that is already queued or on its way share that read, a queued read is widened to take
+ * in an overlapping request as long as it still fits in one request. Answers are kept for a TTL that
+ * depends on the registers, live values go stale in seconds, set points and versions hardly ever change.
+ *
+ * None of this locks, ModbusStuff calls it with _modbusLock held.
+ */
+
+#ifndef MODBUSGATEWAY_H
+#define MODBUSGATEWAY_H
+
+#include <Arduino.h>
+#include <functional>
+
+#define MODBUS_GATEWAY_ENTRIES 8            //ranges cached
+#define MODBUS_GATEWAY_WAITERS 4            //downstream requests that can wait on one upstream read
+#define MODBUS_GATEWAY_DEFAULT_TTL 5000     //ms, registers not in the TTL table
+#define MODBUS_GATEWAY_TIMEOUT 10000        //ms an upstream read may take before its waiters are given up on
+
+/**
+ * Result of reading registers out of the cached register image or the gateway.
+ */
+enum ModbusCacheStatus {
+    CACHE_OK = 0,           //registers copied
+    CACHE_NOT_COVERED = 1,  //some of the registers are not in any bank that is polled
+    CACHE_NOT_READY = 2,    //the bank has not been received yet
+    CACHE_PENDING = 3,      //sent upstream, the callback gets the answer
+    CACHE_UPSTREAM_ERROR = 4, //the Classic answered with an error or not at all
+    CACHE_FULL = 5,         //every entry is waiting on the Classic, try again later
+   CACHE_NO_CONTROLLER = 6 }; //there is no charge controller with that index
+
+typedef std::function<void(ModbusCacheStatus status, const uint8_t *data)> ModbusGatewayCallback;
+
+enum ModbusGatewayState : uint8_t {
+    GATEWAY_FREE = 0,
+    GATEWAY_QUEUED = 1,     //waiting for the acquisition task to send it
+    GATEWAY_IN_FLIGHT = 2,
+    GATEWAY_VALID = 3 };
+
+struct ModbusGatewayWaiter
+{
+   uint16_t address;
+   uint16_t count;
+   ModbusGatewayCallback callback;
+};
+
+struct ModbusGatewayEntry
+{
+   ModbusGatewayState state = GATEWAY_FREE;
+   uint8_t controller = 0;                 //index of the charge controller the registers are read from
+   uint16_t address = 0;
+   uint16_t count = 0;
+   unsigned long stateMillis = 0;          //when it was queued, sent or filled
+   uint32_t ttl = 0;
+   uint8_t waiterCount = 0;
+   ModbusGatewayWaiter waiters[MODBUS_GATEWAY_WAITERS];
+   uint8_t data[2 * 125];
+};
+
+struct ModbusGatewayStats
+{
+   uint32_t imageHits = 0;      //answered from the register image of the polled banks
+   uint32_t hits = 0;           //answered from a cached gateway range
+   uint32_t misses = 0;         //needed a new upstream read
+   uint32_t coalesced = 0;      //joined a read that was already queued or in flight
+   uint32_t upstreamReads = 0;
+   uint32_t upstreamErrors = 0;
+   uint32_t evictions = 0;      //live entries dropped to make room
+   uint32_t full = 0;           //turned away, no entry or waiter slot free
+};
+
+ModbusCacheStatus gatewayRead(uint8_t controller, uint16_t address, uint16_t count, uint8_t *out, ModbusGatewayCallback callback, unsigned long now);
+int gatewayNextQueued(uint8_t controller);
+const ModbusGatewayEntry &gatewayEntry(int entry);
+void gatewayIssued(int entry, unsigned long now);
+void gatewayComplete(int entry, const uint8_t *data, uint8_t errorCode, unsigned long now);
+void gatewayExpire(unsigned long now);
+uint32_t gatewayTtl(uint16_t address, uint16_t count);
+ModbusGatewayStats &gatewayStats();
+
+#endif
@@ -0,0 +1,42 @@
+#include <Arduino.h>
+#include "ModbusPlanner.h"
+
+/**
+ * Work out the fewest holding register reads that cover the banks in neededMask. Banks are taken in
+ * address order and merged into the current span as long as the whole span stays within
+ * MODBUS_MAX_READ_REGISTERS, the gap between them is read and thrown away. Returns the number of spans.
+ */
+int planModbusReads(const ModbusRegisterBank *banks, int bankCount, uint8_t neededMask, ModbusReadSpan *spans, int maxSpans)
+{
+	int spanCount = 0;
+	uint8_t remaining = neededMask;
+	ModbusReadSpan *current = NULL;
+
+	while (remaining != 0)
+	{
+		//next lowest address bank that still has to be placed
+		int next = -1;
+		for (int i = 0; i < bankCount; i++)
+		{
+			if ((remaining & (1 << i)) && (next < 0 || banks[i].address < banks[next].address)) next = i;
+		}
+		if (next < 0) break; //mask has bits beyond bankCount
+		remaining &= ~(1 << next);
+
+		int end = banks[next].address + banks[next].numberOfRegisters;
+		if (current != NULL && end - current->address <= MODBUS_MAX_READ_REGISTERS)
+		{
+			current->numberOfRegisters = max((int)current->numberOfRegisters, end - current->address);
+			current->bankMask |= (1 << next);
+		}
+		else
+		{
+			if (spanCount >= maxSpans) break;
+			current = &spans[spanCount++];
+			current->address = banks[next].address;
+			current->numberOfRegisters = banks[next].numberOfRegisters;
+			current->bankMask = (1 << next);
+		}
+	}
+	return spanCount;
+}
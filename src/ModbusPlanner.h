@@ -0,0 +1,22 @@
+#ifndef MODBUSPLANNER_H
+#define MODBUSPLANNER_H
+
+#include <Arduino.h>
+#include "ChargeControllerInfo.h"
+
+#define MODBUS_MAX_READ_REGISTERS 125           //most holding registers a single FC3 read may ask for
+
+/**
+ * One holding register read planned by planModbusReads(). bankMask has a bit set for each register
+ * bank that lies inside the span.
+ */
+struct ModbusReadSpan
+{
+   uint16_t address = 0;
+   uint16_t numberOfRegisters = 0;
+   uint8_t bankMask = 0;
+};
+
+int planModbusReads(const ModbusRegisterBank *banks, int bankCount, uint8_t neededMask, ModbusReadSpan *spans, int maxSpans);
+
+#endif
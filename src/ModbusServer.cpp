@@ -0,0 +1,301 @@
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <ArduinoJson.h>
+#include "Log.h"
+#include "ModbusServer.h"
+#include "ModbusStuff.h"
+
+#define MB_EXCEPTION_ILLEGAL_FUNCTION 0x01
+#define MB_EXCEPTION_ILLEGAL_ADDRESS 0x02
+#define MB_EXCEPTION_ILLEGAL_VALUE 0x03
+#define MB_EXCEPTION_BUSY 0x06
+#define MB_EXCEPTION_GATEWAY_PATH 0x0A     //no Classic for the unit id
+#define MB_EXCEPTION_GATEWAY_TARGET 0x0B   //the Classic did not answer
+
+/**
+ * One connected client. TCP may split or join frames, bytes are collected until a whole MBAP frame is there.
+ */
+struct ModbusServerConnection
+{
+   AsyncClient *client = NULL;
+   uint32_t generation = 0;         //bumped on each new client, late gateway answers for a gone client are dropped
+   uint8_t buffer[MODBUS_SERVER_MAX_FRAME];
+   uint16_t length = 0;
+};
+
+static AsyncServer *_modbusServer = NULL;
+static ModbusServerConnection _connections[MODBUS_SERVER_MAX_CLIENTS];
+static ModbusServerCoils _coils;
+static ModbusServerStats _serverStats;
+static SemaphoreHandle_t _clientLock = NULL;   //the AsyncTCP task deletes clients that other tasks answer deferred reads on
+
+static inline uint16_t frameWord(const uint8_t *p)
+{
+   return p[0] << 8 | p[1];
+}
+
+static inline void putFrameWord(uint8_t *p, uint16_t value)
+{
+   p[0] = value >> 8;
+   p[1] = value & 0xFF;
+}
+
+//Fills in the PDU of an exception response and returns its length
+static uint16_t exceptionResponse(uint8_t *pdu, uint8_t functionCode, uint8_t exception)
+{
+   _serverStats.exceptions++;
+   pdu[0] = functionCode | 0x80;
+   pdu[1] = exception;
+   return 2;
+}
+
+/**
+ * Sends the response PDU to the client of the connection, behind a copy of the request's MBAP header. Dropped
+ * when the client that sent the request (the connection's generation) is gone. Holds _clientLock so the
+ * client can not be deleted under the write.
+ */
+static void sendResponse(ModbusServerConnection &c, uint32_t generation, const uint8_t *header, const uint8_t *pdu, uint16_t pduLength)
+{
+   uint8_t response[MODBUS_SERVER_MAX_FRAME];
+   memcpy(response, header, 7);
+   putFrameWord(response + 4, pduLength + 1);
+   memcpy(response + 7, pdu, pduLength);
+   xSemaphoreTake(_clientLock, portMAX_DELAY);
+   if (c.client != NULL && c.generation == generation) c.client->write((const char *)response, 7 + pduLength);
+   xSemaphoreGive(_clientLock);
+}
+
+//The status of a register read as an exception code, 0 when the data is there
+static uint8_t cacheException(ModbusCacheStatus status)
+{
+   switch (status)
+   {
+   case CACHE_OK:
+   case CACHE_PENDING:
+      return 0;
+   case CACHE_NOT_COVERED:
+      return MB_EXCEPTION_ILLEGAL_ADDRESS;
+   case CACHE_UPSTREAM_ERROR:
+      return MB_EXCEPTION_GATEWAY_TARGET;
+   case CACHE_NO_CONTROLLER:
+      return MB_EXCEPTION_GATEWAY_PATH;
+   default:
+      return MB_EXCEPTION_BUSY;
+   }
+}
+
+/**
+ * Register reads that go through the gateway are answered when the Classic replies, from whatever task
+ * that happens in. The client may have gone or the connection may have a new one by then, sendResponse
+ * checks under _clientLock.
+ */
+static ModbusGatewayCallback deferredRead(ModbusServerConnection &c, const uint8_t *header, uint8_t functionCode, uint16_t quantity)
+{
+   ModbusServerConnection *connection = &c;
+   uint32_t generation = c.generation;
+   uint8_t mbap[7];
+   memcpy(mbap, header, 7);
+   return [connection, generation, mbap, functionCode, quantity](ModbusCacheStatus status, const uint8_t *data) {
+      uint8_t pdu[2 + 2 * MODBUS_MAX_READ_REGISTERS];
+      uint16_t length;
+      uint8_t exception = cacheException(status);
+      if (exception != 0)
+      {
+         length = exceptionResponse(pdu, functionCode, exception);
+      }
+      else
+      {
+         pdu[0] = functionCode;
+         pdu[1] = 2 * quantity;
+         memcpy(pdu + 2, data, 2 * quantity);
+         length = 2 + 2 * quantity;
+      }
+      sendResponse(*connection, generation, mbap, pdu, length);
+   };
+}
+
+//Unit 1 is the first charge controller configured, 2 the second and so on. 0 and 255 (no unit) mean the first.
+static inline uint8_t controllerForUnit(uint8_t unit)
+{
+   return (unit == 0 || unit == 0xFF) ? 0 : unit - 1;
+}
+
+/**
+ * Handles the request PDU and writes the response PDU over resp. Returns the length of the response,
+ * 0 when it will be sent later.
+ */
+static uint16_t handlePdu(ModbusServerConnection &c, const uint8_t *header, const uint8_t *pdu, uint16_t length, uint8_t *resp)
+{
+   uint8_t functionCode = pdu[0];
+   if (length < 5) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_VALUE);
+   uint16_t address = frameWord(pdu + 1);
+   uint16_t quantity = frameWord(pdu + 3);
+   resp[0] = functionCode;
+
+   switch (functionCode)
+   {
+   case 3:
+   case 4:
+   {
+      if (quantity < 1 || quantity > MODBUS_MAX_READ_REGISTERS) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_VALUE);
+      ModbusCacheStatus status = readRegisters(controllerForUnit(header[6]), address, quantity, resp + 2, deferredRead(c, header, functionCode, quantity));
+      if (status == CACHE_PENDING) return 0;
+      uint8_t exception = cacheException(status);
+      if (exception != 0) return exceptionResponse(resp, functionCode, exception);
+      resp[1] = 2 * quantity;
+      return 2 + 2 * quantity;
+   }
+   case 1:
+   {
+      if (quantity < 1 || quantity > 2000) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_VALUE);
+      if (address + quantity > _coils.count()) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_ADDRESS);
+      uint8_t bytes = (quantity + 7) / 8;
+      resp[1] = bytes;
+      memset(resp + 2, 0, bytes);
+      for (uint16_t i = 0; i < quantity; i++)
+      {
+         if (_coils.get(address + i)) resp[2 + i / 8] |= 1 << (i % 8);
+      }
+      return 2 + bytes;
+   }
+   case 5:
+   {
+      //quantity holds the value here: 0xFF00 on, 0x0000 off
+      if (quantity != 0xFF00 && quantity != 0x0000) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_VALUE);
+      if (address >= _coils.count()) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_ADDRESS);
+      _coils.set(address, quantity == 0xFF00);
+      memcpy(resp, pdu, 5);
+      return 5;
+   }
+   case 15:
+   {
+      if (length < 6) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_VALUE);
+      uint8_t bytes = pdu[5];
+      if (quantity < 1 || quantity > 1968 || bytes != (quantity + 7) / 8 || length < 6 + bytes) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_VALUE);
+      if (address + quantity > _coils.count()) return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_ADDRESS);
+      for (uint16_t i = 0; i < quantity; i++)
+      {
+         _coils.set(address + i, (pdu[6 + i / 8] >> (i % 8)) & 1);
+      }
+      memcpy(resp, pdu, 5);
+      return 5;
+   }
+   default:
+      return exceptionResponse(resp, functionCode, MB_EXCEPTION_ILLEGAL_FUNCTION);
+   }
+}
+
+/**
+ * Answers every complete frame in the connection's buffer. Returns false when the stream can not be
+ * a Modbus TCP one, the connection is dropped then.
+ */
+static bool processFrames(ModbusServerConnection &c)
+{
+   while (c.length >= 7)
+   {
+      uint16_t frameLength = 6 + frameWord(c.buffer + 4);
+      if (frameWord(c.buffer + 2) != 0 || frameLength < 8 || frameLength > MODBUS_SERVER_MAX_FRAME) return false;
+      if (c.length < frameLength) break;
+
+      _serverStats.requests++;
+      uint8_t pdu[MODBUS_SERVER_MAX_FRAME];
+      uint16_t pduLength = handlePdu(c, c.buffer, c.buffer + 7, frameLength - 7, pdu);
+      if (pduLength > 0) sendResponse(c, c.generation, c.buffer, pdu, pduLength);
+      else _serverStats.deferred++;
+
+      memmove(c.buffer, c.buffer + frameLength, c.length - frameLength);
+      c.length -= frameLength;
+   }
+   return true;
+}
+
+static void onModbusData(void *arg, AsyncClient *client, void *data, size_t len)
+{
+   ModbusServerConnection &c = *(ModbusServerConnection *)arg;
+   const uint8_t *bytes = (const uint8_t *)data;
+   while (len > 0)
+   {
+      size_t n = min(len, sizeof(c.buffer) - c.length);
+      memcpy(c.buffer + c.length, bytes, n);
+      c.length += n;
+      bytes += n;
+      len -= n;
+      if (!processFrames(c))
+      {
+         logw("Malformed Modbus frame from %s, closing", client->remoteIP().toString().c_str());
+         _serverStats.badFrames++;
+         c.length = 0;
+         client->close(true);
+         return;
+      }
+   }
+}
+
+static void onModbusDisconnect(void *arg, AsyncClient *client)
+{
+   ModbusServerConnection &c = *(ModbusServerConnection *)arg;
+   xSemaphoreTake(_clientLock, portMAX_DELAY);
+   c.client = NULL;
+   c.length = 0;
+   delete client;
+   xSemaphoreGive(_clientLock);
+}
+
+static void onModbusClient(void *arg, AsyncClient *client)
+{
+   ModbusServerConnection *c = NULL;
+   for (int i = 0; i < MODBUS_SERVER_MAX_CLIENTS && c == NULL; i++)
+   {
+      if (_connections[i].client == NULL) c = &_connections[i];
+   }
+   if (c == NULL)
+   {
+      _serverStats.rejected++;
+      client->close(true);
+      delete client;
+      return;
+   }
+   _serverStats.connections++;
+   xSemaphoreTake(_clientLock, portMAX_DELAY);
+   c->generation++;
+   c->client = client;
+   c->length = 0;
+   xSemaphoreGive(_clientLock);
+   client->setNoDelay(true);
+   client->onData(onModbusData, c);
+   client->onDisconnect(onModbusDisconnect, c);
+   logd("Modbus client connected from %s", client->remoteIP().toString().c_str());
+}
+
+bool startModbusServer(ModbusServerCoils coils, uint16_t port)
+{
+   if (_modbusServer != NULL) return true;
+   _coils = coils;
+   _clientLock = xSemaphoreCreateMutex();
+   _modbusServer = new AsyncServer(port);
+   _modbusServer->onClient(onModbusClient, NULL);
+   _modbusServer->begin();
+   logd("Modbus server listening on port %d", port);
+   return true;
+}
+
+String modbusServerStatsAsJson()
+{
+   JsonDocument doc;
+   int clients = 0;
+   for (int i = 0; i < MODBUS_SERVER_MAX_CLIENTS; i++)
+   {
+      if (_connections[i].client != NULL) clients++;
+   }
+   doc["clients"] = clients;
+   doc["connections"] = _serverStats.connections;
+   doc["rejected"] = _serverStats.rejected;
+   doc["requests"] = _serverStats.requests;
+   doc["exceptions"] = _serverStats.exceptions;
+   doc["deferred"] = _serverStats.deferred;
+   doc["badFrames"] = _serverStats.badFrames;
+
+   String returnString;
+   serializeJson(doc, returnString);
+   return returnString;
+}
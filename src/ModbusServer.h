@@ -0,0 +1,46 @@
+/**
+ * Modbus TCP server that answers other clients (loggers, Home Assistant, the Midnite app) out of the register
+ * image the acquisition task keeps of the Classic, so the Classic only ever sees this board polling it.
+ * The relays are exposed as coils.
+ *
+ * Function codes: 1 read coils, 3/4 read holding/input registers, 5 write single coil, 15 write multiple coils.
+ * Registers use the same addresses as the requests sent to the Classic, the unit id picks the Classic when there
+ * is more than one (1 for the first one configured, 0 and 255 also mean the first). Reads of a bank that is polled are
+ * answered from the register image (exception 6, busy, until it has been received), anything else goes
+ * through the gateway cache (exception 11 when the Classic does not answer).
+ */
+
+#ifndef MODBUSSERVER_H
+#define MODBUSSERVER_H
+
+#include <Arduino.h>
+#include <functional>
+
+#define MODBUS_SERVER_PORT 502
+#define MODBUS_SERVER_MAX_CLIENTS 4
+#define MODBUS_SERVER_MAX_FRAME 260     //MBAP header + largest PDU
+
+/**
+ * How the server gets at the relays, supplied by main so this module does not need to know about LilyGoRelays.
+ */
+struct ModbusServerCoils
+{
+   std::function<int()> count;
+   std::function<bool(int coil)> get;
+   std::function<void(int coil, bool on)> set;
+};
+
+struct ModbusServerStats
+{
+   uint32_t connections = 0;
+   uint32_t rejected = 0;       //connections refused because all client slots were in use
+   uint32_t requests = 0;
+   uint32_t exceptions = 0;
+   uint32_t deferred = 0;       //register reads answered later, after a gateway read of the Classic
+   uint32_t badFrames = 0;      //connections dropped for a malformed MBAP header
+};
+
+bool startModbusServer(ModbusServerCoils coils, uint16_t port = MODBUS_SERVER_PORT);
+String modbusServerStatsAsJson();
+
+#endif
@@ -1,56 +1,110 @@
 #include <Arduino.h>
+#include <atomic>
 #include <esp32ModbusTCP.h>
+#include <ArduinoJson.h>
 #include "Log.h"
 #include "ModbusStuff.h"
 #include "ChargeControllerInfo.h"
+#include "ClassicRegisterMap.h"
+#include "TimeSeries.h"
+#include "Rollups.h"
+#include "FlashLog.h"
+#include "DerivedMeasures.h"
 
-int _currentRegister = 0;
-uint16_t _currentRequestId = 0;
+/**
+ * One entry per outstanding request, keyed by the packet id esp32ModbusTCP returned when it was issued.
+ */
+struct ModbusTransaction
+{
+	uint16_t packetId = 0;			//0 = slot is free
+	ModbusReadSpan span;			//registers requested and the banks they cover
+	unsigned long issueMillis = 0;
+	unsigned long completeMillis = 0;
+	unsigned long deadline = 0;		//ms after issueMillis the response is given up on
+	uint8_t retries = 0;			//times these banks were already requested during this gather cycle
+	uint8_t errorCode = 0;			//MBError, 0 = SUCCESS
+	int8_t gatewayEntry = -1;		//ModbusGateway entry the read is for, -1 for bank reads
+};
+
+#define numBanks CLASSIC_BANK_COUNT
+#define REGISTER_BANK(bank, rate) {false, classicBankStart(bank), classicBankCount(bank), rate, 0}
+//Order follows ClassicBank, the extent of each bank comes from CLASSIC_REGISTER_MAP. Each controller gets a copy.
+static const ModbusRegisterBank _bankLayout[numBanks] = {
+	REGISTER_BANK(BANK_IDENTITY, MODBUS_POLL_ONCE),
+	REGISTER_BANK(BANK_LIVE, MODBUS_POLL_LIVE),
+	REGISTER_BANK(BANK_TEMPERATURE, MODBUS_SLOW_POLL_RATE),
+	REGISTER_BANK(BANK_MPPT, MODBUS_POLL_ONCE),
+	REGISTER_BANK(BANK_SETPOINTS, MODBUS_SLOW_POLL_RATE),
+	REGISTER_BANK(BANK_WHIZBANG, MODBUS_POLL_LIVE),
+	REGISTER_BANK(BANK_VERSION, MODBUS_POLL_ONCE)};
+
+#define CHECK_BANK_SIZE(bank) static_assert(classicBankCount(bank) <= MODBUS_MAX_READ_REGISTERS, #bank " is too big for one read");
+CHECK_BANK_SIZE(BANK_IDENTITY)
+CHECK_BANK_SIZE(BANK_LIVE)
+CHECK_BANK_SIZE(BANK_TEMPERATURE)
+CHECK_BANK_SIZE(BANK_MPPT)
+CHECK_BANK_SIZE(BANK_SETPOINTS)
+CHECK_BANK_SIZE(BANK_WHIZBANG)
+CHECK_BANK_SIZE(BANK_VERSION)
 
-void modbus4100(uint8_t *data);
-void modbus4360(uint8_t *data);
-void modbus4163(uint8_t *data);
-void modbus4243(uint8_t *data);
-void modbus16386(uint8_t *data);
+/**
+ * Everything kept for one Classic. Each has its own esp32ModbusTCP connection, transaction table and pipeline
+ * window, so the Classics are polled side by side and a slow one does not hold the others up.
+ */
+struct ClassicController
+{
+	uint8_t index = 0;
+	esp32ModbusTCP *client = NULL;			//NULL until its address has been resolved
+	String host;							//name or IP as configured
+	ChargeControllerInfo info;				//decoded from registerImage a field at a time as they are needed, see decodeFields()
+	ClassicFieldSet decodedFields = 0;		//fields of info that are up to date with registerImage
+	ClassicFieldSet changedFields = 0;		//fields whose registers changed since the controller was last published
+	uint8_t imageBanks = 0;					//banks that registerImage holds, one bit per bank
+	ModbusRegisterBank registers[numBanks];
+	ModbusBankStats bankStats[numBanks];
+	ModbusTransaction transactions[MODBUS_PIPELINE_WINDOW];
+	uint8_t registerImage[2 * classicImageRegisters];	//raw big-endian registers of every bank as last received, laid out by classicImageOffset()
+	uint8_t bankAttempts[numBanks] = {0};	//requests made for each bank during the current gather cycle
+	int requestsInFlight = 0;
+	int readsThisCycle = 0;
+	bool doGather = false;
+	bool holdingOff = true;					//no new gather cycle is started until gatherTimer fires, pushed out on errors
+	TimerId gatherTimer = 0;
+	unsigned long currentGatherRate = MODBUS_FAST_POLL_RATE; //hold off after a failed cycle, doubles on each failure up to MAX_GATHER_HOLDOFF
+	unsigned long completeMillis = 0;		//when its last gather cycle completed, 0 = never
+};
 
-#define numBanks 5
-static ModbusRegisterBank _registers[numBanks] = {
-	{false, 4100, 44, modbus4100},    //0
-	{false, 4360, 22, modbus4360},    //1
-	{false, 4163, 2, modbus4163},     //2
-	{false, 4243, 32, modbus4243},    //3
-	{false, 16386, 4, modbus16386}};  //4
+static ClassicController _controllers[MAX_CHARGE_CONTROLLERS];
+static uint8_t _controllerCount = 0;
+static bool _publishPending = false;		//a controller has completed a cycle that has not been published yet
+static uint8_t _publishedControllers = 0;	//controllers that went into the last publish, one bit each
 
 hw_timer_t *_watchdogTimer = NULL;
-hw_timer_t *_modbusReadTimer = NULL;
-int modbusRequestFailureCount = 0;
-boolean doGather = false;
-uint8_t _boilerPlateReadBitField = 0;
 
-unsigned long _nextGatherTime = 0;
-unsigned long _nextModbusPollTimeStamp = 0;
-unsigned long _currentGatherRate = DEFAULT_GATHER_RATE;
+volatile unsigned long _livePollRate = MODBUS_FAST_POLL_RATE; //rate of the MODBUS_POLL_LIVE banks, see setPollUrgency()
 
-esp32ModbusTCP *_pClassic;
-ChargeControllerInfo _chargeControllerInfo;
+//Published by the acquisition task through a seqlock: the sequence is odd while _chargerData is being written.
 chargerDataForRelayControl _chargerData;
+static std::atomic<uint32_t> _chargerDataSeq(0);
+
+TimeSeries _history; //every published sample, written by the acquisition task under _modbusLock
+Rollups _rollups;    //min/max/average of the published samples, same locking as _history
+DerivedMeasures _derived; //power, net amp hours and slopes of the published samples, same locking as _history
+uint32_t _historyFlushTime = 0; //sample time the open history block was last written to flash
+
+TimerWheelPool<MAX_CHARGE_CONTROLLERS> _modbusTimers; //deadlines of the acquisition task (a gather hold off per controller), run from gatherModbusData()
 
-void IRAM_ATTR clearModbusRead()
+TaskHandle_t _modbusTaskHandle = NULL;
+SemaphoreHandle_t _modbusLock = NULL; //the acquisition task and the esp32ModbusTCP callbacks share the controller and transaction state
+
+void lockModbus()
 {
-	_currentRequestId = 0; //clear a hanging read that appears to never come back.
-	loge("Long MODBUS read, requestId cleared");
-	//ets_printf("Long MODBUS read, requestId cleared\n");
+	if (_modbusLock != NULL) xSemaphoreTakeRecursive(_modbusLock, portMAX_DELAY);
 }
 
-void init_modbusReadTimer()
+void unlockModbus()
 {
-	if (_modbusReadTimer == NULL)
-	{
-		_modbusReadTimer = timerBegin(0, 80, true);					   //timer 0, div 80
-		timerAttachInterrupt(_modbusReadTimer, &clearModbusRead, true);	  //attach callback
-		timerAlarmWrite(_modbusReadTimer, MODBUS_READ_TIMEOUT * 1000, false); //set time in us
-		timerAlarmEnable(_modbusReadTimer);							   //enable interrupt
-	}
+	if (_modbusLock != NULL) xSemaphoreGiveRecursive(_modbusLock);
 }
 
 void IRAM_ATTR resetModule()
@@ -78,118 +132,276 @@ void feed_watchdog()
 	}
 }
 
-void resetStart_modbusReadTimer()
+/**
+ * Find the outstanding transaction for the given packet id, NULL if the packet does not belong to any of them.
+ */
+ModbusTransaction *findTransaction(ClassicController &c, uint16_t packetId)
 {
-	if (_modbusReadTimer != NULL)
+	if (packetId == 0) return NULL;
+	for (int i = 0; i < MODBUS_PIPELINE_WINDOW; i++)
 	{
-		timerWrite(_modbusReadTimer, 0); // reset the timer to start counting up again
-		if (!timerStarted(_modbusReadTimer)){
-			timerStart(_modbusReadTimer);
+		if (c.transactions[i].packetId == packetId)
+		{
+			return &c.transactions[i];
 		}
 	}
+	return NULL;
 }
 
-void stop_modbusReadTimer() 
+/**
+ * Bit mask of the banks covered by the outstanding requests.
+ */
+uint8_t banksInFlight(const ClassicController &c)
 {
-	if (_modbusReadTimer != NULL)
+	uint8_t mask = 0;
+	for (int i = 0; i < MODBUS_PIPELINE_WINDOW; i++)
 	{
-		timerStop(_modbusReadTimer); // reset the timer to start counting up again
+		if (c.transactions[i].packetId != 0)
+		{
+			mask |= c.transactions[i].span.bankMask;
+		}
 	}
+	return mask;
 }
 
-uint16_t Getuint16Value(int index, uint8_t *data)
+/**
+ * Brings the fields asked for up to date with the register image, only those that changed since they were
+ * last decoded are touched. Fields of banks that have not been received keep their defaults.
+ */
+const ChargeControllerInfo &decodeFields(ClassicController &c, ClassicFieldSet fields)
 {
-	index *= 2;
-	return (data[index] << 8 | data[index + 1]);
+	ClassicFieldSet received = 0;
+	for (int b = 0; b < numBanks; b++)
+	{
+		if (c.imageBanks & (1 << b)) received |= classicBankFields(b);
+	}
+	ClassicFieldSet missing = fields & received & ~c.decodedFields;
+	while (missing != 0)
+	{
+		int field = __builtin_ctzll(missing);
+		missing &= missing - 1;
+		classicFieldDecoders[field](c.registerImage, c.info);
+	}
+	c.decodedFields |= fields & received;
+	return c.info;
 }
 
-int16_t Getint16Value(int index, uint8_t *data)
+/**
+ * The whizbang bank is only read once the MPPT bank has told us there is a whizbang jr.
+ */
+bool bankSkipped(ClassicController &c, int bank)
 {
-	index *= 2;
-	return (data[index] << 8 | data[index + 1]);
+	return bank == BANK_WHIZBANG && (c.imageBanks & (1 << BANK_MPPT)) && !decodeFields(c, classicFieldBit(CLASSIC_FIELD_hasWhizbang)).hasWhizbang;
 }
 
-uint32_t Getuint32Value(int index, uint8_t *data)
+/**
+ * A bank is due when it has never been read, or when its poll rate has elapsed since it was last read.
+ * The rate is looked up each time so a change of the live rate takes effect straight away.
+ */
+bool bankDue(ClassicController &c, int bank, unsigned long now)
 {
-	index *= 2;
-	return data[index + 2] << 24 | data[index + 3] << 16 | data[index] << 8 | data[index + 1];
+	const ModbusRegisterBank &b = c.registers[bank];
+	if (bankSkipped(c, bank)) return false;
+	if (!b.received) return true;
+	if (b.pollRate == MODBUS_POLL_ONCE) return false;
+	unsigned long rate = (b.pollRate == MODBUS_POLL_LIVE) ? _livePollRate : b.pollRate;
+	return now - b.lastPollMillis >= rate;
 }
 
-int32_t Getint32Value(int index, uint8_t *data)
+/**
+ * Record a request that was just issued for a span in a free slot of the transaction table.
+ */
+ModbusTransaction *openTransaction(ClassicController &c, uint16_t packetId, const ModbusReadSpan &span)
 {
-	index *= 2;
-	return data[index + 2] << 24 | data[index + 3] << 16 | data[index] << 8 | data[index + 1];
+	ModbusTransaction *t = NULL;
+	for (int i = 0; i < MODBUS_PIPELINE_WINDOW; i++)
+	{
+		if (c.transactions[i].packetId == 0)
+		{
+			t = &c.transactions[i];
+			break;
+		}
+	}
+	if (t == NULL)
+	{
+		loge("No free transaction slot for packetId[%d]", packetId);
+		return NULL;
+	}
+
+	t->packetId = packetId;
+	t->span = span;
+	t->issueMillis = millis();
+	t->completeMillis = 0;
+	t->deadline = MODBUS_REQUEST_DEADLINE;
+	t->retries = 0;
+	t->errorCode = 0;
+	t->gatewayEntry = -1;
+
+	for (int b = 0; b < numBanks; b++)
+	{
+		if ((span.bankMask & (1 << b)) == 0) continue;
+		t->retries = max(t->retries, c.bankAttempts[b]);
+		c.bankAttempts[b]++;
+		c.bankStats[b].requests++;
+		if (c.bankAttempts[b] > 1) c.bankStats[b].retries++;
+		c.bankStats[b].lastIssueMillis = t->issueMillis;
+	}
+	c.requestsInFlight++;
+	c.readsThisCycle++;
+	return t;
 }
 
-float GetFloatValue(int index, uint8_t *data, float div = 1.0)
+/**
+ * The request is complete (data or error): record its timing in the statistics of every bank it covered and free the slot.
+ */
+void closeTransaction(ClassicController &c, ModbusTransaction *t, uint8_t errorCode)
 {
-	return Getint16Value(index, data) / div;
+	t->completeMillis = millis();
+	t->errorCode = errorCode;
+
+	for (int b = 0; b < numBanks; b++)
+	{
+		if ((t->span.bankMask & (1 << b)) == 0) continue;
+		ModbusBankStats &stats = c.bankStats[b];
+		stats.lastCompleteMillis = t->completeMillis;
+		stats.lastRetries = t->retries;
+		stats.lastError = errorCode;
+		if (errorCode == 0)
+		{
+			stats.responses++;
+			stats.latency.record(t->completeMillis - t->issueMillis);
+		}
+		else if (errorCode == MODBUS_ERROR_DEADLINE)
+		{
+			stats.timeouts++;
+		}
+		else
+		{
+			stats.errors++;
+		}
+	}
+
+	t->packetId = 0;
+	if (c.requestsInFlight > 0) c.requestsInFlight--;
 }
 
-uint8_t GetMSBValue(int index, uint8_t *data)
+/**
+ * Gives up on the requests that are past their deadline, from task context. The banks they covered are
+ * needed again so the next pass of readModbus() asks for them straight away, a late response no longer
+ * matches a transaction and is dropped.
+ */
+void expireTransactions(ClassicController &c, unsigned long now)
 {
-	index *= 2;
-	return (data[index]);
+	for (int i = 0; i < MODBUS_PIPELINE_WINDOW; i++)
+	{
+		ModbusTransaction *t = &c.transactions[i];
+		if (t->packetId == 0 || now - t->issueMillis < t->deadline) continue;
+		logw("%s packetId[%d] banks[0x%02x] no response after %lu ms", c.host.c_str(), t->packetId, t->span.bankMask, now - t->issueMillis);
+		int8_t entry = t->gatewayEntry;
+		closeTransaction(c, t, MODBUS_ERROR_DEADLINE);
+		if (entry >= 0) gatewayComplete(entry, NULL, MODBUS_ERROR_DEADLINE, now);
+	}
 }
 
-boolean GetFlagValue(int index, uint16_t mask, uint8_t *data)
+/**
+ * Send the reads the gateway has queued for the controller, they take slots in the same pipeline window as its bank reads.
+ */
+void issueGatewayReads(ClassicController &c, unsigned long now)
 {
-	index *= 2;
-	int16_t w =  data[index] << 8 | data[index + 1];
-	boolean rVal = (w & mask) != 0;
-	return rVal;
+	int entry;
+	while (c.requestsInFlight < MODBUS_PIPELINE_WINDOW && (entry = gatewayNextQueued(c.index)) >= 0)
+	{
+		const ModbusGatewayEntry &e = gatewayEntry(entry);
+		uint16_t reqId = c.client->readHoldingRegisters(e.address, e.count);
+		if (reqId == 0)
+		{
+			loge("Gateway request %d failed", e.address);
+			gatewayIssued(entry, now);
+			gatewayComplete(entry, NULL, MODBUS_ERROR_SHORT_RESPONSE, now);
+			continue;
+		}
+		ModbusReadSpan span;
+		span.address = e.address;
+		span.numberOfRegisters = e.count;
+		ModbusTransaction *t = openTransaction(c, reqId, span);
+		if (t != NULL) t->gatewayEntry = entry;
+		gatewayIssued(entry, now);
+		logd("Gateway request Id %d for %d registers at %d", reqId, e.count, e.address);
+	}
 }
 
-int readModbus()
+/**
+ * Plan the reads for every bank that still needs data and keep up to MODBUS_PIPELINE_WINDOW of them in flight at once.
+ * Each request is entered in the transaction table under its packet id so the response can be matched back to it.
+ * A bank whose request failed or timed out is asked for again straight away, up to MAX_MODBUS_READ_ATTEMPTS
+ * times in a gather cycle.
+ * Returns 0=failed (a bank ran out of attempts), 1=request(s) made, 2=nothing needed, 3=waiting on outstanding requests.
+ */
+int readModbus(ClassicController &c)
 {
-	boolean retVal = 0;
-	boolean done = false;
+	uint8_t inFlight = banksInFlight(c);
+	uint8_t needed = 0;
+	uint8_t exhausted = 0;
+	for (int i = 0; i < numBanks; i++)
+	{
+		if (!c.registers[i].received && !bankSkipped(c, i) && (inFlight & (1 << i)) == 0)
+		{
+			if (c.bankAttempts[i] >= MAX_MODBUS_READ_ATTEMPTS) exhausted |= (1 << i);
+			else needed |= (1 << i);
+		}
+	}
+	if (needed == 0)
+	{
+		if (inFlight != 0) return 3; //waiting on outstanding reads
+		return exhausted != 0 ? 0 : 2; //given up on a bank, or have data so skip
+	}
 
-	if (_currentRequestId != 0) return 3; //waiting on another read so do nothing.
+	ModbusReadSpan spans[numBanks];
+	int spanCount = planModbusReads(c.registers, numBanks, needed, spans, numBanks);
 
-	while (!done)
+	int retVal = 1;
+	for (int i = 0; i < spanCount; i++)
 	{
-		if (_currentRegister < numBanks)
+		if (c.requestsInFlight >= MODBUS_PIPELINE_WINDOW)
 		{
-			if (_registers[_currentRegister].received == false)
-			{
-				logd("About to request, cursor= %d; Requesting %d for %d registers", _currentRegister, _registers[_currentRegister].address, _registers[_currentRegister].numberOfRegisters);
-				uint16_t reqId = _pClassic->readHoldingRegisters(_registers[_currentRegister].address, _registers[_currentRegister].numberOfRegisters);
-				if ( reqId != 0)
-				{
-					logd("Request Id %d for register %d Requesting %d for %d registers. ", reqId, _currentRegister, _registers[_currentRegister].address, _registers[_currentRegister].numberOfRegisters);
-					//Only return true if a request was actually made.
-					retVal = 1; //Made request
-					_currentRequestId = reqId;
-					resetStart_modbusReadTimer();
-				}
-				else
-				{
-					loge("Request %d failed\n", _registers[_currentRegister].address);
-					retVal = 0; //error
-				}
-				done = true;
-			} else {
-				retVal = 2; //Have data, skip
-			}
-			done = true;
-			_currentRegister++;
+			if (i == 0) retVal = 3; //window is full, wait for responses to come back
+			break;
+		}
+
+		logd("About to request %d for %d registers from %s, banks 0x%02x", spans[i].address, spans[i].numberOfRegisters, c.host.c_str(), spans[i].bankMask);
+		uint16_t reqId = c.client->readHoldingRegisters(spans[i].address, spans[i].numberOfRegisters);
+		if (reqId != 0)
+		{
+			logd("Request Id %d Requesting %d for %d registers. ", reqId, spans[i].address, spans[i].numberOfRegisters);
+			openTransaction(c, reqId, spans[i]);
 		}
 		else
 		{
-			_currentRegister = 0;
+			loge("Request %d to %s failed", spans[i].address, c.host.c_str());
+			//counts as an attempt so a client that keeps refusing does not hold the cycle up forever
+			for (int b = 0; b < numBanks; b++)
+			{
+				if ((spans[i].bankMask & (1 << b)) == 0) continue;
+				c.bankAttempts[b]++;
+				c.bankStats[b].errors++;
+			}
 		}
 	}
 	return retVal;
 }
 
-void modbusErrorCallback(uint16_t packetId, MBError error)
+void modbusErrorCallback(ClassicController &c, uint16_t packetId, MBError error)
 {
-	logd("Error - packetId[%d], requestId[%d]", packetId, _currentRequestId);
-	modbusRequestFailureCount++;
-	//Only hanging 1 at a time, so clear it out.
-	_currentRequestId = 0;
-	stop_modbusReadTimer();
+	lockModbus();
+	ModbusTransaction *t = findTransaction(c, packetId);
+	logd("Error - %s packetId[%d], banks[0x%02x]", c.host.c_str(), packetId, t == NULL ? 0 : t->span.bankMask);
+	if (t != NULL)
+	{
+		int8_t entry = t->gatewayEntry;
+		closeTransaction(c, t, error); //free the slot so the banks are requested again
+		if (entry >= 0) gatewayComplete(entry, NULL, error, millis());
+	}
+	unlockModbus();
 
 	String text;
 	switch (error)
@@ -237,239 +449,746 @@ void modbusErrorCallback(uint16_t packetId, MBError error)
 		text = "COMM_ERROR";
 		break;
 	}
-	loge("packetId[0x%x], error[%s]", packetId, text);
+	loge("%s packetId[0x%x], error[%s]", c.host.c_str(), packetId, text.c_str());
 }
 
-void modbus4100 (uint8_t *data) //Register 0
+void modbusCallback(ClassicController &c, uint16_t packetId, uint8_t slaveAddress, MBFunctionCode functionCode, uint8_t *data, uint16_t byteCount)
 {
-	_chargeControllerInfo.BatVoltage = GetFloatValue(14, data, 10.0);
-	_chargeControllerInfo.PVVoltage = GetFloatValue(15, data, 10.0);
-	_chargeControllerInfo.BatCurrent = GetFloatValue(16, data, 10.0);
-	_chargeControllerInfo.EnergyToday = GetFloatValue(17, data, 10.0);
-	_chargeControllerInfo.Power = GetFloatValue(18, data);
-	_chargeControllerInfo.ChargeState = GetMSBValue(19, data);
-	_chargeControllerInfo.PVCurrent = GetFloatValue(20, data, 10.0);
-	_chargeControllerInfo.TotalEnergy = Getuint32Value(25, data) / 10.0;
-	_chargeControllerInfo.InfoFlagsBits = Getuint32Value(29, data);
-	_chargeControllerInfo.BatTemperature = GetFloatValue(31, data, 10.0);
-	_chargeControllerInfo.FETTemperature = GetFloatValue(32, data, 10.0);
-	_chargeControllerInfo.PCBTemperature = GetFloatValue(33, data, 10.0);
-	_chargeControllerInfo.FloatTimeTodaySeconds = Getuint16Value(37, data);
-	_chargeControllerInfo.AbsorbTime = Getuint16Value(38, data);
-	_chargeControllerInfo.EqualizeTime = Getuint16Value(42, data);
-	_chargeControllerInfo.Aux1 = GetFlagValue(29, 0x4000, data);
-	_chargeControllerInfo.Aux2 = GetFlagValue(29, 0x8000, data);
-
-	if ((_boilerPlateReadBitField & 0x1) == 0)
+	int regCount = byteCount / 2;
+	lockModbus();
+	ModbusTransaction *t = findTransaction(c, packetId);
+	logd("%s packetId[%d], banks[0x%02x], slaveAddress[%d], functionCode[%d], numberOfRegisters[%d]", c.host.c_str(), packetId, t == NULL ? 0 : t->span.bankMask, slaveAddress, functionCode, regCount);
+
+	if (t == NULL)
+	{
+		logw("packetId[%d] does not match an outstanding request, ignored", packetId);
+		unlockModbus();
+		return;
+	}
+	ModbusReadSpan span = t->span;
+	unsigned long issueMillis = t->issueMillis;
+	int8_t entry = t->gatewayEntry;
+
+	if (span.numberOfRegisters != regCount)
+	{
+		loge("packetId[%d] returned %d registers, expected %d", packetId, regCount, span.numberOfRegisters);
+		closeTransaction(c, t, MODBUS_ERROR_SHORT_RESPONSE);
+		if (entry >= 0) gatewayComplete(entry, NULL, MODBUS_ERROR_SHORT_RESPONSE, millis());
+		unlockModbus();
+		return;
+	}
+	closeTransaction(c, t, 0);
+	if (entry >= 0)
+	{
+		gatewayComplete(entry, data, 0, millis());
+		unlockModbus();
+		return;
+	}
+
+	//copy each bank covered by the span into the register image, it is decoded when something asks for it
+	for (int b = 0; b < numBanks; b++)
 	{
-		_boilerPlateReadBitField |= 0x1;
-		uint16_t reg1 = Getuint16Value(0, data);
-		char buf[32];
-		sprintf(buf, "Classic %d (rev %d)", reg1 & 0x00ff, reg1 >> 8);
-		_chargeControllerInfo.model = buf;
-		int buildYear = Getuint16Value(1, data);
-		int buildMonthDay = Getuint16Value(2, data);
-		sprintf(buf, "%d%02d%02d", buildYear, (buildMonthDay >> 8), (buildMonthDay & 0x00ff));
-		_chargeControllerInfo.buildDate = buf;
-		_chargeControllerInfo.lastVOC = GetFloatValue(21, data, 10.0);
-		_chargeControllerInfo.unitID = Getuint32Value(10, data);
-		short reg6 = Getuint16Value(5, data);
-		short reg7 = Getuint16Value(6, data);
-		short reg8 = Getuint16Value(7, data);
-		char mac[32];
-		sprintf(mac, "%02x:%02x:%02x:%02x:%02x:%02x", reg8 >> 8, reg8 & 0x00ff, reg7 >> 8, reg7 & 0x00ff, reg6 >> 8, reg6 & 0x00ff);
-		_chargeControllerInfo.macAddress = mac;
+		if ((span.bankMask & (1 << b)) == 0) continue;
+		uint8_t *image = c.registerImage + 2 * classicImageOffset(b);
+		const uint8_t *bankData = data + 2 * (c.registers[b].address - span.address);
+		//The first time a bank arrives every one of its fields is new, after that only those whose registers moved
+		ClassicFieldSet changed = (c.imageBanks & (1 << b)) ? classicChangedFields(b, image, bankData) : classicBankFields(b);
+		c.changedFields |= changed;
+		memcpy(image, bankData, 2 * c.registers[b].numberOfRegisters);
+		c.imageBanks |= 1 << b;
+		c.decodedFields &= ~changed;
+		c.registers[b].received = true; // received data for this set of registers
+		c.registers[b].lastPollMillis = issueMillis;
 	}
+	unlockModbus();
+	feed_watchdog();
 }
 
-void modbus4360(uint8_t *data)// whizbang readings  Register 1
-{ 
-	_chargeControllerInfo.PositiveAmpHours = Getuint32Value(4, data);
-	_chargeControllerInfo.NegativeAmpHours = abs((int)Getuint32Value(6, data));
-	_chargeControllerInfo.NetAmpHours = 0; //Getint32Value(8, data); // todo causing deserialization exception in android
-	_chargeControllerInfo.ShuntTemperature = (Getuint16Value(11, data) & 0x00ff) - 50.0f;
-	_chargeControllerInfo.WhizbangBatCurrent = GetFloatValue(10, data, 10.0);
-	_chargeControllerInfo.SOC = Getuint16Value(12, data);
-	_chargeControllerInfo.RemainingAmpHours = Getuint16Value(16, data);
-	_chargeControllerInfo.TotalAmpHours = Getuint16Value(20, data);
+
+/**
+ * Seqlock writer, only ever called from one task at a time. The sequence is odd while the copy is being made
+ * so readers can tell they need to try again.
+ */
+void publishChargerData(chargerDataForRelayControl &cd)
+{
+	uint32_t seq = _chargerDataSeq.load(std::memory_order_relaxed);
+	_chargerDataSeq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	cd.sequence = (seq + 2) / 2;
+	_chargerData = cd;
+	_chargerDataSeq.store(seq + 2, std::memory_order_release);
 }
 
-void modbus4163(uint8_t *data) // boilerplate data Register 2
+//What the published data, the history and combineChargerInfo() use, nothing else is decoded unless it is asked for
+#define TIMESERIES_FIELD_BIT(channel, field, name) | classicFieldBit(CLASSIC_FIELD_##field)
+static constexpr ClassicFieldSet _publishedFields = 0 TIMESERIES_CHANNEL_MAP(TIMESERIES_FIELD_BIT)
+	| classicFieldBit(CLASSIC_FIELD_TotalEnergy) | classicFieldBit(CLASSIC_FIELD_hasWhizbang) | classicFieldBit(CLASSIC_FIELD_ShuntTemperature)
+	| classicFieldBit(CLASSIC_FIELD_PositiveAmpHours) | classicFieldBit(CLASSIC_FIELD_NegativeAmpHours)
+	| classicFieldBit(CLASSIC_FIELD_RemainingAmpHours) | classicFieldBit(CLASSIC_FIELD_TotalAmpHours)
+	| classicNumericFields; //any of them can be an AutoMeasure, the strings are what is worth leaving undecoded
+#undef TIMESERIES_FIELD_BIT
+
+/**
+ * The readings of the charge controllers as one, for relay control and the history. PV and charge currents,
+ * power and energy add up, the voltages are averaged and the hottest temperatures are taken. The Classics share
+ * one battery bank, so the whizbang jr. values come from the first one that has one, except for the SOC
+ * which is the lowest any of them reports. Identity and status are those of the first controller.
+ */
+static void combineChargerInfo(const ChargeControllerInfo *infos[], int count, ChargeControllerInfo &out)
 {
-	if ((_boilerPlateReadBitField & 0x02) == 0)
+	out = *infos[0];
+	for (int i = 1; i < count; i++)
 	{
-		_boilerPlateReadBitField |= 0x02;
-		_chargeControllerInfo.mpptMode = Getuint16Value(0, data);
-		int Aux12FunctionS = (Getuint16Value(1, data) & 0x3f00) >> 8;
-		_chargeControllerInfo.hasWhizbang = Aux12FunctionS == 18;
+		const ChargeControllerInfo &info = *infos[i];
+		out.BatVoltage += info.BatVoltage;
+		out.PVVoltage += info.PVVoltage;
+		out.BatCurrent += info.BatCurrent;
+		out.PVCurrent += info.PVCurrent;
+		out.Power += info.Power;
+		out.EnergyToday += info.EnergyToday;
+		out.TotalEnergy += info.TotalEnergy;
+		out.BatTemperature = max(out.BatTemperature, info.BatTemperature);
+		out.FETTemperature = max(out.FETTemperature, info.FETTemperature);
+		out.PCBTemperature = max(out.PCBTemperature, info.PCBTemperature);
+		if (!info.hasWhizbang) continue;
+		if (!out.hasWhizbang)
+		{
+			out.hasWhizbang = true;
+			out.WhizbangBatCurrent = info.WhizbangBatCurrent;
+			out.ShuntTemperature = info.ShuntTemperature;
+			out.PositiveAmpHours = info.PositiveAmpHours;
+			out.NegativeAmpHours = info.NegativeAmpHours;
+			out.NetAmpHours = info.NetAmpHours;
+			out.RemainingAmpHours = info.RemainingAmpHours;
+			out.TotalAmpHours = info.TotalAmpHours;
+			out.SOC = info.SOC;
+		}
+		out.SOC = min(out.SOC, info.SOC);
 	}
+	out.BatVoltage /= count;
+	out.PVVoltage /= count;
 }
-void modbus4243(uint8_t *data) //Register 3
+
+/**
+ * Publishes the combined readings of the controllers whose last gather cycle is recent enough to act on,
+ * and adds them to the history. Returns false when there is none.
+ */
+static bool publishCombined(unsigned long now)
 {
-	if ((_boilerPlateReadBitField & 0x04) == 0)
+	const ChargeControllerInfo *fresh[MAX_CHARGE_CONTROLLERS];
+	int count = 0;
+	uint8_t freshMask = 0;
+	ClassicFieldSet changed = 0;
+	for (int i = 0; i < _controllerCount; i++)
+	{
+		ClassicController &c = _controllers[i];
+		if (c.completeMillis == 0 || now - c.completeMillis > DEFAULT_GATHER_RATE) continue;
+		fresh[count++] = &decodeFields(c, _publishedFields);
+		freshMask |= 1 << i;
+		changed |= c.changedFields;
+		c.changedFields = 0;
+	}
+	if (count == 0) return false;
+	//A controller that joined or dropped out moves every combined value
+	if (freshMask != _publishedControllers) changed = classicAllFields;
+	_publishedControllers = freshMask;
+
+	const ChargeControllerInfo *info = fresh[0];
+	ChargeControllerInfo combined;
+	if (count > 1)
+	{
+		combineChargerInfo(fresh, count, combined);
+		info = &combined;
+	}
+
+	chargerDataForRelayControl cd;
+	cd.SOC = info->SOC;
+	cd.BatVoltage = info->BatVoltage;
+	cd.BatCurrent = info->WhizbangBatCurrent;
+	cd.PVVoltage = info->PVVoltage;
+	cd.PVCurrent = info->PVCurrent;
+	for (ClassicFieldSet fields = classicNumericFields; fields != 0; fields &= fields - 1)
 	{
-		_boilerPlateReadBitField |= 0x04;
-		_chargeControllerInfo.VbattRegSetPTmpComp = GetFloatValue(0, data, 10.0);
-		_chargeControllerInfo.nominalBatteryVoltage = Getuint16Value(1, data);
-		_chargeControllerInfo.endingAmps = GetFloatValue(2, data, 10.0);
-		_chargeControllerInfo.ReasonForResting = Getuint16Value(31, data);
+		int field = __builtin_ctzll(fields);
+		cd.values[field] = classicFieldValues[field](*info);
 	}
+	cd.controllers = count;
+	cd.changedFields = changed;
+	cd.gatherMillis = millis();
+	time(&cd.timeDataWasGathered); //store the gather time.
+	_derived.update(cd);
+	publishChargerData(cd);
+	TimeSeriesSample sample = TimeSeries::sampleOf((uint32_t)cd.timeDataWasGathered, *info);
+	_history.append(sample);
+	_rollups.add(sample);
+	//Write what the open block holds so far, it carries on filling in memory
+	if (sample.time - _historyFlushTime >= FLASHLOG_FLUSH_INTERVAL)
+	{
+		_history.flush();
+		_historyFlushTime = sample.time;
+	}
+	return true;
 }
-void modbus16386(uint8_t *data)  //Register 4
+
+//The n'th entry of a comma separated list, trimmed, empty when there are fewer entries
+static String listEntry(const String &list, int n)
 {
-	if ((_boilerPlateReadBitField & 0x08) == 0)
+	int start = 0;
+	for (int i = 0; i < n && start >= 0; i++)
 	{
-		_boilerPlateReadBitField |= 0x08;
-		short reg16387 = Getuint16Value(0, data);
-		short reg16388 = Getuint16Value(1, data);
-		short reg16389 = Getuint16Value(2, data);
-		short reg16390 = Getuint16Value(3, data);
-		char unit[16];
-		snprintf_P(unit, sizeof(unit), "%d", (reg16388 << 16) + reg16387);
-		_chargeControllerInfo.appVersion = unit;
-		snprintf_P(unit, sizeof(unit), "%d", (reg16390 << 16) + reg16389);
-		_chargeControllerInfo.netVersion = unit;
+		start = list.indexOf(',', start);
+		if (start >= 0) start++;
 	}
+	if (start < 0) return "";
+	int end = list.indexOf(',', start);
+	String entry = (end < 0) ? list.substring(start) : list.substring(start, end);
+	entry.trim();
+	return entry;
 }
 
-void modbusCallback(uint16_t packetId, uint8_t slaveAddress, MBFunctionCode functionCode, uint8_t *data, uint16_t byteCount)
+//Timer callback, arg is the controller
+static void endHoldOff(uint32_t arg)
 {
-	int regCount = byteCount / 2;
-	logd("packetId[%d], currentRequesId[%d], slaveAddress[%d], functionCode[%d], numberOfRegisters[%d]", packetId, _currentRequestId, slaveAddress, functionCode, regCount);
-	_currentRequestId = 0; 
-	stop_modbusReadTimer();
+	_controllers[arg].holdingOff = false;
+}
 
-	for (int i = 0; i < numBanks; i++)
+//No new gather cycle is started for ms. Without a timer to end it the hold off is skipped, never left on for good.
+static void holdOff(ClassicController &c, unsigned long ms)
+{
+	c.gatherTimer = _modbusTimers.restart(c.gatherTimer, ms, endHoldOff, c.index);
+	c.holdingOff = c.gatherTimer != 0;
+	if (!c.holdingOff) loge("No timer free to hold off gathering from %s", c.host.c_str());
+}
+
+/**
+ * Give the controller its own copy of the banks and its own connection, the esp32ModbusTCP callbacks know which
+ * controller they belong to.
+ */
+static void startController(ClassicController &c, IPAddress ip, int port)
+{
+	for (int b = 0; b < numBanks; b++)
 	{
-		if (_registers[i].numberOfRegisters == regCount)
-		{
-			_registers[i].received = true; // received data for this set of registers
-			_registers[i].func(data);
-			feed_watchdog();
-			break;
-		}
+		c.registers[b] = _bankLayout[b];
 	}
-}
+	c.client = new esp32ModbusTCP(10, ip, port);
+	c.client->onData([&c](uint16_t packetId, uint8_t slaveAddress, MBFunctionCode functionCode, uint8_t *data, uint16_t byteCount) {
+		modbusCallback(c, packetId, slaveAddress, functionCode, data, byteCount);
+	});
+	c.client->onError([&c](uint16_t packetId, MBError error) {
+		modbusErrorCallback(c, packetId, error);
+	});
 
+	//Nothing is published (sequence 0) until the first gather cycle completes.
+	holdOff(c, INITIAL_MODBUS_COLLECTION_DELAY);
+}
 
+/**
+ * ip_addr is the name or IP address of the Classic, or a comma separated list of them when there are several
+ * on the battery bank (up to MAX_CHARGE_CONTROLLERS). port_number is one port for all of them or a list in
+ * the same order. Controllers set up by an earlier call are left alone, so it can be called again until
+ * every one of them resolves.
+ */
 bool setupModbus(String ip_addr, String port_number, WiFiClass _wifi){
-    IPAddress ip;
-
-    //test to see if this is an IP stored
-    if (!ip.fromString(ip_addr)){
-		//Try to get the Ip address using the name
-		int err = WiFi.hostByName(ip_addr.c_str(), ip) ;
-		if(err != 1){
-			Serial.print("Not able to convert ip_addr to ip address, Error code: ");
-			Serial.println(err);
-			return false;
-		}		
+	if (_modbusLock == NULL)
+	{
+		_modbusLock = xSemaphoreCreateRecursiveMutex();
 	}
+	if (!_history.begin())
+	{
+		loge("Not able to allocate the charger history");
+	}
+	//Blocks the history is done with, and the open one every FLASHLOG_FLUSH_INTERVAL, go to flash so they are
+	//still there after a restart.
+	_history.onBlockWritten = [](const TimeSeriesBlock &b) {
+		flashLog.append(FLASHLOG_SAMPLES, b.startTime, &b, TimeSeries::blockBytes(b));
+	};
 
-	Serial.println("\nStarting connection to server...");
-	int port = atoi(port_number.c_str());
-	Serial.print("ip_addr=");
-	Serial.print(ip_addr);
-	Serial.print(" IP=");
-	Serial.print(ip.toString());
-	Serial.print(" Port=");
-	Serial.println(port);
-
-	_pClassic = new esp32ModbusTCP(10, ip, port);
-	_pClassic->onData(modbusCallback);
-	_pClassic->onError(modbusErrorCallback);
-	
-	_chargerData.gatherMillis = 0;
-	_chargerData.SOC = 0;
-	_chargerData.BatVoltage = 0.0;
-	_chargerData.BatCurrent = 0.0;
-	_chargerData.PVVoltage = 0.0;
-	_chargerData.PVCurrent = 0.0;
-	
-	_nextGatherTime = millis() + INITIAL_MODBUS_COLLECTION_DELAY;
+	int count = 0;
+	while (count < MAX_CHARGE_CONTROLLERS && listEntry(ip_addr, count) != "") count++;
+	if (listEntry(ip_addr, count) != "") logw("Only the first %d charge controllers are used", MAX_CHARGE_CONTROLLERS);
 
-	return true;
+	bool allStarted = count > 0;
+	lockModbus();
+	for (int i = 0; i < count; i++){
+		ClassicController &c = _controllers[i];
+		if (c.client != NULL) continue;
+		c.index = i;
+		c.host = listEntry(ip_addr, i);
+		String portEntry = listEntry(port_number, i);
+		if (portEntry == "") portEntry = listEntry(port_number, 0);
+
+		IPAddress ip;
+		//test to see if this is an IP stored
+		if (!ip.fromString(c.host)){
+			//Try to get the Ip address using the name
+			int err = WiFi.hostByName(c.host.c_str(), ip) ;
+			if(err != 1){
+				Serial.print("Not able to convert " + c.host + " to ip address, Error code: ");
+				Serial.println(err);
+				allStarted = false;
+				continue;
+			}
+		}
+
+		Serial.println("\nStarting connection to server...");
+		int port = atoi(portEntry.c_str());
+		Serial.print("ip_addr=");
+		Serial.print(c.host);
+		Serial.print(" IP=");
+		Serial.print(ip.toString());
+		Serial.print(" Port=");
+		Serial.println(port);
+		startController(c, ip, port);
+	}
+	_controllerCount = count;
+	unlockModbus();
+
+	return allStarted;
 }
 
-bool gatherModbusData() {
-    //Is it gather time now?
-    if (millis() > _nextGatherTime)
+/**
+ * One pass over a controller. Each register bank is polled at its own rate. A gather cycle starts as soon as any
+ * bank is due and reads all of the due banks together (the planner merges them into as few reads as it can).
+ * Returns true when a cycle has completed.
+ */
+static bool gatherController(ClassicController &c, unsigned long now) {
+    expireTransactions(c, now);
+    issueGatewayReads(c, now);
+
+    //Is it gather time now for any of the banks?
+    if (!c.doGather && !c.holdingOff)
     {
-        doGather = true;
-        _nextGatherTime = millis() + _currentGatherRate;
-        _registers[0].received = false;
-        _registers[1].received = false;
-        _registers[3].received = false;
-        modbusRequestFailureCount = 0;
+        for (int i = 0; i < numBanks; i++)
+        {
+            if (bankDue(c, i, now))
+            {
+                c.registers[i].received = false;
+                c.doGather = true;
+            }
+        }
+        if (c.doGather)
+        {
+            memset(c.bankAttempts, 0, sizeof(c.bankAttempts));
+            c.readsThisCycle = 0;
+        }
     }
 
     //doGather remains true until all are gathered or failure.
-    if (doGather){
-        //Is it time to read from the Modbus again?
-        //This will automatically read from the areas that need to be read from.
-        int status = readModbus(); //0=failed, 1=request success, 2=request not needed; 3 = waiting
-        
-        if (status != 3 && status != 0) {
-            logd("MODBUS Read Request status = %d", status);
-        }
+    if (!c.doGather) return false;
 
-        if ( status == 0) {
-            modbusRequestFailureCount++; //if failed, up the count
-            loge("modbusRequestFailureCount %d", modbusRequestFailureCount);
-		}
+    //This will automatically read from the areas that need to be read from.
+    int status = readModbus(c); //0=failed, 1=request(s) made, 2=request not needed; 3 = waiting on outstanding requests
 
-		//If failed to get readings from the modbus too many times, skip until next publish time
-		if (modbusRequestFailureCount >= MAX_MODBUS_READ_ATTEMPTS){
-			//skip this whole request
-			doGather = false;
-			_currentGatherRate = 2*_currentGatherRate; //halve the rate when getting errors.
-			_nextGatherTime = millis() + _currentGatherRate; 
-			_registers[0].received = false;
-			_registers[1].received = false;
-			_registers[3].received = false;
-			loge("MODBUS failures causing publish skip");
-		} else {
-			//if we have them all, return true
-			if (_registers[0].received && _registers[1].received && _registers[2].received ) {
-
-				//Save the data
-				_chargerData.SOC = _chargeControllerInfo.SOC;
-				_chargerData.BatVoltage = _chargeControllerInfo.BatVoltage;
-				_chargerData.BatCurrent = _chargeControllerInfo.WhizbangBatCurrent;
-				_chargerData.PVVoltage = _chargeControllerInfo.PVVoltage;
-				_chargerData.PVCurrent = _chargeControllerInfo.PVCurrent;
-				_chargerData.gatherMillis = millis();
-			    time(&_chargerData.timeDataWasGathered); //store the gather time.
-
-				doGather = false;
-				_currentGatherRate = DEFAULT_GATHER_RATE;
-				return true;
-			}
-		}
-	}
+    if (status != 3 && status != 0) {
+        logd("MODBUS Read Request status = %d", status);
+    }
+
+    //A bank could not be read in MAX_MODBUS_READ_ATTEMPTS tries, skip until next publish time
+    if (status == 0){
+        //skip this whole request, the banks that were not received stay due for the next cycle.
+        c.doGather = false;
+        c.currentGatherRate = min(2*c.currentGatherRate, (unsigned long)MAX_GATHER_HOLDOFF); //halve the rate when getting errors.
+        holdOff(c, c.currentGatherRate);
+        loge("MODBUS failures from %s causing publish skip", c.host.c_str());
+    } else if (status == 2) {
+        //every due bank has been received
+        c.doGather = false;
+        c.currentGatherRate = MODBUS_FAST_POLL_RATE;
+        c.completeMillis = millis();
+        return true;
+    }
     return false;
 }
 
+/**
+ * Runs a pass over every charge controller, their requests are all in flight at the same time. The combined
+ * readings are published once the controllers that were being read have all finished their cycles, rather
+ * than once for each of them. Returns true when the data for relay control has been updated.
+ */
+bool gatherModbusData() {
+    bool gathering = false;
+    lockModbus();
+    unsigned long now = millis();
+    _modbusTimers.run();
+    gatewayExpire(now);
+    for (int i = 0; i < _controllerCount; i++)
+    {
+        ClassicController &c = _controllers[i];
+        if (c.client == NULL) continue;
+        if (gatherController(c, now)) _publishPending = true;
+        if (c.doGather) gathering = true;
+    }
+    bool published = false;
+    if (_publishPending && !gathering)
+    {
+        _publishPending = false;
+        published = publishCombined(millis());
+    }
+    unlockModbus();
+    return published;
+}
+
+/**
+ * The acquisition task: keeps gathering from the Classic on its own core so loop() and the web handlers
+ * never wait on Modbus, they pick up the published snapshot with getChargerData().
+ */
+void modbusTask(void *parameter)
+{
+    for (;;)
+    {
+        if (WiFi.status() == WL_CONNECTED)
+        {
+            gatherModbusData();
+        }
+        vTaskDelay(pdMS_TO_TICKS(MODBUS_TASK_PERIOD));
+    }
+}
+
+bool startModbusTask(){
+    if (_modbusTaskHandle != NULL) return true;
+    BaseType_t rc = xTaskCreatePinnedToCore(modbusTask, "modbus", MODBUS_TASK_STACK, NULL, MODBUS_TASK_PRIORITY, &_modbusTaskHandle, MODBUS_TASK_CORE);
+    if (rc != pdPASS) {
+        loge("Could not start the modbus task");
+        _modbusTaskHandle = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Poll the live banks faster while a measure is close to a relay threshold and slower while
+ * everything is far from one.
+ */
+void setPollUrgency(PollUrgency urgency){
+    unsigned long rate = MODBUS_FAST_POLL_RATE;
+    if (urgency == POLL_NEAR) rate = MODBUS_NEAR_POLL_RATE;
+    else if (urgency == POLL_FAR) rate = MODBUS_FAR_POLL_RATE;
+
+    if (rate != _livePollRate) {
+        logd("Live poll rate %lu -> %lu", _livePollRate, rate);
+        _livePollRate = rate;
+    }
+}
+
 void printModbusData(){
-    if ((millis() - _chargerData.gatherMillis) < _currentGatherRate*2) {
+    chargerDataForRelayControl cd = getChargerData();
+    if ((millis() - cd.gatherMillis) < DEFAULT_GATHER_RATE*2) {
         Serial.print("SOC = ");
-        Serial.println(_chargerData.SOC);
+        Serial.println(cd.SOC);
         Serial.print("Battery Voltage = ");
-        Serial.println(_chargerData.BatVoltage);
+        Serial.println(cd.BatVoltage);
         Serial.print("Battery Current = ");
-        Serial.println(_chargerData.BatCurrent);
+        Serial.println(cd.BatCurrent);
         Serial.print("PV Voltage = ");
-        Serial.println(_chargerData.PVVoltage);
+        Serial.println(cd.PVVoltage);
         Serial.print("PV Current = ");
-        Serial.println(_chargerData.PVCurrent);
+        Serial.println(cd.PVCurrent);
         Serial.print("GatherMillis = ");
-        Serial.println(_chargerData.gatherMillis);
+        Serial.println(cd.gatherMillis);
     } else {
         Serial.println("The data is too OLD");
     }
 
 }
 
+/**
+ * Seqlock reader, never blocks the writer. Retries if the copy overlapped a publish.
+ */
 chargerDataForRelayControl getChargerData(){
-    return _chargerData;
+    chargerDataForRelayControl cd;
+    uint32_t before, after;
+    do {
+        before = _chargerDataSeq.load(std::memory_order_acquire);
+        if (before & 1) {
+            vTaskDelay(1); //publish in progress, let the writer finish
+            continue;
+        }
+        cd = _chargerData;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = _chargerDataSeq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return cd;
+}
+
+/**
+ * The fields that changed between the snapshot a consumer last acted on (lastSequence) and cd. When
+ * snapshots were missed in between there is no telling what moved, so every field counts as changed.
+ */
+ClassicFieldSet chargerFieldsChangedSince(const chargerDataForRelayControl &cd, uint32_t lastSequence){
+    return (cd.sequence == lastSequence + 1) ? cd.changedFields : classicAllFields | derivedFields;
+}
+
+/**
+ * Cheap check for new data: compare with the sequence of the last snapshot that was read.
+ */
+uint32_t chargerDataSequence(){
+    return _chargerDataSeq.load(std::memory_order_acquire) / 2;
+}
+
+
+String modbusStatsAsJson(){
+    JsonDocument doc;
+    lockModbus();
+    JsonArray controllers = doc["controllers"].to<JsonArray>();
+    for (int c = 0; c < _controllerCount; c++){
+        const ClassicController &controller = _controllers[c];
+        JsonObject entry = controllers.add<JsonObject>();
+        entry["host"] = controller.host;
+        entry["started"] = controller.client != NULL;
+        entry["inFlight"] = controller.requestsInFlight;
+        entry["readsThisCycle"] = controller.readsThisCycle;
+        entry["holdOff"] = controller.currentGatherRate;
+        entry["lastComplete"] = controller.completeMillis;
+        JsonArray banks = entry["banks"].to<JsonArray>();
+        for (int i = 0; i < numBanks; i++){
+            const ModbusBankStats &stats = controller.bankStats[i];
+            JsonObject bank = banks.add<JsonObject>();
+            bank["address"] = controller.registers[i].address;
+            bank["count"] = controller.registers[i].numberOfRegisters;
+            bank["requests"] = stats.requests;
+            bank["responses"] = stats.responses;
+            bank["errors"] = stats.errors;
+            bank["retries"] = stats.retries;
+            bank["timeouts"] = stats.timeouts;
+            bank["lastError"] = stats.lastError;
+            bank["lastRetries"] = stats.lastRetries;
+            bank["lastIssue"] = stats.lastIssueMillis;
+            bank["lastComplete"] = stats.lastCompleteMillis;
+            bank["p50"] = stats.latency.percentile(50);
+            bank["p95"] = stats.latency.percentile(95);
+            bank["p99"] = stats.latency.percentile(99);
+            bank["avg"] = stats.latency.average();
+            bank["max"] = stats.latency.maxMillis;
+        }
+    }
+    doc["livePollRate"] = _livePollRate;
+    const ModbusGatewayStats &gateway = gatewayStats();
+    JsonObject cache = doc["gateway"].to<JsonObject>();
+    cache["imageHits"] = gateway.imageHits;
+    cache["hits"] = gateway.hits;
+    cache["misses"] = gateway.misses;
+    cache["coalesced"] = gateway.coalesced;
+    cache["upstreamReads"] = gateway.upstreamReads;
+    cache["upstreamErrors"] = gateway.upstreamErrors;
+    cache["evictions"] = gateway.evictions;
+    cache["full"] = gateway.full;
+    unlockModbus();
+
+    String returnString;
+    serializeJson(doc, returnString);
+    return returnString;
+}
+
+/**
+ * Copies count registers starting at address out of the register image of a controller, as big-endian words
+ * the way they came from the Classic. Every register has to be inside a bank that has been received.
+ */
+ModbusCacheStatus readCachedRegisters(uint8_t controller, uint16_t address, uint16_t count, uint8_t *out){
+    ModbusCacheStatus status = CACHE_OK;
+    lockModbus();
+    if (controller >= _controllerCount || _controllers[controller].client == NULL){
+        unlockModbus();
+        return CACHE_NO_CONTROLLER;
+    }
+    const ClassicController &c = _controllers[controller];
+    while (count > 0 && status == CACHE_OK){
+        int b = 0;
+        while (b < numBanks && !(address >= c.registers[b].address && address < c.registers[b].address + c.registers[b].numberOfRegisters)) b++;
+        if (b == numBanks){
+            status = CACHE_NOT_COVERED;
+        } else if ((c.imageBanks & (1 << b)) == 0){
+            status = CACHE_NOT_READY;
+        } else {
+            uint16_t n = min((int)count, c.registers[b].address + c.registers[b].numberOfRegisters - address);
+            memcpy(out, c.registerImage + 2 * (classicImageOffset(b) + address - c.registers[b].address), 2 * n);
+            out += 2 * n;
+            address += n;
+            count -= n;
+        }
+    }
+    unlockModbus();
+    return status;
+}
+
+/**
+ * Registers of a controller for a downstream client: straight from its register image when a polled bank holds
+ * them, otherwise through the gateway, which may answer later through callback (CACHE_PENDING).
+ */
+ModbusCacheStatus readRegisters(uint8_t controller, uint16_t address, uint16_t count, uint8_t *out, ModbusGatewayCallback callback){
+    ModbusCacheStatus status = readCachedRegisters(controller, address, count, out);
+    lockModbus();
+    if (status == CACHE_NOT_COVERED){
+        status = gatewayRead(controller, address, count, out, callback, millis());
+    } else if (status == CACHE_OK){
+        gatewayStats().imageHits++;
+    }
+    unlockModbus();
+    return status;
+}
+
+/**
+ * Number of charge controllers configured, whether or not they have answered yet.
+ */
+uint8_t chargeControllerCount(){
+    return _controllerCount;
+}
+
+/**
+ * Every field of a controller that has been received, decoded now out of its register image. The identity
+ * and version strings are only ever built here.
+ */
+String chargerInfoAsJson(uint8_t controller){
+    JsonDocument doc;
+    lockModbus();
+    if (controller < _controllerCount){
+        ClassicController &c = _controllers[controller];
+        const ChargeControllerInfo &info = decodeFields(c, classicAllFields);
+        doc["host"] = c.host;
+#define CLASSIC_FIELD_JSON(bank, address, type, scale, field) if (c.imageBanks & (1 << bank)) doc[#field] = info.field;
+        CLASSIC_REGISTER_MAP(CLASSIC_FIELD_JSON)
+#undef CLASSIC_FIELD_JSON
+    }
+    unlockModbus();
+
+    String returnString;
+    serializeJson(doc, returnString);
+    return returnString;
+}
+
+/**
+ * Writes the block of history that is still open to flash, call it before a planned restart.
+ */
+void flushHistory(){
+    lockModbus();
+    _history.flush();
+    unlockModbus();
+}
+
+/**
+ * Calls func with every block of history in flash that overlaps [from, to], with the time its samples are new
+ * from and how many of them are. The open block is written again each FLASHLOG_FLUSH_INTERVAL as it grows, so
+ * a copy of a block only adds what came after the copy before it.
+ */
+static void queryFlashHistory(uint32_t from, uint32_t to, std::function<void(const TimeSeriesBlock &, uint32_t newFrom, uint16_t newCount)> func){
+    const TimeSeriesBlock *previous = NULL;
+    flashLog.query(FLASHLOG_SAMPLES, from, to, [&](const FlashLogRecord &r, const uint8_t *payload) {
+        const TimeSeriesBlock *b = (const TimeSeriesBlock *)payload;
+        if (previous != NULL && previous->startTime == b->startTime && previous->count <= b->count){
+            func(*b, max(from, previous->endTime + 1), b->count - previous->count);
+        } else {
+            func(*b, from, b->count);
+        }
+        previous = b;
+        return true;
+    });
+}
+
+/**
+ * Samples between from and to (seconds, inclusive) as one array per channel. What is older than the
+ * history held in memory comes from the flash log. When there are more than maxSamples (capped at
+ * HISTORY_MAX_SAMPLES) in the range only every n'th one is returned.
+ */
+String historyAsJson(uint32_t from, uint32_t to, uint32_t maxSamples){
+    JsonDocument doc;
+    if (maxSamples == 0 || maxSamples > HISTORY_MAX_SAMPLES) maxSamples = HISTORY_MAX_SAMPLES;
+    //Only the block headers are looked at under the lock, the decoding is done on copies so the acquisition task
+    //is not held up for the length of the request.
+    lockModbus();
+    uint32_t samples = _history.sampleCount();
+    uint32_t oldest = _history.oldestTime();
+    doc["samples"] = samples;
+    doc["oldest"] = oldest;
+    doc["newest"] = _history.newestTime();
+    doc["bytes"] = _history.bytesInUse();
+    doc["capacity"] = _history.blockCapacity() * sizeof(TimeSeriesBlock);
+    uint32_t inRange = _history.countInRange(from, to);
+    uint32_t firstBlock = _history.blockNumberAt(from);
+    uint32_t endBlock = _history.endBlockNumber();
+    unlockModbus();
+
+    //The blocks in memory have been written to flash as well, only go to flash for what is older.
+    uint32_t flashTo = samples ? min(to, oldest - 1) : to;
+    if (flashTo >= from){
+        queryFlashHistory(from, flashTo, [&](const TimeSeriesBlock &b, uint32_t newFrom, uint16_t newCount) {
+            inRange += newCount;
+        });
+    }
+    uint32_t step = (inRange > maxSamples) ? (inRange + maxSamples - 1) / maxSamples : 1;
+    doc["flashSize"] = flashLog.partitionSize();
+    if (!flashLog.isOpen()) doc["flash"] = String("no flash history, ") + flashLog.error();
+    doc["step"] = step;
+    JsonArray times = doc["time"].to<JsonArray>();
+    JsonArray channels[TIMESERIES_CHANNELS];
+    for (int ch = 0; ch < TIMESERIES_CHANNELS; ch++){
+        channels[ch] = doc[timeSeriesChannelNames[ch]].to<JsonArray>();
+    }
+    uint32_t n = 0;
+    std::function<bool(const TimeSeriesSample &)> addSample = [&](const TimeSeriesSample &sample) {
+        if (n++ % step == 0){
+            times.add(sample.time);
+            for (int ch = 0; ch < TIMESERIES_CHANNELS; ch++) channels[ch].add(sample.values[ch]);
+        }
+        return true;
+    };
+    if (flashTo >= from){
+        queryFlashHistory(from, flashTo, [&](const TimeSeriesBlock &b, uint32_t newFrom, uint16_t newCount) {
+            uint32_t visited = 0;
+            if (newCount > 0) TimeSeries::decodeBlock(b, newFrom, flashTo, visited, addSample);
+        });
+    }
+
+    //A block at a time, one that was dropped since the headers were looked at is in flash and skipped here
+    TimeSeriesBlock *copy = (TimeSeriesBlock *)malloc(sizeof(TimeSeriesBlock));
+    for (uint32_t number = firstBlock; copy != NULL && number < endBlock; number++){
+        lockModbus();
+        bool copied = _history.copyBlock(number, *copy);
+        unlockModbus();
+        if (!copied) continue;
+        if (copy->startTime > to) break;
+        uint32_t visited = 0;
+        if (!TimeSeries::decodeBlock(*copy, from, to, visited, addSample)) break;
+    }
+    free(copy);
+
+    String returnString;
+    serializeJson(doc, returnString);
+    return returnString;
+}
+
+/**
+ * Aggregate of the res buckets that start inside [from, to), for readers outside the acquisition task.
+ */
+bool chargerRollup(RollupResolution res, uint32_t from, uint32_t to, RollupBucket &out){
+    lockModbus();
+    bool found = _rollups.combine(res, from, to, out);
+    unlockModbus();
+    return found;
+}
+
+/**
+ * The last count buckets of res, newest first, each with the min/max/avg of every channel.
+ */
+String rollupsAsJson(RollupResolution res, uint16_t count){
+    JsonDocument doc;
+    doc["resolution"] = Rollups::asString(res);
+    JsonArray buckets = doc["buckets"].to<JsonArray>();
+    lockModbus();
+    for (uint16_t ago = 0; ago < count; ago++){
+        const RollupBucket *b = _rollups.bucket(res, ago);
+        if (b == NULL) break;
+        JsonObject bucket = buckets.add<JsonObject>();
+        bucket["start"] = b->start;
+        bucket["count"] = b->count;
+        for (int ch = 0; ch < TIMESERIES_CHANNELS; ch++){
+            JsonObject channel = bucket[timeSeriesChannelNames[ch]].to<JsonObject>();
+            channel["min"] = b->min[ch];
+            channel["max"] = b->max[ch];
+            channel["avg"] = b->average(ch);
+        }
+    }
+    unlockModbus();
+
+    String returnString;
+    serializeJson(doc, returnString);
+    return returnString;
 }
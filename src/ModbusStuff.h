@@ -5,37 +5,105 @@
 #include <WiFi.h>
 #include "ChargeControllerInfo.h"
 #include <esp32ModbusTCP.h>
+#include "LatencyHistogram.h"
+#include "ModbusPlanner.h"
+#include "Rollups.h"
+#include "ModbusGateway.h"
+#include "ClassicRegisterMap.h"
+#include "TimerWheel.h"
 
-#define MODBUS_READ_TIMEOUT 300000               //5 minutes in ms. Clear the modbus read
+#ifndef MAX_CHARGE_CONTROLLERS
+#define MAX_CHARGE_CONTROLLERS 4                 //Classics on the one battery bank, each polled over its own connection
+#endif
+#ifndef MODBUS_REQUEST_DEADLINE
+#define MODBUS_REQUEST_DEADLINE 750              //ms a request may be outstanding before it is given up on and asked for again
+#endif
 #define WATCHDOG_TIMER 600000                    //time in ms to trigger the watchdog
-#define MAX_MODBUS_READ_ATTEMPTS 3               //maximum number of tries per gather cycle.
-#define DEFAULT_GATHER_RATE 120000               //300,000 = 5 minutes, 60,000 = 1 minute, 120,000 = 2 minutes
+#define MAX_MODBUS_READ_ATTEMPTS 3               //maximum number of requests for a bank per gather cycle.
+#define DEFAULT_GATHER_RATE 120000               //data older than this is too old to act on. 60,000 = 1 minute, 120,000 = 2 minutes
+/**
+ * Default poll rates, picked so the steady state asks the Classic for no more than the single 2 minute gather cycle did
+ * (5 requests, 104 registers, about 2.5 requests and 52 registers a minute). The live and whizbang banks (17 registers
+ * each, one request each) every minute and the temperature and set point banks every 10 minutes come to about 2.1
+ * requests and 38 registers a minute, less while every measure is far from a relay threshold. Only while a measure is
+ * near one are the live banks read faster than that, a burst for as long as a relay is about to switch.
+ */
+#ifndef MODBUS_FAST_POLL_RATE
+#define MODBUS_FAST_POLL_RATE 60000              //battery and PV volts/amps, SOC. 60,000 = 1 minute
+#endif
+#ifndef MODBUS_SLOW_POLL_RATE
+#define MODBUS_SLOW_POLL_RATE 600000             //temperatures, timers and set points. 600,000 = 10 minutes
+#endif
+#ifndef MODBUS_NEAR_POLL_RATE
+#define MODBUS_NEAR_POLL_RATE 2000               //live banks while a measure is close to a relay threshold. 2,000 = 2 seconds
+#endif
+#ifndef MODBUS_FAR_POLL_RATE
+#define MODBUS_FAR_POLL_RATE 90000               //live banks while every measure is well away from the relay thresholds. 90,000 = 1.5 minutes
+#endif
+#ifndef MODBUS_TASK_CORE
+#define MODBUS_TASK_CORE 0                       //core the acquisition task is pinned to, loop() runs on core 1
+#endif
+#define MODBUS_TASK_PRIORITY 2
+#define MODBUS_TASK_STACK 4096
+#define MODBUS_TASK_PERIOD 20                    //ms between passes of the acquisition task
+#define MAX_GATHER_HOLDOFF 300000                //the hold off after failed gather cycles doubles up to this. 300,000 = 5 minutes
+#define MODBUS_POLL_ONCE 0                       //identity and firmware registers are read once after boot
+#define MODBUS_POLL_LIVE 1                       //live banks, polled at the rate picked by setPollUrgency()
 #define INITIAL_MODBUS_COLLECTION_DELAY 15000    //15,000 15 seconds
+#ifndef MODBUS_PIPELINE_WINDOW
+#define MODBUS_PIPELINE_WINDOW 5                 //maximum number of register bank requests in flight at once to each Classic, 1 = one at a time
+#endif
+#define HISTORY_DEFAULT_SAMPLES 120            //samples /history returns unless asked for more
+#define HISTORY_MAX_SAMPLES 500                //keeps the JSON document of /history inside the heap
+#define MODBUS_ERROR_SHORT_RESPONSE 0xF0         //transaction error code used when a response has the wrong number of registers
+#define MODBUS_ERROR_DEADLINE 0xF1               //transaction error code used when no response came before the deadline
 
 /**
- * Thsi data structure contains the values that can be used for automatically controlling the relays.
- * If additional measures are needed, create an entry here and then set the value in the code where
- * the other values are being set. The measures then can be used in the code to automatically control
- * the relays.
+ * Timing and error counts for one register bank, filled in from the transaction table as requests complete.
  */
-struct chargerDataForRelayControl
+struct ModbusBankStats
 {
-   unsigned long gatherMillis = 0;
-   time_t timeDataWasGathered = 0;
-   int SOC = 0;
-   double BatVoltage = -1;
-   double BatCurrent = -1;
-   double PVVoltage = -1;
-   double PVCurrent = -1;
+   uint32_t requests = 0;
+   uint32_t responses = 0;
+   uint32_t errors = 0;
+   uint32_t retries = 0;          //requests that were a repeat of an earlier one in the same gather cycle
+   uint32_t timeouts = 0;         //requests given up on at MODBUS_REQUEST_DEADLINE, not counted in errors
+   uint8_t lastError = 0;         //MBError of the last completed request, 0 = SUCCESS
+   uint8_t lastRetries = 0;
+   unsigned long lastIssueMillis = 0;
+   unsigned long lastCompleteMillis = 0;
+   LatencyHistogram latency;      //issue to response time of the successful requests
 };
 
+//The fields chargerDataForRelayControl is made of
+constexpr ClassicFieldSet chargerDataFields = classicFieldBit(CLASSIC_FIELD_SOC) | classicFieldBit(CLASSIC_FIELD_BatVoltage)
+    | classicFieldBit(CLASSIC_FIELD_WhizbangBatCurrent) | classicFieldBit(CLASSIC_FIELD_PVVoltage) | classicFieldBit(CLASSIC_FIELD_PVCurrent);
+
+/**
+ * How close the live measures are to the thresholds of the relays, picks the poll rate of the live banks.
+ */
+enum PollUrgency { POLL_FAR = 0, POLL_NORMAL = 1, POLL_NEAR = 2 };
+
 void init_watchdog();
 void feed_watchdog();
 
 bool setupModbus(String ip_addr, String port_number, WiFiClass _wifi);
+bool startModbusTask();
 bool gatherModbusData();
 void printModbusData();
+void setPollUrgency(PollUrgency urgency);
 
 chargerDataForRelayControl getChargerData();
+uint32_t chargerDataSequence();
+ClassicFieldSet chargerFieldsChangedSince(const chargerDataForRelayControl &cd, uint32_t lastSequence);
+String modbusStatsAsJson();
+uint8_t chargeControllerCount();
+String chargerInfoAsJson(uint8_t controller);
+ModbusCacheStatus readCachedRegisters(uint8_t controller, uint16_t address, uint16_t count, uint8_t *out);
+ModbusCacheStatus readRegisters(uint8_t controller, uint16_t address, uint16_t count, uint8_t *out, ModbusGatewayCallback callback);
+void flushHistory();
+String historyAsJson(uint32_t from, uint32_t to, uint32_t maxSamples);
+bool chargerRollup(RollupResolution res, uint32_t from, uint32_t to, RollupBucket &out);
+String rollupsAsJson(RollupResolution res, uint16_t count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include <Arduino.h>
+#include <math.h>
+#include "RelayRule.h"
+#include "AutoData.h"
+
+static_assert(RULE_MAX_CODE <= 16, "_latched has a bit per instruction");
+static_assert(RULE_MAX_TIMERS <= 8, "_running has a bit per timer");
+
+/**
+ * Recursive descent over the rule text, emitting the program in postfix order as it goes.
+ */
+struct RuleParser
+{
+   const char *p;
+   RuleInstruction *code;
+   uint8_t length;
+   uint8_t timers;
+   ClassicFieldSet fields;
+   const char *error;
+
+   bool fail(const char *message)
+   {
+      if (error == NULL) error = message;
+      return false;
+   }
+
+   void skipSpace()
+   {
+      while (*p == ' ' || *p == '\t') p++;
+   }
+
+   //Is the next word kw? Words end at anything that can not be part of a name.
+   bool keyword(const char *kw)
+   {
+      skipSpace();
+      size_t n = strlen(kw);
+      if (strncasecmp(p, kw, n) != 0 || isalnum((unsigned char)p[n]) || p[n] == '_') return false;
+      p += n;
+      return true;
+   }
+
+   bool symbol(const char *s)
+   {
+      skipSpace();
+      size_t n = strlen(s);
+      if (strncmp(p, s, n) != 0) return false;
+      p += n;
+      return true;
+   }
+
+   bool number(float &value)
+   {
+      skipSpace();
+      char *end;
+      value = strtof(p, &end);
+      if (end == p) return fail("number expected");
+      p = end;
+      return true;
+   }
+
+   bool emit(RuleOp op, float value = 0)
+   {
+      if (length >= RULE_MAX_CODE) return fail("too many conditions");
+      RuleInstruction &in = code[length++];
+      memset(&in, 0, sizeof(in));
+      in.op = op;
+      in.value = value;
+      return true;
+   }
+
+   bool parseOr()
+   {
+      if (!parseAnd()) return false;
+      while (keyword("OR") || symbol("||"))
+      {
+         if (!parseAnd() || !emit(RULE_OR)) return false;
+      }
+      return true;
+   }
+
+   bool parseAnd()
+   {
+      if (!parseUnary()) return false;
+      while (keyword("AND") || symbol("&&"))
+      {
+         if (!parseUnary() || !emit(RULE_AND)) return false;
+      }
+      return true;
+   }
+
+   bool parseUnary()
+   {
+      skipSpace();
+      if (keyword("NOT") || (p[0] == '!' && p[1] != '=' && symbol("!")))
+      {
+         return parseUnary() && emit(RULE_NOT);
+      }
+      if (!parsePrimary()) return false;
+      if (!keyword("FOR")) return true;
+
+      float duration;
+      if (!number(duration)) return false;
+      if (keyword("h")) duration *= 3600;
+      else if (keyword("min") || keyword("m")) duration *= 60;
+      else keyword("s");
+      if (duration < 0) return fail("negative duration");
+      if (timers >= RULE_MAX_TIMERS) return fail("too many FOR clauses");
+      if (!emit(RULE_FOR, duration * 1000)) return false;
+      code[length - 1].timer = timers++;
+      return true;
+   }
+
+   bool parsePrimary()
+   {
+      if (symbol("("))
+      {
+         if (!parseOr()) return false;
+         return symbol(")") || fail("')' expected");
+      }
+
+      skipSpace();
+      const char *start = p;
+      while (isalnum((unsigned char)*p) || *p == '_') p++;
+      if (p == start) return fail("measure expected");
+      char name[16];
+      size_t n = 0;
+      for (; n < sizeof(name) - 1 && start + n < p; n++) name[n] = toupper((unsigned char)start[n]);
+      name[n] = 0;
+      AutoMeasure measure = (start + n == p) ? fromString(name) : IGNORE;
+      if (measure == IGNORE)
+      {
+         p = start;
+         return fail("unknown measure");
+      }
+
+      RuleComparator comparator;
+      if (symbol(">=")) comparator = RULE_GE;
+      else if (symbol("<=")) comparator = RULE_LE;
+      else if (symbol("==") || symbol("=")) comparator = RULE_EQ;
+      else if (symbol("!=")) comparator = RULE_NE;
+      else if (symbol(">")) comparator = RULE_GT;
+      else if (symbol("<")) comparator = RULE_LT;
+      else return fail("comparator expected");
+
+      float value, hysteresis = 0;
+      if (!number(value)) return false;
+      if (symbol("~"))
+      {
+         if (!number(hysteresis)) return false;
+         if (hysteresis < 0) return fail("negative hysteresis");
+      }
+      if (!emit(RULE_COMPARE, value)) return false;
+      RuleInstruction &in = code[length - 1];
+      in.comparator = comparator;
+      in.measure = measure;
+      in.hysteresis = hysteresis;
+      fields |= (ClassicFieldSet)1 << autoMeasureInfo[measure].changeBit;
+      return true;
+   }
+};
+
+bool RelayRule::compile(const char *text)
+{
+   clear();
+   while (*text == ' ' || *text == '\t') text++;
+   if (*text == 0) return true;
+   strncpy(_text, text, RULE_TEXT_MAX - 1);
+   if (strlen(text) >= RULE_TEXT_MAX)
+   {
+      _error = "rule too long";
+      _errorAt = RULE_TEXT_MAX - 1;
+      return false;
+   }
+
+   RuleParser parser = {_text, _code, 0, 0, 0, NULL};
+   bool ok = parser.parseOr();
+   parser.skipSpace();
+   if (ok && *parser.p != 0) ok = parser.fail("unexpected text");
+   if (!ok)
+   {
+      _error = parser.error;
+      _errorAt = parser.p - _text;
+      return false;
+   }
+   _length = parser.length;
+   _fields = parser.fields;
+   return true;
+}
+
+void RelayRule::clear()
+{
+   *this = RelayRule();
+}
+
+static inline bool compare(const RuleInstruction &in, float reading, bool latched)
+{
+   float h = in.hysteresis;
+   switch (in.comparator)
+   {
+   case RULE_GT: return reading > (latched ? in.value - h : in.value);
+   case RULE_GE: return reading >= (latched ? in.value - h : in.value);
+   case RULE_LT: return reading < (latched ? in.value + h : in.value);
+   case RULE_LE: return reading <= (latched ? in.value + h : in.value);
+   case RULE_EQ: return fabsf(reading - in.value) <= h;
+   default: return fabsf(reading - in.value) > h;
+   }
+}
+
+bool RelayRule::evaluate(const chargerDataForRelayControl &cd, unsigned long now)
+{
+   uint32_t stack = 0;                      //one bit per entry, the top is bit 0
+   bool waiting = false;
+   for (uint8_t i = 0; i < _length; i++)
+   {
+      const RuleInstruction &in = _code[i];
+      bool result;
+      switch (in.op)
+      {
+      case RULE_COMPARE:
+         result = compare(in, measureValue((AutoMeasure)in.measure, cd), _latched & (1 << i));
+         _latched = result ? (_latched | (1 << i)) : (_latched & ~(1 << i));
+         break;
+      case RULE_AND:
+         result = (stack & 1) && (stack & 2);
+         stack >>= 2;
+         break;
+      case RULE_OR:
+         result = (stack & 1) || (stack & 2);
+         stack >>= 2;
+         break;
+      case RULE_NOT:
+         result = !(stack & 1);
+         stack >>= 1;
+         break;
+      default: //RULE_FOR
+         result = false;
+         if (!(stack & 1))
+         {
+            _running &= ~(1 << in.timer);
+         }
+         else if (!(_running & (1 << in.timer)))
+         {
+            _running |= 1 << in.timer;
+            _since[in.timer] = now;
+            result = in.value <= 0;
+            waiting = waiting || !result;
+         }
+         else
+         {
+            result = now - _since[in.timer] >= in.value;
+            waiting = waiting || !result;
+         }
+         stack >>= 1;
+         break;
+      }
+      stack = (stack << 1) | result;
+   }
+   _waiting = waiting;
+   return _length > 0 && (stack & 1);
+}
+
+bool RelayRule::near(const chargerDataForRelayControl &cd, float margin) const
+{
+   for (uint8_t i = 0; i < _length; i++)
+   {
+      const RuleInstruction &in = _code[i];
+      if (in.op != RULE_COMPARE) continue;
+      float within = margin >= 0 ? margin : autoMeasureInfo[in.measure].nearMargin;
+      float distance = fabsf(measureValue((AutoMeasure)in.measure, cd) - in.value);
+      if (distance <= within + in.hysteresis) return true;
+   }
+   return false;
+}
@@ -0,0 +1,83 @@
+/**
+ * Rules that turn a relay on while a condition over several measures holds, such as
+ * "SOC > 80 AND PVCURRENT > 10 FOR 5m". The text is compiled once, when the relay config is loaded or changed,
+ * into a short postfix program kept inside the rule. Evaluating it on each sample allocates nothing and costs a
+ * few instructions per condition.
+ *
+ * Keywords and measure names (the short names of AUTO_MEASURE_MAP) are not case sensitive:
+ *   rule       := or
+ *   or         := and { (OR | ||) and }
+ *   and        := unary { (AND | &&) unary }
+ *   unary      := (NOT | !) unary | primary [FOR duration]
+ *   primary    := ( or ) | MEASURE comparator number [~ number]
+ *   comparator := > | >= | < | <= | == | !=
+ *   duration   := number [s | m | min | h]
+ *
+ * "~ h" gives an ordered comparison hysteresis: "SOC > 80 ~ 5" turns true above 80 and stays true until the
+ * SOC is back down to 75. With == and != it is the tolerance of the match. "FOR d" keeps the condition in
+ * front of it false until it has held for d without a break, wrap a group in brackets to time all of it.
+ */
+
+#ifndef RELAYRULE_H
+#define RELAYRULE_H
+
+#include <Arduino.h>
+#include "ChargeControllerInfo.h"
+#include "ClassicRegisterMap.h"
+
+#define RULE_TEXT_MAX 96                   //characters of a rule, including the terminator
+#define RULE_MAX_CODE 16                   //instructions, one per comparison and one per AND, OR, NOT and FOR
+#define RULE_MAX_TIMERS 4                  //FOR clauses in one rule
+
+enum RuleOp : uint8_t { RULE_COMPARE, RULE_AND, RULE_OR, RULE_NOT, RULE_FOR };
+enum RuleComparator : uint8_t { RULE_GT, RULE_GE, RULE_LT, RULE_LE, RULE_EQ, RULE_NE };
+
+struct RuleInstruction
+{
+   RuleOp op;
+   RuleComparator comparator;
+   uint8_t measure;                         //AutoMeasure a RULE_COMPARE reads
+   uint8_t timer;                           //timer a RULE_FOR runs
+   float value;                             //threshold, or the duration of a RULE_FOR in ms
+   float hysteresis;
+};
+
+/**
+ * A compiled rule and the state it carries from one sample to the next. It is trivially copyable, so it can
+ * live in the AutoData array.
+ */
+class RelayRule
+{
+public:
+   /**
+    * Compiles text, which is kept so it can be shown and saved again. An empty text clears the rule. Returns
+    * false when it does not compile, the rule then stays off and error() tells why.
+    */
+   bool compile(const char *text);
+   void clear();
+
+   bool empty() const { return _text[0] == 0; }
+   bool active() const { return _length > 0; }
+   const char *text() const { return _text; }
+   const char *error() const { return _error; }          //NULL when the text compiled
+   uint8_t errorAt() const { return _errorAt; }          //offset into the text where it went wrong
+
+   bool evaluate(const chargerDataForRelayControl &cd, unsigned long now);
+   bool near(const chargerDataForRelayControl &cd, float margin = -1) const; //is any comparison within margin, or its measure's nearMargin when that is negative?
+   bool waiting() const { return _waiting; }             //a FOR has started and not run out yet
+   ClassicFieldSet fields() const { return _fields; }    //change bits of the measures it reads
+
+private:
+   char _text[RULE_TEXT_MAX] = {0};
+   RuleInstruction _code[RULE_MAX_CODE];
+   uint8_t _length = 0;
+   ClassicFieldSet _fields = 0;
+   const char *_error = NULL;
+   uint8_t _errorAt = 0;
+   uint16_t _latched = 0;                   //comparisons that were true at the last sample, one bit per instruction
+   uint8_t _running = 0;                    //FOR timers that have started, one bit per timer
+   bool _waiting = false;
+   unsigned long _since[RULE_MAX_TIMERS] = {0};
+};
+
+#endif
@@ -0,0 +1,123 @@
+#include <Arduino.h>
+#include <time.h>
+#include "Rollups.h"
+
+void RollupBucket::add(const TimeSeriesSample &sample)
+{
+   for (uint8_t ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+   {
+      float value = sample.values[ch];
+      if (count == 0 || value < min[ch]) min[ch] = value;
+      if (count == 0 || value > max[ch]) max[ch] = value;
+      sum[ch] += value;
+   }
+   count++;
+}
+
+void RollupBucket::merge(const RollupBucket &other)
+{
+   if (other.count == 0) return;
+   for (uint8_t ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+   {
+      if (count == 0 || other.min[ch] < min[ch]) min[ch] = other.min[ch];
+      if (count == 0 || other.max[ch] > max[ch]) max[ch] = other.max[ch];
+      sum[ch] += other.sum[ch];
+   }
+   if (count == 0 || other.start < start) start = other.start;
+   count += other.count;
+}
+
+Rollups::Rollups()
+{
+   _rings[ROLLUP_MINUTE] = {_minutes, ROLLUP_MINUTES, 0, 0};
+   _rings[ROLLUP_HOUR] = {_hours, ROLLUP_HOURS, 0, 0};
+   _rings[ROLLUP_DAY] = {_days, ROLLUP_DAYS, 0, 0};
+}
+
+void Rollups::clear()
+{
+   for (int res = 0; res < ROLLUP_RESOLUTIONS; res++)
+   {
+      _rings[res].newest = 0;
+      _rings[res].used = 0;
+   }
+}
+
+/**
+ * Minutes are aligned on the epoch, hours and days on the local clock so time zones with a half hour
+ * offset and daylight saving still get their buckets on the hour and at midnight.
+ */
+uint32_t Rollups::bucketStart(RollupResolution res, uint32_t time)
+{
+   if (res == ROLLUP_MINUTE) return time - time % 60;
+   time_t t = time;
+   struct tm local;
+   localtime_r(&t, &local);
+   if (res == ROLLUP_HOUR) return time - local.tm_min * 60 - local.tm_sec;
+   return time - local.tm_hour * 3600 - local.tm_min * 60 - local.tm_sec;
+}
+
+void Rollups::add(const TimeSeriesSample &sample)
+{
+   for (int res = 0; res < ROLLUP_RESOLUTIONS; res++)
+   {
+      Ring &ring = _rings[res];
+      uint32_t start = bucketStart((RollupResolution)res, sample.time);
+      RollupBucket *current = ring.used ? &ring.buckets[ring.newest] : NULL;
+
+      //The clock was set back, the buckets already kept no longer line up with it.
+      if (current != NULL && start < current->start)
+      {
+         ring.used = 0;
+         current = NULL;
+      }
+      if (current == NULL || start != current->start)
+      {
+         if (current != NULL) ring.newest = (ring.newest + 1) % ring.size;
+         if (ring.used < ring.size) ring.used++;
+         current = &ring.buckets[ring.newest];
+         *current = RollupBucket();
+         current->start = start;
+      }
+      current->add(sample);
+   }
+}
+
+const RollupBucket *Rollups::bucket(RollupResolution res, uint16_t ago) const
+{
+   const Ring &ring = _rings[res];
+   if (ago >= ring.used) return NULL;
+   return &ring.buckets[(ring.newest + ring.size - ago) % ring.size];
+}
+
+bool Rollups::combine(RollupResolution res, uint32_t from, uint32_t to, RollupBucket &out) const
+{
+   out = RollupBucket();
+   for (uint16_t ago = 0; ago < _rings[res].used; ago++)
+   {
+      const RollupBucket *b = bucket(res, ago);
+      if (b->start < from) break;
+      if (b->start < to) out.merge(*b);
+   }
+   return out.count > 0;
+}
+
+RollupResolution Rollups::fromString(const String &name)
+{
+   if (name == "hour") return ROLLUP_HOUR;
+   if (name == "day") return ROLLUP_DAY;
+   return ROLLUP_MINUTE;
+}
+
+const char *Rollups::asString(RollupResolution res)
+{
+   switch (res)
+   {
+   case ROLLUP_HOUR:
+      return "hour";
+   case ROLLUP_DAY:
+      return "day";
+   default:
+      return "minute";
+   }
+}
@@ -0,0 +1,76 @@
+/**
+ * Streaming min/max/average of the charger measurements per minute, hour and day. Each sample updates the
+ * current bucket of every resolution in constant time, a new bucket is started when the sample falls past
+ * the end of the current one. Hours and days follow the local time zone so a day runs midnight to midnight.
+ *
+ * Like TimeSeries the owner serialises add() against the readers.
+ */
+
+#ifndef ROLLUPS_H
+#define ROLLUPS_H
+
+#include <Arduino.h>
+#include "TimeSeries.h"
+
+#define ROLLUP_MINUTES 60                       //minute buckets kept
+#define ROLLUP_HOURS 48                         //hour buckets kept
+#define ROLLUP_DAYS 7                           //day buckets kept
+
+enum RollupResolution : uint8_t {
+    ROLLUP_MINUTE = 0,
+    ROLLUP_HOUR = 1,
+    ROLLUP_DAY = 2,
+    ROLLUP_RESOLUTIONS = 3 };
+
+struct RollupBucket
+{
+   uint32_t start = 0;                          //seconds, first second covered by the bucket
+   uint32_t count = 0;                          //samples added
+   float min[TIMESERIES_CHANNELS] = {0};
+   float max[TIMESERIES_CHANNELS] = {0};
+   double sum[TIMESERIES_CHANNELS] = {0};
+
+   void add(const TimeSeriesSample &sample);
+   void merge(const RollupBucket &other);
+   float average(uint8_t channel) const { return count ? sum[channel] / count : 0; }
+};
+
+class Rollups
+{
+public:
+   Rollups();
+
+   void add(const TimeSeriesSample &sample);
+   void clear();
+
+   //Bucket ago steps back from the current one (0), NULL when there are not that many
+   const RollupBucket *bucket(RollupResolution res, uint16_t ago) const;
+   uint16_t bucketCount(RollupResolution res) const { return _rings[res].used; }
+
+   /**
+    * Combines the buckets of res that start inside [from, to). Works on the buckets only, so the result
+    * covers whole minutes, hours or days. Returns false when there are none.
+    */
+   bool combine(RollupResolution res, uint32_t from, uint32_t to, RollupBucket &out) const;
+
+   static RollupResolution fromString(const String &name);
+   static const char *asString(RollupResolution res);
+
+private:
+   struct Ring
+   {
+      RollupBucket *buckets;
+      uint16_t size;
+      uint16_t newest;
+      uint16_t used;
+   };
+
+   RollupBucket _minutes[ROLLUP_MINUTES];
+   RollupBucket _hours[ROLLUP_HOURS];
+   RollupBucket _days[ROLLUP_DAYS];
+   Ring _rings[ROLLUP_RESOLUTIONS];
+
+   static uint32_t bucketStart(RollupResolution res, uint32_t time);
+};
+
+#endif
@@ -0,0 +1,324 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include "TimeSeries.h"
+#ifdef BOARD_HAS_PSRAM
+#include <esp_heap_caps.h>
+#endif
+
+//Worst case size of one sample: the timestamp with a full 32 bit delta of delta, every channel with a new window.
+#define TIMESERIES_MAX_SAMPLE_BITS (4 + 32 + TIMESERIES_CHANNELS * (2 + 5 + 5 + 32))
+#define TIMESERIES_DATA_BITS ((int)sizeof(((TimeSeriesBlock *)0)->data) * 8)
+
+#define TIMESERIES_CHANNEL_NAME(channel, field, name) name,
+const char *const timeSeriesChannelNames[TIMESERIES_CHANNELS] = {TIMESERIES_CHANNEL_MAP(TIMESERIES_CHANNEL_NAME)};
+#undef TIMESERIES_CHANNEL_NAME
+
+static inline uint32_t floatBits(float value)
+{
+   uint32_t bits;
+   memcpy(&bits, &value, sizeof(bits));
+   return bits;
+}
+
+static inline float bitsFloat(uint32_t bits)
+{
+   float value;
+   memcpy(&value, &bits, sizeof(value));
+   return value;
+}
+
+//Bits are packed most significant first. The block is zeroed when it is started so only the ones are written.
+static void putBits(uint8_t *data, uint16_t &pos, uint32_t value, uint8_t bits)
+{
+   while (bits)
+   {
+      uint8_t avail = 8 - (pos & 7);
+      uint8_t take = bits < avail ? bits : avail;
+      uint8_t chunk = (value >> (bits - take)) & ((1u << take) - 1);
+      data[pos >> 3] |= chunk << (avail - take);
+      pos += take;
+      bits -= take;
+   }
+}
+
+static uint32_t getBits(const uint8_t *data, uint16_t &pos, uint8_t bits)
+{
+   uint32_t value = 0;
+   while (bits)
+   {
+      uint8_t avail = 8 - (pos & 7);
+      uint8_t take = bits < avail ? bits : avail;
+      value = (value << take) | ((data[pos >> 3] >> (avail - take)) & ((1u << take) - 1));
+      pos += take;
+      bits -= take;
+   }
+   return value;
+}
+
+/**
+ * Delta of delta buckets, same as the Gorilla paper: 0 | 10+7 bits | 110+9 bits | 1110+12 bits | 1111+32 bits
+ */
+static void putTime(uint8_t *data, uint16_t &pos, TimeSeriesCodecState &s, uint32_t time)
+{
+   int32_t delta = (int32_t)(time - s.time);
+   int32_t dod = delta - s.delta;
+   if (dod == 0) putBits(data, pos, 0, 1);
+   else if (dod >= -63 && dod <= 64) { putBits(data, pos, 0b10, 2); putBits(data, pos, dod + 63, 7); }
+   else if (dod >= -255 && dod <= 256) { putBits(data, pos, 0b110, 3); putBits(data, pos, dod + 255, 9); }
+   else if (dod >= -2047 && dod <= 2048) { putBits(data, pos, 0b1110, 4); putBits(data, pos, dod + 2047, 12); }
+   else { putBits(data, pos, 0b1111, 4); putBits(data, pos, (uint32_t)dod, 32); }
+   s.delta = delta;
+   s.time = time;
+}
+
+static uint32_t getTime(const uint8_t *data, uint16_t &pos, TimeSeriesCodecState &s)
+{
+   int32_t dod;
+   if (getBits(data, pos, 1) == 0) dod = 0;
+   else if (getBits(data, pos, 1) == 0) dod = (int32_t)getBits(data, pos, 7) - 63;
+   else if (getBits(data, pos, 1) == 0) dod = (int32_t)getBits(data, pos, 9) - 255;
+   else if (getBits(data, pos, 1) == 0) dod = (int32_t)getBits(data, pos, 12) - 2047;
+   else dod = (int32_t)getBits(data, pos, 32);
+   s.delta += dod;
+   s.time += s.delta;
+   return s.time;
+}
+
+/**
+ * 0 when the value did not change, 10 + bits inside the previous window, 11 + leading zeros (5) + length - 1 (5) + bits
+ */
+static void putValue(uint8_t *data, uint16_t &pos, TimeSeriesCodecState &s, uint8_t ch, float value)
+{
+   uint32_t bits = floatBits(value);
+   uint32_t x = bits ^ s.value[ch];
+   s.value[ch] = bits;
+   if (x == 0)
+   {
+      putBits(data, pos, 0, 1);
+      return;
+   }
+   uint8_t leading = __builtin_clz(x);
+   uint8_t trailing = __builtin_ctz(x);
+   if (leading > 31) leading = 31;
+   if (s.meaningful[ch] != 0 && leading >= s.leading[ch] && trailing >= 32 - s.leading[ch] - s.meaningful[ch])
+   {
+      putBits(data, pos, 0b10, 2);
+      putBits(data, pos, x >> (32 - s.leading[ch] - s.meaningful[ch]), s.meaningful[ch]);
+   }
+   else
+   {
+      uint8_t meaningful = 32 - leading - trailing;
+      putBits(data, pos, 0b11, 2);
+      putBits(data, pos, leading, 5);
+      putBits(data, pos, meaningful - 1, 5);
+      putBits(data, pos, x >> trailing, meaningful);
+      s.leading[ch] = leading;
+      s.meaningful[ch] = meaningful;
+   }
+}
+
+static float getValue(const uint8_t *data, uint16_t &pos, TimeSeriesCodecState &s, uint8_t ch)
+{
+   if (getBits(data, pos, 1) != 0)
+   {
+      if (getBits(data, pos, 1) != 0)
+      {
+         s.leading[ch] = getBits(data, pos, 5);
+         s.meaningful[ch] = getBits(data, pos, 5) + 1;
+      }
+      uint8_t trailing = 32 - s.leading[ch] - s.meaningful[ch];
+      s.value[ch] ^= getBits(data, pos, s.meaningful[ch]) << trailing;
+   }
+   return bitsFloat(s.value[ch]);
+}
+
+bool TimeSeries::begin(size_t budgetBytes)
+{
+   if (_blocks != NULL) return true;
+   size_t blocks = budgetBytes / sizeof(TimeSeriesBlock);
+   if (blocks > UINT16_MAX) blocks = UINT16_MAX;
+#ifdef BOARD_HAS_PSRAM
+   _blocks = (TimeSeriesBlock *)heap_caps_malloc(blocks * sizeof(TimeSeriesBlock), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+   if (_blocks == NULL) blocks = TIMESERIES_FALLBACK_BUDGET / sizeof(TimeSeriesBlock);
+#endif
+   if (_blocks == NULL) _blocks = (TimeSeriesBlock *)malloc(blocks * sizeof(TimeSeriesBlock));
+   if (_blocks == NULL) return false;
+   _capacity = blocks;
+   clear();
+   return true;
+}
+
+void TimeSeries::clear()
+{
+   _droppedBlocks += _used;                     //keeps the block numbers going up
+   _head = 0;
+   _used = 0;
+   _samples = 0;
+   _sealed = false;
+   _written = 0;
+   _state = TimeSeriesCodecState();
+}
+
+TimeSeriesSample TimeSeries::sampleOf(uint32_t time, const ChargeControllerInfo &info)
+{
+   TimeSeriesSample sample;
+   sample.time = time;
+#define TIMESERIES_CHANNEL_VALUE(channel, field, name) sample.values[channel] = info.field;
+   TIMESERIES_CHANNEL_MAP(TIMESERIES_CHANNEL_VALUE)
+#undef TIMESERIES_CHANNEL_VALUE
+   return sample;
+}
+
+/**
+ * Opens a new block holding the sample uncompressed, dropping the oldest block when the ring is full.
+ */
+TimeSeriesBlock &TimeSeries::startBlock(const TimeSeriesSample &sample)
+{
+   if (_used == _capacity)
+   {
+      _samples -= block(0).count;
+      _head = (_head + 1) % _capacity;
+      _used--;
+      _droppedBlocks++;
+   }
+   _used++;
+   TimeSeriesBlock &b = block(_used - 1);
+   memset(&b, 0, sizeof(b));
+   b.startTime = b.endTime = sample.time;
+   b.count = 1;
+   _sealed = false;
+   _written = 0;
+   _state = TimeSeriesCodecState();
+   _state.time = sample.time;
+   for (uint8_t ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+   {
+      _state.value[ch] = floatBits(sample.values[ch]);
+      putBits(b.data, b.bitLength, _state.value[ch], 32);
+   }
+   _samples++;
+   return b;
+}
+
+void TimeSeries::append(const TimeSeriesSample &sample)
+{
+   if (_capacity == 0) return;
+
+   //The clock was set back (the RTC or NTP came up after the first samples), the old timestamps mean nothing now.
+   if (_used > 0 && sample.time < _state.time) clear();
+
+   if (_used == 0 || _sealed || block(_used - 1).bitLength + TIMESERIES_MAX_SAMPLE_BITS > TIMESERIES_DATA_BITS)
+   {
+      seal();
+      startBlock(sample);
+      return;
+   }
+
+   TimeSeriesBlock &b = block(_used - 1);
+   putTime(b.data, b.bitLength, _state, sample.time);
+   for (uint8_t ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+   {
+      putValue(b.data, b.bitLength, _state, ch, sample.values[ch]);
+   }
+   b.endTime = sample.time;
+   b.count++;
+   _samples++;
+}
+
+/**
+ * Decodes b, calling func for the samples with from <= time <= to. Returns false once there is no point going on,
+ * either func asked to stop or the samples went past to.
+ */
+bool TimeSeries::decodeBlock(const TimeSeriesBlock &b, uint32_t from, uint32_t to, uint32_t &visited, std::function<bool(const TimeSeriesSample &)> &func)
+{
+   TimeSeriesCodecState s;
+   TimeSeriesSample sample;
+   uint16_t pos = 0;
+   s.time = sample.time = b.startTime;
+   for (uint8_t ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+   {
+      s.value[ch] = getBits(b.data, pos, 32);
+      sample.values[ch] = bitsFloat(s.value[ch]);
+   }
+   for (uint16_t i = 0; i < b.count; i++)
+   {
+      if (i > 0)
+      {
+         sample.time = getTime(b.data, pos, s);
+         for (uint8_t ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+         {
+            sample.values[ch] = getValue(b.data, pos, s, ch);
+         }
+      }
+      if (sample.time > to) return false;
+      if (sample.time < from) continue;
+      visited++;
+      if (!func(sample)) return false;
+   }
+   return true;
+}
+
+uint32_t TimeSeries::query(uint32_t from, uint32_t to, std::function<bool(const TimeSeriesSample &)> func) const
+{
+   uint32_t visited = 0;
+   for (uint16_t n = 0; n < _used; n++)
+   {
+      const TimeSeriesBlock &b = block(n);
+      if (b.endTime < from) continue;
+      if (b.startTime > to) break;
+      if (!decodeBlock(b, from, to, visited, func)) break;
+   }
+   return visited;
+}
+
+uint32_t TimeSeries::blockNumberAt(uint32_t time) const
+{
+   uint16_t n = 0;
+   while (n < _used && block(n).endTime < time) n++;
+   return _droppedBlocks + n;
+}
+
+bool TimeSeries::copyBlock(uint32_t number, TimeSeriesBlock &out) const
+{
+   if (number < _droppedBlocks || number - _droppedBlocks >= _used) return false;
+   const TimeSeriesBlock &b = block(number - _droppedBlocks);
+   memcpy(&out, &b, blockBytes(b));
+   return true;
+}
+
+uint32_t TimeSeries::countInRange(uint32_t from, uint32_t to) const
+{
+   uint32_t count = 0;
+   for (uint16_t n = 0; n < _used; n++)
+   {
+      const TimeSeriesBlock &b = block(n);
+      if (b.endTime >= from && b.startTime <= to) count += b.count;
+   }
+   return count;
+}
+
+size_t TimeSeries::bytesInUse() const
+{
+   if (_used == 0) return 0;
+   return (_used - 1) * sizeof(TimeSeriesBlock) + blockBytes(block(_used - 1));
+}
+
+size_t TimeSeries::blockBytes(const TimeSeriesBlock &b)
+{
+   return offsetof(TimeSeriesBlock, data) + (b.bitLength + 7) / 8;
+}
+
+void TimeSeries::seal()
+{
+   if (_used == 0 || _sealed) return;
+   _sealed = true;
+   flush();
+}
+
+void TimeSeries::flush()
+{
+   if (_used == 0) return;
+   const TimeSeriesBlock &b = block(_used - 1);
+   if (b.count == _written) return;
+   _written = b.count;
+   if (onBlockWritten) onBlockWritten(b);
+}
@@ -0,0 +1,148 @@
+/**
+ * In memory history of the charger measurements, compressed the way Facebook's Gorilla does it: timestamps
+ * are stored as the delta of the delta from the previous sample, values as the XOR with the previous value
+ * with only the meaningful bits written. Readings that sit still cost a single bit per channel, so the fixed
+ * budget holds days of samples taken every few seconds.
+ *
+ * The samples go into a ring of fixed size blocks, when the ring is full the oldest block is dropped.
+ * onBlockWritten is called with each block once no more samples will go into it, and by flush() with the
+ * open block as far as it has got. It is the only place blocks are handed out so they can be kept somewhere
+ * more durable, a block can be handed out several times as it grows and the last one holds all of it.
+ * The store does no locking of its own, the owner has to serialise append() against the queries.
+ */
+
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <Arduino.h>
+#include <functional>
+#include "ChargeControllerInfo.h"
+
+#define TIMESERIES_BLOCK_BYTES 1024             //size of one block, header included
+
+#ifdef BOARD_HAS_PSRAM
+#define TIMESERIES_BUDGET (2 * 1024 * 1024)     //bytes of history kept in PSRAM
+#else
+#define TIMESERIES_BUDGET (32 * 1024)           //bytes of history kept on the heap
+#endif
+#define TIMESERIES_FALLBACK_BUDGET (32 * 1024)  //used when the PSRAM allocation fails
+
+/**
+ * X(channel, field, name)
+ *   channel - index of the value in TimeSeriesSample::values
+ *   field   - member of ChargeControllerInfo that is recorded
+ *   name    - key used for the channel in the JSON output
+ * The first five line up with AutoMeasure.
+ */
+#define TIMESERIES_CHANNEL_MAP(X) \
+    X(TS_SOC,                SOC,                "SOC") \
+    X(TS_BATVOLTAGE,         BatVoltage,         "BatVoltage") \
+    X(TS_BATCURRENT,         BatCurrent,         "BatCurrent") \
+    X(TS_PVVOLTAGE,          PVVoltage,          "PVVoltage") \
+    X(TS_PVCURRENT,          PVCurrent,          "PVCurrent") \
+    X(TS_POWER,              Power,              "Power") \
+    X(TS_ENERGYTODAY,        EnergyToday,        "EnergyToday") \
+    X(TS_CHARGESTATE,        ChargeState,        "ChargeState") \
+    X(TS_BATTEMPERATURE,     BatTemperature,     "BatTemperature") \
+    X(TS_FETTEMPERATURE,     FETTemperature,     "FETTemperature") \
+    X(TS_PCBTEMPERATURE,     PCBTemperature,     "PCBTemperature") \
+    X(TS_WHIZBANGBATCURRENT, WhizbangBatCurrent, "WhizbangBatCurrent")
+
+#define TIMESERIES_CHANNEL_ENUM(channel, field, name) channel,
+enum TimeSeriesChannel : uint8_t { TIMESERIES_CHANNEL_MAP(TIMESERIES_CHANNEL_ENUM) TIMESERIES_CHANNELS };
+#undef TIMESERIES_CHANNEL_ENUM
+
+extern const char *const timeSeriesChannelNames[TIMESERIES_CHANNELS];
+
+struct TimeSeriesSample
+{
+   uint32_t time = 0;                           //seconds, as returned by time()
+   float values[TIMESERIES_CHANNELS] = {0};
+};
+
+/**
+ * Everything the encoder needs to carry from one sample to the next, the decoder keeps the same.
+ */
+struct TimeSeriesCodecState
+{
+   uint32_t time = 0;
+   int32_t delta = 0;
+   uint32_t value[TIMESERIES_CHANNELS] = {0};   //raw float bits
+   uint8_t leading[TIMESERIES_CHANNELS] = {0};  //window of the last XOR that was written with its own window
+   uint8_t meaningful[TIMESERIES_CHANNELS] = {0};
+};
+
+struct TimeSeriesBlock
+{
+   uint32_t startTime;
+   uint32_t endTime;
+   uint16_t count;
+   uint16_t bitLength;
+   uint8_t data[TIMESERIES_BLOCK_BYTES - 12];
+};
+
+class TimeSeries
+{
+public:
+   bool begin(size_t budgetBytes = TIMESERIES_BUDGET);
+
+   void append(const TimeSeriesSample &sample);
+
+   //The recorded channels of info, stamped with time
+   static TimeSeriesSample sampleOf(uint32_t time, const ChargeControllerInfo &info);
+
+   /**
+    * Calls func for every sample with from <= time <= to, oldest first, until it returns false.
+    * Returns the number of samples visited.
+    */
+   uint32_t query(uint32_t from, uint32_t to, std::function<bool(const TimeSeriesSample &)> func) const;
+
+   //Upper bound of the samples query() would visit, worked out from the block headers without decoding
+   uint32_t countInRange(uint32_t from, uint32_t to) const;
+
+   /**
+    * Blocks are numbered as they are started and the numbers are never reused, so a reader in another task
+    * can take the blocks one at a time with copyBlock() and decode the copies without holding its lock.
+    */
+   uint32_t blockNumberAt(uint32_t time) const;  //first block that ends at or after time
+   uint32_t endBlockNumber() const { return _droppedBlocks + _used; }
+   bool copyBlock(uint32_t number, TimeSeriesBlock &out) const; //false once the block has been dropped
+
+   void clear();
+
+   //Closes the newest block early, the next sample starts a new one
+   void seal();
+   //Hands the open block to onBlockWritten as it is, it goes on taking samples
+   void flush();
+   std::function<void(const TimeSeriesBlock &)> onBlockWritten;
+
+   //Bytes of b that hold data, a copy this long decodes the same as the block
+   static size_t blockBytes(const TimeSeriesBlock &b);
+   static bool decodeBlock(const TimeSeriesBlock &b, uint32_t from, uint32_t to, uint32_t &visited, std::function<bool(const TimeSeriesSample &)> &func);
+
+   uint32_t sampleCount() const { return _samples; }
+   uint32_t droppedBlocks() const { return _droppedBlocks; } //dropped for room or cleared
+   uint16_t blocksInUse() const { return _used; }
+   uint16_t blockCapacity() const { return _capacity; }
+   uint32_t oldestTime() const { return _used ? block(0).startTime : 0; }
+   uint32_t newestTime() const { return _used ? block(_used - 1).endTime : 0; }
+   uint32_t newestBlockStart() const { return _used ? block(_used - 1).startTime : 0; }
+   size_t bytesInUse() const;
+
+private:
+   TimeSeriesBlock *_blocks = NULL;
+   uint16_t _capacity = 0;
+   uint16_t _head = 0;                          //oldest block
+   uint16_t _used = 0;
+   uint32_t _samples = 0;
+   uint32_t _droppedBlocks = 0;
+   bool _sealed = false;                        //the newest block takes no more samples
+   uint16_t _written = 0;                       //samples of the newest block onBlockWritten has been given
+   TimeSeriesCodecState _state;                 //encoder state of the newest block
+
+   TimeSeriesBlock &block(uint16_t n) { return _blocks[(_head + n) % _capacity]; }
+   const TimeSeriesBlock &block(uint16_t n) const { return _blocks[(_head + n) % _capacity]; }
+   TimeSeriesBlock &startBlock(const TimeSeriesSample &sample);
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "TimerWheel.h"
+
+#define TIMER_WHEEL_NONE 0xFFFF
+
+static_assert((TIMER_WHEEL_SLOTS & (TIMER_WHEEL_SLOTS - 1)) == 0, "TIMER_WHEEL_SLOTS has to be a power of two");
+
+uint64_t monotonicMillis()
+{
+   return (uint64_t)esp_timer_get_time() / 1000;
+}
+
+void TimerWheel::init()
+{
+   for (uint16_t i = 0; i < _size; i++)
+   {
+      _timers[i].next = (i + 1 < _size) ? i + 1 : TIMER_WHEEL_NONE;
+      _timers[i].generation = 0;
+      _timers[i].slot = TIMER_WHEEL_NONE;
+   }
+   _free = 0;
+   for (uint16_t s = 0; s < TIMER_WHEEL_SLOTS; s++) _slots[s] = TIMER_WHEEL_NONE;
+   memset(_occupied, 0, sizeof(_occupied));
+}
+
+//Ids carry the generation in the top half so one that has fired and been reused does not match any more
+static inline TimerId timerId(uint16_t index, uint16_t generation)
+{
+   return ((uint32_t)generation << 16) | (index + 1);
+}
+
+TimerWheel::Timer *TimerWheel::find(TimerId id) const
+{
+   uint16_t index = (id & 0xFFFF) - 1;
+   if (id == 0 || index >= _size) return NULL;
+   const Timer &t = _timers[index];
+   if (t.slot == TIMER_WHEEL_NONE || t.generation != (id >> 16)) return NULL;
+   return (Timer *)&t;
+}
+
+/**
+ * Puts the timer in the slot of the first tick that starts at or after its expiry, or of the next tick when
+ * that has already gone by. Called with _lock held.
+ */
+void TimerWheel::link(uint16_t index)
+{
+   Timer &t = _timers[index];
+   uint64_t tick = (t.expiry + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK;
+   if (tick <= _tick) tick = _tick + 1;
+   uint16_t slot = tick & (TIMER_WHEEL_SLOTS - 1);
+   t.slot = slot;
+   t.prev = TIMER_WHEEL_NONE;
+   t.next = _slots[slot];
+   if (t.next != TIMER_WHEEL_NONE) _timers[t.next].prev = index;
+   _slots[slot] = index;
+   _occupied[slot / 32] |= 1UL << (slot % 32);
+}
+
+//Takes the timer out of its slot. Called with _lock held.
+void TimerWheel::unlink(uint16_t index)
+{
+   Timer &t = _timers[index];
+   if (t.prev != TIMER_WHEEL_NONE) _timers[t.prev].next = t.next;
+   else _slots[t.slot] = t.next;
+   if (t.next != TIMER_WHEEL_NONE) _timers[t.next].prev = t.prev;
+   if (_slots[t.slot] == TIMER_WHEEL_NONE) _occupied[t.slot / 32] &= ~(1UL << (t.slot % 32));
+   t.slot = TIMER_WHEEL_NONE;
+}
+
+TimerId TimerWheel::startAt(uint64_t when, TimerCallback callback, uint32_t arg, uint64_t period)
+{
+   portENTER_CRITICAL(&_lock);
+   uint16_t index = _free;
+   if (index == TIMER_WHEEL_NONE)
+   {
+      portEXIT_CRITICAL(&_lock);
+      return 0;
+   }
+   Timer &t = _timers[index];
+   _free = t.next;
+   t.expiry = when;
+   t.period = period;
+   t.callback = callback;
+   t.arg = arg;
+   t.generation++;
+   link(index);
+   _active++;
+   TimerId id = timerId(index, t.generation);
+   portEXIT_CRITICAL(&_lock);
+   return id;
+}
+
+TimerId TimerWheel::start(uint64_t delay, TimerCallback callback, uint32_t arg, uint64_t period)
+{
+   return startAt(monotonicMillis() + delay, callback, arg, period);
+}
+
+TimerId TimerWheel::restart(TimerId id, uint64_t delay, TimerCallback callback, uint32_t arg)
+{
+   cancel(id);
+   return start(delay, callback, arg);
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+   portENTER_CRITICAL(&_lock);
+   Timer *t = find(id);
+   if (t != NULL)
+   {
+      uint16_t index = t - _timers;
+      unlink(index);
+      t->next = _free;
+      _free = index;
+      _active--;
+   }
+   portEXIT_CRITICAL(&_lock);
+   return t != NULL;
+}
+
+bool TimerWheel::pending(TimerId id) const
+{
+   portENTER_CRITICAL(&_lock);
+   bool found = find(id) != NULL;
+   portEXIT_CRITICAL(&_lock);
+   return found;
+}
+
+void TimerWheel::run(uint64_t now)
+{
+   uint64_t tick = now / TIMER_WHEEL_TICK;
+   if (tick <= _tick) return;
+
+   //Past a whole turn of the wheel every slot has been looked at once, which is enough as expiries are absolute.
+   uint64_t first = _tick + 1;
+   if (tick - _tick > TIMER_WHEEL_SLOTS) first = tick - TIMER_WHEEL_SLOTS + 1;
+   for (uint64_t t = first; t <= tick; t++)
+   {
+      uint16_t slot = t & (TIMER_WHEEL_SLOTS - 1);
+      if (!(_occupied[slot / 32] & (1UL << (slot % 32)))) continue;
+
+      //Fire the due timers one at a time, the callback may change the slot so look at it afresh each time.
+      for (;;)
+      {
+         portENTER_CRITICAL(&_lock);
+         _tick = t - 1;
+         uint16_t index = _slots[slot];
+         while (index != TIMER_WHEEL_NONE && _timers[index].expiry > now) index = _timers[index].next;
+         if (index == TIMER_WHEEL_NONE)
+         {
+            portEXIT_CRITICAL(&_lock);
+            break;
+         }
+         Timer &timer = _timers[index];
+         TimerCallback callback = timer.callback;
+         uint32_t arg = timer.arg;
+         unlink(index);
+         if (timer.period != 0)
+         {
+            //Keep to the period's beat, unless it has fallen more than a period behind
+            timer.expiry += timer.period;
+            if (timer.expiry <= now) timer.expiry = now + timer.period;
+            _tick = t;
+            link(index);
+         }
+         else
+         {
+            timer.next = _free;
+            _free = index;
+            _active--;
+         }
+         portEXIT_CRITICAL(&_lock);
+         callback(arg);
+      }
+   }
+   portENTER_CRITICAL(&_lock);
+   _tick = tick;
+   portEXIT_CRITICAL(&_lock);
+}
@@ -0,0 +1,100 @@
+/**
+ * Hashed timer wheel on a 64 bit millisecond clock that does not wrap. Timers hash on their expiry tick into
+ * one of TIMER_WHEEL_SLOTS slots, so starting or cancelling one is O(1) and run() only looks at the slots the
+ * clock has moved past, skipping the empty ones through a bitmap. A pass over the loop with nothing due costs
+ * a compare.
+ *
+ * Timers come from a fixed pool and call a plain function with a 32 bit argument, nothing is allocated once
+ * the wheel is constructed. Each wheel is a TimerWheelPool sized for the timers its user can have pending. Timers can be started and cancelled from any task; the callbacks run in the task
+ * that calls run(), outside the wheel's lock, so they may start and cancel timers themselves.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <Arduino.h>
+
+#define TIMER_WHEEL_SLOTS 256               //power of two
+#define TIMER_WHEEL_TICK 10                 //ms, the resolution of the timers
+
+typedef void (*TimerCallback)(uint32_t arg);
+typedef uint32_t TimerId;                   //0 is never a valid timer
+
+/**
+ * Milliseconds since boot, from the 64 bit esp_timer clock so it never wraps.
+ */
+uint64_t monotonicMillis();
+
+class TimerWheel
+{
+public:
+   /**
+    * Calls callback(arg) delay ms from now, and then every period ms when period is not 0. Returns 0 when
+    * every timer of the pool is in use, callers have to cope with that.
+    */
+   TimerId start(uint64_t delay, TimerCallback callback, uint32_t arg, uint64_t period = 0);
+   TimerId startAt(uint64_t when, TimerCallback callback, uint32_t arg, uint64_t period = 0);
+
+   /**
+    * Cancels id, if it is still pending, and starts it again delay ms from now. For deadlines that move out
+    * each time something happens, like a save that waits for the changes to stop.
+    */
+   TimerId restart(TimerId id, uint64_t delay, TimerCallback callback, uint32_t arg);
+
+   bool cancel(TimerId id);                 //false when id had already fired or been cancelled
+   bool pending(TimerId id) const;
+   uint16_t active() const { return _active; }
+   bool full() const { return _active >= _size; }
+
+   /**
+    * Fires every timer that is due. Called from the one task the callbacks are meant to run in.
+    */
+   void run(uint64_t now);
+   void run() { run(monotonicMillis()); }
+
+protected:
+   struct Timer
+   {
+      uint64_t expiry;                      //ms on the monotonic clock
+      uint64_t period;                      //ms, 0 for a one shot
+      TimerCallback callback;
+      uint32_t arg;
+      uint16_t next;                        //in the slot list or the free list, TIMER_WHEEL_NONE at the end
+      uint16_t prev;
+      uint16_t generation;                  //bumped each time it is taken from the pool, makes stale ids harmless
+      uint16_t slot;                        //TIMER_WHEEL_NONE while it is not pending
+   };
+
+   TimerWheel(Timer *timers, uint16_t size) : _timers(timers), _size(size) {}
+   void init();                             //links the pool into the free list, once it has been constructed
+
+private:
+   Timer *_timers;                          //the pool, owned by the TimerWheelPool
+   uint16_t _size;
+   uint16_t _slots[TIMER_WHEEL_SLOTS];      //first timer of each slot
+   uint32_t _occupied[TIMER_WHEEL_SLOTS / 32]; //slots with a timer in them, one bit each
+   uint16_t _free;
+   uint16_t _active = 0;
+   uint64_t _tick = 0;                      //last tick run() has been through
+   mutable portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+
+   Timer *find(TimerId id) const;
+   void link(uint16_t index);
+   void unlink(uint16_t index);
+};
+
+/**
+ * A wheel with a pool of Timers timers (32 bytes each), the most that can be pending on it at once.
+ */
+template <uint16_t Timers>
+class TimerWheelPool : public TimerWheel
+{
+public:
+   TimerWheelPool() : TimerWheel(_pool, Timers) { init(); }
+
+private:
+   static_assert(Timers > 0 && Timers < 0xFFFF, "timers are linked by a 16 bit index");
+   Timer _pool[Timers];
+};
+
+#endif
@@ -6,14 +6,31 @@
 String allMeasureStrings(AutoMeasure select){
   String retString;
   for (int i=SOC; i<=IGNORE; i++){
-    retString = "<option value=\"" + autoMeasureInfo[(AutoMeasure)i].shortName + "\" ";
+    retString += "<option value=\"" + autoMeasureInfo[(AutoMeasure)i].shortName + "\" ";
     retString += (select==(AutoMeasure)i?"selected":"");
     retString += ">" + autoMeasureInfo[(AutoMeasure)i].longName + "</option>";
   }
   return retString;
 }
 
-String configHTML(LilygoRelays::lilygoRelay relay, AutoData relayAutoData){  
+/*
+Text made safe to put inside an attribute value or an element, a rule is full of && and <.
+*/
+String htmlEscape(const char *text){
+  String retString;
+  for (; *text != 0; text++){
+    switch (*text){
+      case '&': retString += "&amp;"; break;
+      case '"': retString += "&quot;"; break;
+      case '<': retString += "&lt;"; break;
+      case '>': retString += "&gt;"; break;
+      default: retString += *text;
+    }
+  }
+  return retString;
+}
+
+String configHTML(LilygoRelays::lilygoRelay relay, const AutoData &relayAutoData){  
   return 
       String("<div class=\"relay-section\">")
     + String("<h3>" + relay.getRelayFixedName() + "</h3>")
@@ -36,6 +53,27 @@ String configHTML(LilygoRelays::lilygoRelay relay, AutoData relayAutoData){
     + String(     "<input type=\"number\" id=\"" + relay.getRelayFixedShortName() + "-value\" name=\"" + relay.getRelayFixedShortName() + "-value\" step=\"any\" value=\"" + relayAutoData.value + "\">")
     + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-restorevalue\">Res. Value:</label>")
     + String(     "<input type=\"number\" id=\"" + relay.getRelayFixedShortName() + "-restorevalue\" name=\"" + relay.getRelayFixedShortName() + "-restorevalue\" step=\"any\" value=\"" + relayAutoData.restoreValue + "\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-margin\">Near margin:</label>")
+    + String(     "<input type=\"number\" id=\"" + relay.getRelayFixedShortName() + "-margin\" name=\"" + relay.getRelayFixedShortName() + "-margin\" step=\"any\" min=\"0\" value=\"" + (relayAutoData.nearMargin >= 0 ? String(relayAutoData.nearMargin) : String("")) + "\" placeholder=\"" + String(autoMeasureInfo[relayAutoData.measure].nearMargin) + "\">")
+    + String(   "</div>")
+    + String(   "<div class=\"relay-item\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-on\">On at:</label>")
+    + String(     "<input type=\"time\" id=\"" + relay.getRelayFixedShortName() + "-on\" name=\"" + relay.getRelayFixedShortName() + "-on\" value=\"" + minuteOfDayText(relayAutoData.onAt) + "\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-off\">Off at:</label>")
+    + String(     "<input type=\"time\" id=\"" + relay.getRelayFixedShortName() + "-off\" name=\"" + relay.getRelayFixedShortName() + "-off\" value=\"" + minuteOfDayText(relayAutoData.offAt) + "\">")
+    + String(   "</div>")
+    + String(   "<div class=\"relay-item\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-minon\">Min on (s):</label>")
+    + String(     "<input type=\"number\" id=\"" + relay.getRelayFixedShortName() + "-minon\" name=\"" + relay.getRelayFixedShortName() + "-minon\" min=\"0\" max=\"65535\" value=\"" + relayAutoData.minOnSeconds + "\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-minoff\">Min off (s):</label>")
+    + String(     "<input type=\"number\" id=\"" + relay.getRelayFixedShortName() + "-minoff\" name=\"" + relay.getRelayFixedShortName() + "-minoff\" min=\"0\" max=\"65535\" value=\"" + relayAutoData.minOffSeconds + "\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-maxperhour\">Max switches/h:</label>")
+    + String(     "<input type=\"number\" id=\"" + relay.getRelayFixedShortName() + "-maxperhour\" name=\"" + relay.getRelayFixedShortName() + "-maxperhour\" min=\"0\" max=\"255\" value=\"" + relayAutoData.maxSwitchesPerHour + "\">")
+    + String(   "</div>")
+    + String(   "<div class=\"relay-item\">")
+    + String(     "<label for=\"" + relay.getRelayFixedShortName() + "-rule\">Rule:</label>")
+    + String(     "<input type=\"text\" id=\"" + relay.getRelayFixedShortName() + "-rule\" name=\"" + relay.getRelayFixedShortName() + "-rule\" value=\"" + htmlEscape(relayAutoData.rule.text()) + "\" maxlength=\"" + String(RULE_TEXT_MAX - 1) + "\" placeholder=\"SOC > 80 AND PVCURRENT > 10 FOR 5m\">")
+    + (relayAutoData.rule.error() ? String("<span class=\"rule-error\">" + String(relayAutoData.rule.error()) + " at " + String(relayAutoData.rule.errorAt()) + "</span>") : String(""))
     + String(   "</div>")
     + String("</div>");
 }
@@ -2,6 +2,6 @@
 #include "LilyGoRelays.hpp"
 #include "AutoData.h"
 
-String configHTML(LilygoRelays::lilygoRelay relay, AutoData relayAutoData);
+String configHTML(LilygoRelays::lilygoRelay relay, const AutoData &relayAutoData);
 String actionHTML(LilygoRelays::lilygoRelay relay);
 String eventListenerJS(LilygoRelays::lilygoRelay relay);
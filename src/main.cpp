@@ -23,9 +23,13 @@ This code works with all the Lilygo Relay boards.
 #include "ChargeControllerInfo.h"
 #include "OTAStuff.h"
 #include "ModbusStuff.h"
+#include "FlashLog.h"
+#include "ModbusServer.h"
 #include "secrets.h"
 #include "WebStuff.h"
 #include "AutoData.h"
+#include "TimerWheel.h"
+#include "DecisionTrace.h"
 
 // Create AsyncWebServer object on port 80
 AsyncWebServer server(80);
@@ -78,6 +82,9 @@ const long interval = 10*1000;  // Wait 10 seconds for Wi-Fi connection (millise
 
 using namespace ace_button;
 #define RELAY_SAVE_DELAY                  2000 // Delay to wait after a save was requested in case we get a bunch quickly
+#define WIFI_RECONNECT_INTERVAL           60000 // Check every minute that WiFi is still up
+#define RELAY_SCHEDULE_RETRY              60000 // Wait for the clock to be set before arming the relay schedules
+#define RTC_READ_INTERVAL                 600000 // 10 minutes
 
 const char *ntpServer1 = "pool.ntp.org";
 const char *ntpServer2 = "time.nist.gov";
@@ -92,19 +99,31 @@ LilygoRelays relays = LilygoRelays(LilygoRelays::Lilygo4Relays,1);
 LilygoRelays relays = LilygoRelays(LilygoRelays::Lilygo8Relays,1);
 #elif defined(LILYGO_RELAY6)
 LilygoRelays relays = LilygoRelays(LilygoRelays::Lilygo6Relays,LILYGO_RELAY6_BANKS);
-uint32_t lastMillis;
 SensorPCF8563 rtc;
 #endif
 
 // Timer variables
-uint32_t lastSaveRequestTime=-1;
-uint32_t wifiNeedsSave=-1;
+//Per relay: the two schedule timers and the recheck timer, then the saves and the periodic checks
+TimerWheelPool<3 * AUTO_MAX_RELAYS + 16> timers; //deadlines of loop(), their callbacks run from there
+TimerId relaySaveTimer = 0;           //restarted on every change so the save waits for them to stop
+TimerId wifiSaveTimer = 0;
+TimerId scheduleTimers[AUTO_MAX_RELAYS][2] = {{0}}; //[relay][on], next time of day the relay is switched
+TimerId recheckTimers[AUTO_MAX_RELAYS] = {0};     //looks at a relay again once its held back switch is allowed
+uint32_t relaysToRecheck = 0;         //set by recheckTimers, one bit per relay
+bool relaySchedulesChanged = true;    //arm the time of day schedules again from loop()
+RelayRule *pendingRules[AUTO_MAX_RELAYS] = {NULL}; //compiled by the web server's task, installed by loop() between evaluations
+portMUX_TYPE pendingRulesLock = portMUX_INITIALIZER_UNLOCKED;
 
 unsigned long lastTime = 0;  
 unsigned long timerDelay = 30000;
-unsigned long wifiReconnectPreviousMillis = millis();
 
 bool modbusGood = false;
+uint32_t lastChargerDataSequence = 0; //sequence of the charger data that was last acted on
+bool autoControlConfigChanged = true; //relay settings changed, run auto control on the next data even if no measure moved
+AutoControlIndex autoControlIndex;    //relays per measure, rebuilt when the relay settings change
+uint32_t relaysNearThreshold = 0;     //relays whose measures were close to switching them when last looked at
+uint32_t loggedRelayStates = 0;       //relay states as last written to the flash log, one bit per relay
+bool relayStatesLogged = false;
 
 // Create a eSPIFFS class
 #ifndef USE_SERIAL_DEBUG_FOR_eSPIFFS
@@ -192,6 +211,8 @@ void ButtonHandleEvent(AceButton *n, uint8_t eventType, uint8_t buttonState)
             Serial.println(relays[i].getUserData());
             automaticData[i] = fromJson(relays[i].getUserData());
           }
+          autoControlConfigChanged = true;
+          relaySchedulesChanged = true;
         }
         Serial.println(relays[0].getUserData());
         Serial.println(relays[1].getUserData());
@@ -225,6 +246,9 @@ String measureText(chargerDataForRelayControl cd){
     retString += "A; PV Volts: " + String(cd.PVVoltage,2);
     retString += "V; PV Curr: " + String(cd.PVCurrent,2);
     retString += "A";
+    if (cd.controllers > 1) {
+      retString += " (" + String(cd.controllers) + " controllers)";
+    }
     
     struct tm *timeinfo;
     timeinfo = localtime(&cd.timeDataWasGathered);
@@ -333,6 +357,7 @@ bool initWiFi() {
 }
 
 void relayUpdated(int relay, int value){
+  relaySwitched(automaticData[relay], value, monotonicMillis() / 1000);
   if (events.count()>0){
     events.send(String(value).c_str(), relays[relay].getRelayFixedShortName().c_str(),millis());
   }
@@ -340,54 +365,242 @@ void relayUpdated(int relay, int value){
 
 void measuresUpdated(chargerDataForRelayControl cd){
   if (events.count()>0 & (millis() - (cd.gatherMillis) < DEFAULT_GATHER_RATE*2)){
-    events.send(measureText(getChargerData()).c_str(), "chargedata", millis());
+    events.send(measureText(cd).c_str(), "chargedata", millis());
   }
 }
 
 
+/*
+Write any relay that changed state since the last call to the flash log, whatever changed it (automatic
+control, a button or the web page). The first call logs every relay so the log starts from a known state.
+*/
+void logRelayTransitions(){
+  time_t now;
+  time(&now);
+  for (int i=0; i<relays.numberOfRelays() && i<32; i++){
+    bool on = relays[i].getRelayStatus();
+    if (!relayStatesLogged || on != (bool)bitRead(loggedRelayStates, i)){
+      FlashLogRelayTransition transition = {(uint8_t)i, (uint8_t)on, 0};
+      flashLog.append(FLASHLOG_RELAY, now, &transition, sizeof(transition));
+      bitWrite(loggedRelayStates, i, on);
+    }
+  }
+  relayStatesLogged = true;
+}
+
+/*
+Put the rules the web page compiled in place of the ones auto control evaluates. Called from loop() only, so a
+rule is never changed under doAutoControl().
+*/
+void installPendingRules(){
+  for (int i=0; i<AUTO_MAX_RELAYS; i++){
+    portENTER_CRITICAL(&pendingRulesLock);
+    RelayRule *rule = pendingRules[i];
+    pendingRules[i] = NULL;
+    portEXIT_CRITICAL(&pendingRulesLock);
+    if (rule != NULL){
+      automaticData[i].rule = *rule;
+      delete rule;
+      autoControlConfigChanged = true;
+    }
+  }
+}
+
+//Timer callback, a relay whose switch was held back may switch now
+void recheckRelay(uint32_t relay){
+  relaysToRecheck |= 1UL << relay;
+}
+
 /*
 Process the settings found in autoData against the data collected from the solar charger and 
 change the state of any relays that need to be switched based on the charger data.
+Only the automatic relays in relayMask are looked at, the others keep the state they are in. A relay is
+not switched before its dwell time is up or past its switches per hour, it is looked at again once it may.
 Note calling setRelayStatus will only chage the relay if the value is different and it will handle
 sending out the event to update the screen etc.
 */
-void doAutoControl(chargerDataForRelayControl cd){
-  double theCurrentValue;
+void doAutoControl(chargerDataForRelayControl cd, uint32_t relayMask){
+  PollUrgency urgency = POLL_NORMAL; //stays normal when no relay is automatic
   //Make sure that the data that was received is recent
   if (millis() - cd.gatherMillis <= DEFAULT_GATHER_RATE){
-    for (int i=0; i< relays.numberOfRelays(); i++){
-      //Only run the check if the measure is not "IGNORE"
-      if (automaticData[i].measure != IGNORE){
-        switch (automaticData[i].measure) {
-        case SOC:
-          theCurrentValue = cd.SOC;
-          break;
-        case BATVOLT:
-          theCurrentValue = cd.BatVoltage;
-          break;
-        case BATCURRENT:
-          theCurrentValue = cd.BatCurrent;
-          break;
-        case PVVOLT:
-          theCurrentValue = cd.PVVoltage;
-          break;
-        case PVCURRENT:
-          theCurrentValue = cd.PVCurrent;
-          break;
-        default:
-          theCurrentValue = cd.SOC;
-          break;
+    relayMask &= autoControlIndex.automatic();
+    for (; relayMask != 0; relayMask &= relayMask - 1){
+      int i = __builtin_ctz(relayMask);
+      AutoData &ad = automaticData[i];
+      bool current = relays[i].getRelayStatus();
+      unsigned long now = millis();
+      bool wanted = autoAdjustRelay(ad, cd, current, now);
+      DecisionRecord decision;
+      decision.millis = now;
+      decision.relay = i;
+      if (ad.rule.empty()) {
+        decision.measure = ad.measure;
+        decision.reading = measureValue(ad.measure, cd);
+        decision.value = ad.value;
+        decision.restoreValue = ad.restoreValue;
+      } else {
+        decision.measure = DECISION_MEASURE_RULE;
+        decision.reading = decision.value = decision.restoreValue = NAN;
+      }
+      decision.holdOff = 0;
+      decision.outcome = DECISION_KEPT;
+      if (wanted != current) {
+        bool byDwell;
+        decision.holdOff = relaySwitchHoldOff(ad, wanted, monotonicMillis() / 1000, byDwell);
+        if (decision.holdOff == 0) {
+          relays[i].setRelayStatus(wanted);
+          decision.outcome = DECISION_SWITCHED;
+        } else {
+          decision.outcome = byDwell ? DECISION_HELD_DWELL : DECISION_HELD_RATE;
+          if (!timers.pending(recheckTimers[i])) {
+            recheckTimers[i] = timers.start((uint64_t)decision.holdOff * 1000, recheckRelay, i);
+            if (recheckTimers[i] == 0) {
+              //Look at every relay again with the next data instead
+              ESP_LOGE(TAG, "No timer free to recheck relay %d", i);
+              autoControlConfigChanged = true;
+            }
+          }
         }
-
-        Serial.println("Checking relay = " + String(i));
-        relays[i].setRelayStatus(
-          autoAdjustSingleRelay(
-            theCurrentValue, 
-            relays[i].getRelayStatus(),
-            automaticData[i]));
       }
+      decision.state = (current ? DECISION_STATE_BEFORE : 0) | (wanted ? DECISION_STATE_WANTED : 0) |
+                       (relays[i].getRelayStatus() ? DECISION_STATE_AFTER : 0);
+      decisionTrace.record(decision);
+      bitWrite(relaysNearThreshold, i, autoNearThreshold(ad, cd));
+    }
+    //Poll faster while any relay is close to switching, slower while they are all far from it.
+    relaysNearThreshold &= autoControlIndex.automatic();
+    if (relaysNearThreshold != 0) {
+      urgency = POLL_NEAR;
+    } else if (autoControlIndex.automatic() != 0) {
+      urgency = POLL_FAR;
     }
   }
+  setPollUrgency(urgency);
+}
+
+//Timer callback, writes the relay settings once the changes have stopped for RELAY_SAVE_DELAY
+void saveRelayConfig(uint32_t){
+  ESP_LOGD(TAG,"Save was requested");
+
+  //store all the autoData with each relay in the UserData section
+  for (int i=0; i<relays.numberOfRelays(); i++){
+    relays[i].setUserData(asRawJson(automaticData[i]));
+  }
+  //Save the name of the device.
+  fileSystem.saveToFile(namePath, name);            
+
+  config = relays.asRawJson();
+  Serial.println("Relays json data:" + config);
+  fileSystem.saveToFile(configPath, config);
+}
+
+//Timer callback, writes the WiFi and Classic settings and restarts with them
+void saveWiFiConfig(uint32_t){
+  ESP_LOGD(TAG,"WiFi configuration Save was requested");
+  fileSystem.saveToFile(namePath, name);
+  fileSystem.saveToFile(ssidPath, ssid);
+  fileSystem.saveToFile(passPath, pass);            
+  fileSystem.saveToFile(classicnamePath, classicname);            
+  fileSystem.saveToFile(classicipPath, classicip);            
+  fileSystem.saveToFile(classicportPath, classicport);   
+  flushHistory();
+  delay(3000); //wait 3 seconds, then restart.
+  ESP.restart();         
+}
+
+void requestRelaySave(){
+  relaySaveTimer = timers.restart(relaySaveTimer, RELAY_SAVE_DELAY, saveRelayConfig, 0);
+  if (relaySaveTimer == 0) {
+    ESP_LOGE(TAG, "No timer free to delay the relay save, saving now");
+    saveRelayConfig(0);
+  }
+}
+
+void requestWiFiSave(){
+  wifiSaveTimer = timers.restart(wifiSaveTimer, RELAY_SAVE_DELAY, saveWiFiConfig, 0);
+  if (wifiSaveTimer == 0) {
+    ESP_LOGE(TAG, "No timer free to delay the WiFi save, saving now");
+    saveWiFiConfig(0);
+  }
+}
+
+//Timer callback, every WIFI_RECONNECT_INTERVAL
+void checkWiFi(uint32_t){
+  // if WiFi is down, try reconnecting
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("Reconnecting to WiFi...");
+    WiFi.disconnect();
+    WiFi.reconnect();
+  }
+}
+
+#ifdef LILYGO_RELAY6
+//Timer callback, every RTC_READ_INTERVAL
+void readRtc(uint32_t){
+  RTC_DateTime datetime = rtc.getDateTime();
+  logd("RTC %04d-%02d-%02d %02d:%02d:%02d", datetime.year, datetime.month, datetime.day, datetime.hour, datetime.minute, datetime.second);
+}
+#endif
+
+/*
+ms from now until the local clock next reads minuteOfDay, 0 while the clock has not been set.
+*/
+uint64_t msUntilMinuteOfDay(int16_t minuteOfDay){
+  time_t now;
+  time(&now);
+  struct tm at;
+  localtime_r(&now, &at);
+  if (at.tm_year <= (2016 - 1900)) return 0;
+  at.tm_hour = minuteOfDay / 60;
+  at.tm_min = minuteOfDay % 60;
+  at.tm_sec = 0;
+  at.tm_isdst = -1;
+  time_t next = mktime(&at);
+  //A timer that fires a little early must not find the same minute again
+  if (next <= now + 30) {
+    at.tm_mday++;
+    at.tm_isdst = -1;
+    next = mktime(&at);
+  }
+  return (uint64_t)(next - now) * 1000;
+}
+
+void relayScheduleDue(uint32_t arg);
+
+/*
+Timer callback as well, arg is the relay shifted left one with the on bit below it. Works the delay out from the
+wall clock each time, so the schedule follows daylight saving and clock corrections.
+*/
+void armRelaySchedule(uint32_t arg){
+  int relay = arg >> 1;
+  bool on = arg & 1;
+  int16_t at = on ? automaticData[relay].onAt : automaticData[relay].offAt;
+  timers.cancel(scheduleTimers[relay][on]);
+  scheduleTimers[relay][on] = 0;
+  if (at < 0) return;
+  uint64_t delay = msUntilMinuteOfDay(at);
+  if (delay == 0) {
+    scheduleTimers[relay][on] = timers.start(RELAY_SCHEDULE_RETRY, armRelaySchedule, arg);
+  } else {
+    scheduleTimers[relay][on] = timers.start(delay, relayScheduleDue, arg);
+  }
+  if (scheduleTimers[relay][on] == 0) {
+    //loop() arms them all again once a timer is free
+    ESP_LOGE(TAG, "No timer free for the schedule of relay %d", relay);
+    relaySchedulesChanged = true;
+  }
+}
+
+void relayScheduleDue(uint32_t arg){
+  relays[arg >> 1].setRelayStatus((arg & 1) ? HIGH : LOW);
+  armRelaySchedule(arg);
+}
+
+void armRelaySchedules(){
+  for (int i=0; i<relays.numberOfRelays() && i<AUTO_MAX_RELAYS; i++){
+    armRelaySchedule(i << 1 | 1);
+    armRelaySchedule(i << 1);
+  }
 }
 
 void setup() {
@@ -582,6 +795,57 @@ if (!initWiFi()){
             }
           }
 
+          if (p->name() == relays[i].getRelayFixedShortName()+"-on"){
+            if (automaticData[i].onAt != minuteOfDayFromText(p->value())){
+              saveIt = true;
+              automaticData[i].onAt = minuteOfDayFromText(p->value());
+            }
+          }
+
+          if (p->name() == relays[i].getRelayFixedShortName()+"-off"){
+            if (automaticData[i].offAt != minuteOfDayFromText(p->value())){
+              saveIt = true;
+              automaticData[i].offAt = minuteOfDayFromText(p->value());
+            }
+          }
+
+          if (p->name() == relays[i].getRelayFixedShortName()+"-minon"){
+            if (automaticData[i].minOnSeconds != p->value().toInt()){
+              saveIt = true;
+              automaticData[i].minOnSeconds = constrain(p->value().toInt(), 0, 65535);
+            }
+          }
+
+          if (p->name() == relays[i].getRelayFixedShortName()+"-minoff"){
+            if (automaticData[i].minOffSeconds != p->value().toInt()){
+              saveIt = true;
+              automaticData[i].minOffSeconds = constrain(p->value().toInt(), 0, 65535);
+            }
+          }
+
+          if (p->name() == relays[i].getRelayFixedShortName()+"-maxperhour"){
+            if (automaticData[i].maxSwitchesPerHour != p->value().toInt()){
+              saveIt = true;
+              automaticData[i].maxSwitchesPerHour = constrain(p->value().toInt(), 0, 255);
+            }
+          }
+
+          if (p->name() == relays[i].getRelayFixedShortName()+"-rule"){
+            if (p->value() != automaticData[i].rule.text()){
+              saveIt = true;
+              //loop() may be evaluating the relay's rule right now, it swaps the new one in when it is not
+              RelayRule *rule = new RelayRule();
+              if (!rule->compile(p->value().c_str())) {
+                ESP_LOGW(TAG, "Rule for relay %d not used, %s at %d", i, rule->error(), rule->errorAt());
+              }
+              portENTER_CRITICAL(&pendingRulesLock);
+              RelayRule *replaced = pendingRules[i];
+              pendingRules[i] = rule;
+              portEXIT_CRITICAL(&pendingRulesLock);
+              delete replaced;
+            }
+          }
+
           if (p->name() == relays[i].getRelayFixedShortName()+"-value"){
             if (abs(automaticData[i].value-p->value().toFloat())>0.01){
               saveIt = true;
@@ -595,12 +859,23 @@ if (!initWiFi()){
               automaticData[i].restoreValue = p->value().toFloat();
             }
           }
+
+          //Left empty the relay uses the measure's margin
+          if (p->name() == relays[i].getRelayFixedShortName()+"-margin"){
+            double margin = p->value().length() == 0 ? -1 : max(0.0, (double)p->value().toFloat());
+            if (abs(automaticData[i].nearMargin-margin)>0.001){
+              saveIt = true;
+              automaticData[i].nearMargin = margin;
+            }
+          }
         }
       }
     }
     if (saveIt) {
       ESP_LOGD(TAG, "Requesting Save");
-      lastSaveRequestTime = millis();
+      requestRelaySave();
+      autoControlConfigChanged = true;
+      relaySchedulesChanged = true;
     }
     request->redirect("/");
   });
@@ -620,7 +895,7 @@ if (!initWiFi()){
     } else if (request->hasParam("saverelaystates")) {
       //Save all of the relays
       ESP_LOGD(TAG, "saveRelayState received");
-      lastSaveRequestTime = millis(); //request a save
+      requestRelaySave();
               
     } else {
       inputMessage1 = "No message sent";
@@ -629,6 +904,56 @@ if (!initWiFi()){
     request->send(200, "text/plain", "OK");
   });
 
+  // Per register bank Modbus latency (p50/p95/p99) and error counts
+  server.on("/modbusstats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "application/json", modbusStatsAsJson());
+  });
+
+  //from and to are in seconds since the epoch, the whole history when they are left out
+  server.on("/history", HTTP_GET, [](AsyncWebServerRequest *request) {
+    uint32_t from = request->hasParam("from") ? request->getParam("from")->value().toInt() : 0;
+    uint32_t to = request->hasParam("to") ? request->getParam("to")->value().toInt() : UINT32_MAX;
+    uint32_t max = request->hasParam("max") ? request->getParam("max")->value().toInt() : HISTORY_DEFAULT_SAMPLES;
+    request->send(200, "application/json", historyAsJson(from, to, max));
+  });
+
+  //res is minute, hour or day, count the number of buckets back from the current one
+  server.on("/rollups", HTTP_GET, [](AsyncWebServerRequest *request) {
+    RollupResolution res = Rollups::fromString(request->hasParam("res") ? request->getParam("res")->value() : "minute");
+    uint16_t count = request->hasParam("count") ? request->getParam("count")->value().toInt() : ROLLUP_MINUTES;
+    request->send(200, "application/json", rollupsAsJson(res, count));
+  });
+
+  //Every decoded field of one charge controller, controller is 0 for the first one configured
+  server.on("/charger", HTTP_GET, [](AsyncWebServerRequest *request) {
+    uint8_t controller = request->hasParam("controller") ? request->getParam("controller")->value().toInt() : 0;
+    request->send(200, "application/json", chargerInfoAsJson(controller));
+  });
+
+  server.on("/modbusserver", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "application/json", modbusServerStatsAsJson());
+  });
+
+  server.on("/relaystats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "application/json", relayGuardsAsJson(automaticData, relays.numberOfRelays()));
+  });
+
+  //The decisions auto control made, as the binary records of DecisionTrace.h, since is the number of the first one wanted
+  server.on("/decisiontrace", HTTP_GET, [](AsyncWebServerRequest *request) {
+    uint32_t since = request->hasParam("since") ? request->getParam("since")->value().toInt() : 0;
+    DecisionTraceHeader header = decisionTrace.header(since);
+    size_t length = sizeof(header) + (size_t)header.count * sizeof(DecisionRecord);
+    request->send(request->beginResponse("application/octet-stream", length, [header](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return decisionTrace.read(header, index, buffer, maxLen);
+    }));
+  });
+
+  server.on("/relaylog", HTTP_GET, [](AsyncWebServerRequest *request) {
+    uint32_t from = request->hasParam("from") ? request->getParam("from")->value().toInt() : 0;
+    uint32_t to = request->hasParam("to") ? request->getParam("to")->value().toInt() : UINT32_MAX;
+    request->send(200, "application/json", relayLogAsJson(from, to, HISTORY_MAX_SAMPLES));
+  });
+
   server.on("/wifimanager", HTTP_GET, [](AsyncWebServerRequest *request) {
     request->send(SPIFFS, "/wifimanager.html", "text/html", false, processor);
   });
@@ -641,32 +966,32 @@ if (!initWiFi()){
         // HTTP POST name value
         if (p->name() == PARAM_DEVICE_NAME) {
           name = p->value().c_str();
-          wifiNeedsSave = millis();
+          requestWiFiSave();
         }
         // HTTP POST ssid value
         if (p->name() == PARAM_SSID) {
           ssid = p->value().c_str();
-          wifiNeedsSave = millis();
+          requestWiFiSave();
         }
         // HTTP POST pass value
         if (p->name() == PARAM_PASS) {
           pass = p->value().c_str();
-          wifiNeedsSave = millis();
+          requestWiFiSave();
         }
         // HTTP POST classicname value
         if (p->name() == PARAM_CLASSIC_NAME) {
           classicname = p->value().c_str();
-          wifiNeedsSave = millis();
+          requestWiFiSave();
         }
         // HTTP POST classicname value
         if (p->name() == PARAM_CLASSIC_IP) {
           classicip = p->value().c_str();
-          wifiNeedsSave = millis();
+          requestWiFiSave();
         }
         // HTTP POST classicname value
         if (p->name() == PARAM_CLASSIC_PORT) {
           classicport = p->value().c_str();
-          wifiNeedsSave = millis();
+          requestWiFiSave();
         }
       }
     }
@@ -678,6 +1003,9 @@ if (!initWiFi()){
   server.begin();
   Serial.print("Hostname = "); Serial.println(hostName);
   
+  //Open the history log before the modbus task starts writing to it
+  flashLog.begin();
+
   modbusGood = false;
   int i = 0;
   while (!modbusGood and i++<10) {
@@ -690,6 +1018,21 @@ if (!initWiFi()){
       Serial.println("Modbus setup success");
     }
   }
+  if (modbusGood) {
+    startModbusTask();
+  }
+
+  //Other Modbus clients read the Classic's registers from us, the relays are the coils.
+  ModbusServerCoils coils;
+  coils.count = []() { return relays.numberOfRelays(); };
+  coils.get = [](int coil) { return (bool)relays[coil].getRelayStatus(); };
+  coils.set = [](int coil, bool on) { relays[coil].setRelayStatus(on ? HIGH : LOW); };
+  startModbusServer(coils);
+
+  timers.start(WIFI_RECONNECT_INTERVAL, checkWiFi, 0, WIFI_RECONNECT_INTERVAL);
+#ifdef LILYGO_RELAY6
+  timers.start(RTC_READ_INTERVAL, readRtc, 0, RTC_READ_INTERVAL);
+#endif
 
   //Initialize the watchdog that can reset the module if thing go wrong.
 	init_watchdog();
@@ -700,67 +1043,44 @@ void loop() {
   ElegantOTA.loop();
   boot.check();
   relays.loop();
-
-  // if WiFi is down, try reconnecting
-  if ((WiFi.status() != WL_CONNECTED) && (millis() - wifiReconnectPreviousMillis >= (1000*60))) { //check every minute
-    Serial.println("Reconnecting to WiFi...");
-    WiFi.disconnect();
-    WiFi.reconnect();
-    wifiReconnectPreviousMillis = millis();
-  }
-
-  if (WiFi.status() == WL_CONNECTED){
-    if (modbusGood){
-      if (gatherModbusData()){
-        //got modbus data, process it.
-        printModbusData();
-        //Control the relays
-        doAutoControl(getChargerData());
-        //Notify any web pages that the measures have been updated
-        measuresUpdated(getChargerData());
-      }
-    }
+  logRelayTransitions();
+  installPendingRules();
+
+  //Saves, WiFi checks and relay schedules
+  timers.run();
+  if (relaySchedulesChanged && !timers.full()) {
+    relaySchedulesChanged = false;
+    armRelaySchedules();
   }
 
-  if (lastSaveRequestTime!=-1 and (lastSaveRequestTime+RELAY_SAVE_DELAY<millis())) {
-    lastSaveRequestTime = -1;
-    ESP_LOGD(TAG,"Save was requested");
+  //Relays whose switch was held back and may switch now
+  if (relaysToRecheck != 0 && modbusGood) {
+    uint32_t relayMask = relaysToRecheck;
+    relaysToRecheck = 0;
+    doAutoControl(getChargerData(), relayMask);
+  }
 
-    //store all the autoData with each relay in the UserData section
-    for (int i=0; i<relays.numberOfRelays(); i++){
-      relays[i].setUserData(asRawJson(automaticData[i]));
+  //The modbus task gathers in the background, only act on the measures that changed in what it published.
+  if (modbusGood && chargerDataSequence() != lastChargerDataSequence){
+    chargerDataForRelayControl cd = getChargerData();
+    ClassicFieldSet changed = chargerFieldsChangedSince(cd, lastChargerDataSequence);
+    lastChargerDataSequence = cd.sequence;
+    //Control the relays whose measures moved or whose rules are timing a FOR, or all of them after their settings changed
+    if (autoControlConfigChanged) {
+      autoControlConfigChanged = false;
+      autoControlIndex.build(automaticData, relays.numberOfRelays());
+      relaysNearThreshold = 0;
+      doAutoControl(cd, autoControlIndex.automatic()); //also resets the poll rate when none is left automatic
+    } else {
+      uint32_t relayMask = autoControlIndex.relaysFor(changed) | autoRulesWaiting(automaticData, relays.numberOfRelays());
+      if (relayMask != 0) {
+        doAutoControl(cd, relayMask);
+      }
+    }
+    if (changed & chargerDataFields) {
+      printModbusData();
+      //Notify any web pages that the measures have been updated
+      measuresUpdated(cd);
     }
-    //Save the name of the device.
-    fileSystem.saveToFile(namePath, name);            
-
-    config = relays.asRawJson();
-    Serial.println("Relays json data:" + config);
-    fileSystem.saveToFile(configPath, config);
-  }
-
-  if (wifiNeedsSave!=-1 and (wifiNeedsSave+RELAY_SAVE_DELAY<millis())) {
-    wifiNeedsSave = -1;
-    ESP_LOGD(TAG,"WiFi configuration Save was requested");
-    fileSystem.saveToFile(namePath, name);
-    fileSystem.saveToFile(ssidPath, ssid);
-    fileSystem.saveToFile(passPath, pass);            
-    fileSystem.saveToFile(classicnamePath, classicname);            
-    fileSystem.saveToFile(classicipPath, classicip);            
-    fileSystem.saveToFile(classicportPath, classicport);   
-    delay(3000); //wait 3 seconds, then restart.
-    ESP.restart();         
-  }
-  
-#if defined(LILYGORELAY6)
-  if (millis() - lastMillis > (1000*60*10)) { //10 minutes
-      lastMillis = millis();
-      RTC_DateTime datetime = rtc.getDateTime();
-      // Serial.printf(" Year :"); Serial.print(datetime.year);
-      // Serial.printf(" Month:"); Serial.print(datetime.month);
-      // Serial.printf(" Day :"); Serial.print(datetime.day);
-      // Serial.printf(" Hour:"); Serial.print(datetime.hour);
-      // Serial.printf(" Minute:"); Serial.print(datetime.minute);
-      // Serial.printf(" Sec :"); Serial.println(datetime.second);
   }
-#endif
 }
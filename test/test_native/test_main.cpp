@@ -0,0 +1,936 @@
+/**
+ * Unit tests of the control and decoding core, run on the host with
+ *    pio test -e native
+ * They use the same sources and Arduino shim as the benchmarks in native/src.
+ */
+#include <Arduino.h>
+#include <time.h>
+#include <unity.h>
+#include <vector>
+#include "AutoData.h"
+#include "ClassicRegisterMap.h"
+#include "DerivedMeasures.h"
+#include "ModbusGateway.h"
+#include "ModbusPlanner.h"
+#include "RelayRule.h"
+#include "Rollups.h"
+#include "TimeSeries.h"
+#include "TimerWheel.h"
+
+void setUp() {}
+void tearDown() {}
+
+//Puts a register into a bank response, big endian as it comes off the wire
+static void putWord(uint8_t *data, uint8_t bank, uint16_t address, uint16_t value)
+{
+   uint8_t *p = data + 2 * (address - classicBankStart(bank));
+   p[0] = value >> 8;
+   p[1] = value & 0xFF;
+}
+
+//32 bit registers are sent low word first
+static void putDWord(uint8_t *data, uint8_t bank, uint16_t address, uint32_t value)
+{
+   putWord(data, bank, address, value & 0xFFFF);
+   putWord(data, bank, address + 1, value >> 16);
+}
+
+static void test_decode_identity_bank()
+{
+   uint8_t data[2 * classicBankCount(BANK_IDENTITY)] = {};
+   putWord(data, BANK_IDENTITY, 4100, 0x0496);           //Classic 150, revision 4
+   putWord(data, BANK_IDENTITY, 4101, 2023);
+   putWord(data, BANK_IDENTITY, 4102, 0x0511);           //May 17th
+   putWord(data, BANK_IDENTITY, 4105, 0x5566);
+   putWord(data, BANK_IDENTITY, 4106, 0x3344);
+   putWord(data, BANK_IDENTITY, 4107, 0x1122);
+   putDWord(data, BANK_IDENTITY, 4110, 123456);
+   ChargeControllerInfo info;
+   decodeClassicBank<BANK_IDENTITY>(data, info);
+   TEST_ASSERT_EQUAL_STRING("Classic 150 (rev 4)", info.model.c_str());
+   TEST_ASSERT_EQUAL_STRING("20230517", info.buildDate.c_str());
+   TEST_ASSERT_EQUAL_STRING("11:22:33:44:55:66", info.macAddress.c_str());
+   TEST_ASSERT_EQUAL_INT(123456, info.unitID);
+}
+
+static void test_decode_live_bank()
+{
+   uint8_t data[2 * classicBankCount(BANK_LIVE)] = {};
+   putWord(data, BANK_LIVE, 4114, 528);                  //52.8V
+   putWord(data, BANK_LIVE, 4115, 950);                  //95.0V PV
+   putWord(data, BANK_LIVE, 4116, (uint16_t)-100);       //-10.0A, signed
+   putWord(data, BANK_LIVE, 4117, 32);                   //3.2kWh
+   putWord(data, BANK_LIVE, 4118, 630);                  //630W
+   putWord(data, BANK_LIVE, 4119, 0x0305);               //state 3 in the high byte
+   putWord(data, BANK_LIVE, 4120, 66);                   //6.6A
+   putDWord(data, BANK_LIVE, 4125, 123456);              //12345.6kWh
+   putDWord(data, BANK_LIVE, 4129, 0x4000);              //aux 1 on, aux 2 off
+   ChargeControllerInfo info;
+   decodeClassicBank<BANK_LIVE>(data, info);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 52.8, info.BatVoltage);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 95.0, info.PVVoltage);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, -10.0, info.BatCurrent);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 3.2, info.EnergyToday);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 630, info.Power);
+   TEST_ASSERT_EQUAL_UINT16(3, info.ChargeState);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 6.6, info.PVCurrent);
+   TEST_ASSERT_FLOAT_WITHIN(0.01, 12345.6, info.TotalEnergy);
+   TEST_ASSERT_EQUAL_INT(0x4000, info.InfoFlagsBits);
+   TEST_ASSERT_TRUE(info.Aux1);
+   TEST_ASSERT_FALSE(info.Aux2);
+}
+
+static void test_decode_whizbang_bank()
+{
+   uint8_t data[2 * classicBankCount(BANK_WHIZBANG)] = {};
+   putDWord(data, BANK_WHIZBANG, 4364, 1500);
+   putDWord(data, BANK_WHIZBANG, 4366, (uint32_t)-1200);  //negative amp hours are sent negative
+   putWord(data, BANK_WHIZBANG, 4370, (uint16_t)-118);   //-11.8A
+   putWord(data, BANK_WHIZBANG, 4371, 0x0048);           //22C, stored + 50
+   putWord(data, BANK_WHIZBANG, 4372, 85);
+   putWord(data, BANK_WHIZBANG, 4380, 400);
+   ChargeControllerInfo info;
+   decodeClassicBank<BANK_WHIZBANG>(data, info);
+   TEST_ASSERT_EQUAL_UINT32(1500, info.PositiveAmpHours);
+   TEST_ASSERT_EQUAL_INT(1200, info.NegativeAmpHours);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, -11.8, info.WhizbangBatCurrent);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 22, info.ShuntTemperature);
+   TEST_ASSERT_EQUAL_UINT16(85, info.SOC);
+   TEST_ASSERT_EQUAL_UINT16(400, info.TotalAmpHours);
+}
+
+//The single field decoders read the same registers out of the whole image
+static void test_field_decoder_matches_bank_decoder()
+{
+   uint8_t image[2 * classicImageRegisters] = {};
+   uint8_t *live = image + 2 * classicImageOffset(BANK_LIVE);
+   putWord(live, BANK_LIVE, 4114, 531);
+   ChargeControllerInfo bank, field;
+   decodeClassicBank<BANK_LIVE>(live, bank);
+   classicFieldDecoders[CLASSIC_FIELD_BatVoltage](image, field);
+   TEST_ASSERT_EQUAL_FLOAT(bank.BatVoltage, field.BatVoltage);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 53.1, field.BatVoltage);
+}
+
+//Only the fields whose registers moved have to be decoded again, the flags sharing a register go together
+static void test_changed_fields()
+{
+   uint8_t before[2 * classicBankCount(BANK_LIVE)] = {};
+   uint8_t after[sizeof(before)] = {};
+   TEST_ASSERT_TRUE(classicChangedFields(BANK_LIVE, before, after) == 0);
+   putWord(after, BANK_LIVE, 4115, 1200);
+   putWord(after, BANK_LIVE, 4129, 0x4000);
+   ClassicFieldSet expected = classicFieldBit(CLASSIC_FIELD_PVVoltage) | classicFieldBit(CLASSIC_FIELD_InfoFlagsBits) |
+                              classicFieldBit(CLASSIC_FIELD_Aux1) | classicFieldBit(CLASSIC_FIELD_Aux2);
+   TEST_ASSERT_TRUE(classicChangedFields(BANK_LIVE, before, after) == expected);
+}
+
+#define TEST_BANK(address, count) {false, address, count, 0, 0}
+
+static void test_plan_merges_close_banks()
+{
+   ModbusRegisterBank banks[] = {TEST_BANK(4100, 12), TEST_BANK(4114, 17), TEST_BANK(4163, 2)};
+   ModbusReadSpan spans[3];
+   int n = planModbusReads(banks, 3, 0x7, spans, 3);
+   TEST_ASSERT_EQUAL_INT(1, n);
+   TEST_ASSERT_EQUAL_UINT16(4100, spans[0].address);
+   TEST_ASSERT_EQUAL_UINT16(65, spans[0].numberOfRegisters);
+   TEST_ASSERT_EQUAL_HEX8(0x7, spans[0].bankMask);
+}
+
+static void test_plan_splits_at_the_read_limit()
+{
+   //16386 is far past what one read can reach from 4100
+   ModbusRegisterBank banks[] = {TEST_BANK(16386, 4), TEST_BANK(4100, 12), TEST_BANK(4364, 17)};
+   ModbusReadSpan spans[3];
+   int n = planModbusReads(banks, 3, 0x7, spans, 3);
+   TEST_ASSERT_EQUAL_INT(3, n);
+   TEST_ASSERT_EQUAL_UINT16(4100, spans[0].address);
+   TEST_ASSERT_EQUAL_HEX8(0x2, spans[0].bankMask);
+   TEST_ASSERT_EQUAL_UINT16(4364, spans[1].address);
+   TEST_ASSERT_EQUAL_UINT16(16386, spans[2].address);
+   for (int i = 0; i < n; i++) TEST_ASSERT_TRUE(spans[i].numberOfRegisters <= MODBUS_MAX_READ_REGISTERS);
+}
+
+static void test_plan_only_needed_banks()
+{
+   ModbusRegisterBank banks[] = {TEST_BANK(4100, 12), TEST_BANK(4114, 17), TEST_BANK(4131, 12)};
+   ModbusReadSpan spans[3];
+   TEST_ASSERT_EQUAL_INT(0, planModbusReads(banks, 3, 0, spans, 3));
+   int n = planModbusReads(banks, 3, 0x4, spans, 3);
+   TEST_ASSERT_EQUAL_INT(1, n);
+   TEST_ASSERT_EQUAL_UINT16(4131, spans[0].address);
+   TEST_ASSERT_EQUAL_UINT16(12, spans[0].numberOfRegisters);
+   TEST_ASSERT_EQUAL_HEX8(0x4, spans[0].bankMask);
+}
+
+static void test_plan_stops_at_max_spans()
+{
+   ModbusRegisterBank banks[] = {TEST_BANK(16386, 4), TEST_BANK(4100, 12), TEST_BANK(8000, 2)};
+   ModbusReadSpan spans[2];
+   TEST_ASSERT_EQUAL_INT(2, planModbusReads(banks, 3, 0x7, spans, 2));
+}
+
+//Value above restoreValue: on at or above restoreValue, back off below value
+static void test_auto_adjust_normal()
+{
+   AutoData ad;
+   ad.measure = BATVOLT;
+   ad.value = 12.2;
+   ad.restoreValue = 13.1;
+   TEST_ASSERT_FALSE(autoAdjustSingleRelay(12.5, false, ad));
+   TEST_ASSERT_TRUE(autoAdjustSingleRelay(13.1, false, ad));
+   TEST_ASSERT_TRUE(autoAdjustSingleRelay(12.5, true, ad));
+   TEST_ASSERT_TRUE(autoAdjustSingleRelay(12.2, true, ad));
+   TEST_ASSERT_FALSE(autoAdjustSingleRelay(12.1, true, ad));
+}
+
+//restoreValue below value: the relay is on while the reading is low, a load dump for a high SOC say
+static void test_auto_adjust_opposite()
+{
+   AutoData ad;
+   ad.measure = SOC;
+   ad.value = 90;
+   ad.restoreValue = 80;
+   TEST_ASSERT_TRUE(autoAdjustSingleRelay(70, false, ad));
+   TEST_ASSERT_FALSE(autoAdjustSingleRelay(85, false, ad));
+   TEST_ASSERT_TRUE(autoAdjustSingleRelay(85, true, ad));
+   TEST_ASSERT_FALSE(autoAdjustSingleRelay(90, true, ad));
+}
+
+static void test_json_round_trip()
+{
+   AutoData ad;
+   ad.measure = PVCURRENT;
+   ad.value = 10.25;
+   ad.restoreValue = 3.5;
+   AutoData back = fromJson(asRawJson(ad));
+   TEST_ASSERT_EQUAL_INT(PVCURRENT, back.measure);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 10.25, back.value);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 3.5, back.restoreValue);
+   TEST_ASSERT_TRUE(back.rule.empty());
+}
+
+static void test_json_defaults()
+{
+   AutoData back = fromJson("{\"ad\":{\"me\":\"SOC\",\"vl\":90,\"rv\":80}}");
+   TEST_ASSERT_EQUAL_INT(SOC, back.measure);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 90, back.value);
+   back = fromJson("not json");
+   TEST_ASSERT_EQUAL_INT(IGNORE, back.measure);
+   back = fromJson("{\"ad\":{\"me\":\"NOSUCH\"}}");
+   TEST_ASSERT_EQUAL_INT(IGNORE, back.measure);
+}
+
+static void test_near_margin()
+{
+   AutoData ad;
+   ad.measure = BATVOLT;
+   ad.value = 12.2;
+   ad.restoreValue = 13.1;
+   TEST_ASSERT_FLOAT_WITHIN(0.001, autoMeasureInfo[BATVOLT].nearMargin, relayNearMargin(ad, BATVOLT));
+   TEST_ASSERT_TRUE(nearThreshold(12.4, ad));
+   ad.nearMargin = 0.1;
+   TEST_ASSERT_FALSE(nearThreshold(12.4, ad));
+   TEST_ASSERT_TRUE(nearThreshold(13.0, ad));
+
+   AutoData back = fromJson(asRawJson(ad));
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 0.1, back.nearMargin);
+   ad.nearMargin = -1;
+   back = fromJson(asRawJson(ad));
+   TEST_ASSERT_TRUE(back.nearMargin < 0);
+}
+
+//A held back switch is counted once however often auto control asks again, the next one is counted again
+static void test_switch_hold_off_dwell()
+{
+   AutoData ad;
+   ad.minOnSeconds = 60;
+   ad.minOffSeconds = 30;
+   bool byDwell;
+   TEST_ASSERT_EQUAL_UINT32(0, relaySwitchHoldOff(ad, true, 1000, byDwell));
+   relaySwitched(ad, true, 1000);
+   TEST_ASSERT_EQUAL_UINT32(50, relaySwitchHoldOff(ad, false, 1010, byDwell));
+   TEST_ASSERT_TRUE(byDwell);
+   TEST_ASSERT_EQUAL_UINT32(30, relaySwitchHoldOff(ad, false, 1030, byDwell));
+   TEST_ASSERT_EQUAL_UINT32(1, relaySwitchHoldOff(ad, false, 1059, byDwell));
+   TEST_ASSERT_EQUAL_UINT32(1, ad.guard.suppressedDwell);
+   TEST_ASSERT_EQUAL_UINT32(0, relaySwitchHoldOff(ad, false, 1060, byDwell));
+   relaySwitched(ad, false, 1060);
+   TEST_ASSERT_EQUAL_UINT32(2, ad.guard.switches);
+
+   TEST_ASSERT_EQUAL_UINT32(20, relaySwitchHoldOff(ad, true, 1070, byDwell));
+   TEST_ASSERT_EQUAL_UINT32(2, ad.guard.suppressedDwell);
+   TEST_ASSERT_EQUAL_UINT32(0, ad.guard.suppressedRate);
+}
+
+//The hour's allowance refills as time goes by
+static void test_switch_hold_off_rate()
+{
+   AutoData ad;
+   ad.maxSwitchesPerHour = 2;
+   bool byDwell;
+   TEST_ASSERT_EQUAL_UINT32(0, relaySwitchHoldOff(ad, true, 0, byDwell));
+   relaySwitched(ad, true, 0);
+   TEST_ASSERT_EQUAL_UINT32(0, relaySwitchHoldOff(ad, false, 10, byDwell));
+   relaySwitched(ad, false, 10);
+   uint32_t holdOff = relaySwitchHoldOff(ad, true, 20, byDwell);
+   TEST_ASSERT_FALSE(byDwell);
+   TEST_ASSERT_TRUE(holdOff > 1750 && holdOff <= 1800);
+   relaySwitchHoldOff(ad, true, 100, byDwell);
+   relaySwitchHoldOff(ad, true, 1000, byDwell);
+   TEST_ASSERT_EQUAL_UINT32(1, ad.guard.suppressedRate);
+   TEST_ASSERT_EQUAL_UINT32(0, relaySwitchHoldOff(ad, true, 20 + holdOff, byDwell));
+   TEST_ASSERT_EQUAL_UINT32(3, ad.guard.switches);
+}
+
+static void test_minute_of_day_text()
+{
+   TEST_ASSERT_EQUAL_STRING("00:00", minuteOfDayText(0).c_str());
+   TEST_ASSERT_EQUAL_STRING("23:59", minuteOfDayText(1439).c_str());
+   TEST_ASSERT_EQUAL_STRING("", minuteOfDayText(-1).c_str());
+   TEST_ASSERT_EQUAL_STRING("", minuteOfDayText(1440).c_str());
+   TEST_ASSERT_EQUAL_INT(7 * 60 + 5, minuteOfDayFromText("07:05"));
+   TEST_ASSERT_EQUAL_INT(-1, minuteOfDayFromText("24:00"));
+   TEST_ASSERT_EQUAL_INT(-1, minuteOfDayFromText(""));
+}
+
+//Charger data with the SOC and PV current a rule reads
+static chargerDataForRelayControl ruleData(float soc, float pvCurrent)
+{
+   chargerDataForRelayControl cd;
+   cd.values[autoMeasureInfo[SOC].changeBit] = soc;
+   cd.values[autoMeasureInfo[PVCURRENT].changeBit] = pvCurrent;
+   return cd;
+}
+
+static void test_rule_compile()
+{
+   RelayRule rule;
+   TEST_ASSERT_TRUE(rule.compile("soc > 80 and PVCURRENT > 10 FOR 5m"));
+   TEST_ASSERT_NULL(rule.error());
+   TEST_ASSERT_TRUE(rule.active());
+   TEST_ASSERT_EQUAL_STRING("soc > 80 and PVCURRENT > 10 FOR 5m", rule.text());
+   TEST_ASSERT_TRUE(rule.compile("NOT (SOC < 20 || PVCURRENT >= 1) && SOC != 50 ~ 2"));
+   TEST_ASSERT_TRUE(rule.compile(""));
+   TEST_ASSERT_TRUE(rule.empty());
+   TEST_ASSERT_FALSE(rule.active());
+
+   TEST_ASSERT_FALSE(rule.compile("SOC > "));
+   TEST_ASSERT_NOT_NULL(rule.error());
+   TEST_ASSERT_FALSE(rule.active());
+   TEST_ASSERT_FALSE(rule.compile("NOSUCH > 5"));
+   TEST_ASSERT_EQUAL_UINT8(0, rule.errorAt());
+   TEST_ASSERT_FALSE(rule.compile("SOC > 80 AND (PVCURRENT > 10"));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(90, 20), 0));
+}
+
+//Hysteresis holds a comparison true past its threshold until it is back by the hysteresis
+static void test_rule_evaluate_hysteresis()
+{
+   RelayRule rule;
+   TEST_ASSERT_TRUE(rule.compile("SOC > 80 ~ 5 OR NOT PVCURRENT >= 0"));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(80, 1), 0));
+   TEST_ASSERT_TRUE(rule.evaluate(ruleData(81, 1), 0));
+   TEST_ASSERT_TRUE(rule.evaluate(ruleData(76, 1), 0));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(75, 1), 0));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(78, 1), 0));
+   TEST_ASSERT_TRUE(rule.evaluate(ruleData(78, -1), 0));
+
+   TEST_ASSERT_TRUE(rule.near(ruleData(78, 5), -1));
+   TEST_ASSERT_FALSE(rule.near(ruleData(70, 5), -1));
+   TEST_ASSERT_TRUE(rule.near(ruleData(70, 5), 6));
+}
+
+//FOR keeps a condition false until it has held for the duration, a break starts the wait again
+static void test_rule_evaluate_for()
+{
+   RelayRule rule;
+   TEST_ASSERT_TRUE(rule.compile("SOC > 80 AND PVCURRENT > 10 FOR 5m"));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(90, 20), 1000));
+   TEST_ASSERT_TRUE(rule.waiting());
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(90, 20), 1000 + 299999));
+   TEST_ASSERT_TRUE(rule.evaluate(ruleData(90, 20), 1000 + 300000));
+   TEST_ASSERT_FALSE(rule.waiting());
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(70, 20), 1000 + 300000));
+   TEST_ASSERT_TRUE(rule.evaluate(ruleData(90, 20), 1000 + 300000));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(90, 5), 400000));
+   TEST_ASSERT_FALSE(rule.evaluate(ruleData(90, 20), 500000));
+   TEST_ASSERT_TRUE(rule.evaluate(ruleData(90, 20), 800000));
+}
+
+//Samples with steady, noisy and jumping values and uneven gaps, the kind of thing the codec has to cope with
+static TimeSeriesSample testSample(int i)
+{
+   TimeSeriesSample sample;
+   sample.time = 1700000000 + 4 * i + (i / 7) + 3600 * (i / 97);
+   for (int ch = 0; ch < TIMESERIES_CHANNELS; ch++)
+   {
+      sample.values[ch] = (ch % 3 == 0) ? 13.0f : (float)(((i / 5) * 7 + ch * 13) % 41) / 10.0f - 1.0f;
+   }
+   if (i % 500 == 250) sample.values[TS_POWER] = 1e9f;
+   return sample;
+}
+
+static bool sameSample(const TimeSeriesSample &a, const TimeSeriesSample &b)
+{
+   return a.time == b.time && memcmp(a.values, b.values, sizeof(a.values)) == 0;
+}
+
+static void test_timeseries_round_trip()
+{
+   TimeSeries history;
+   TEST_ASSERT_TRUE(history.begin(64 * 1024));
+   const int count = 3000;
+   for (int i = 0; i < count; i++) history.append(testSample(i));
+   TEST_ASSERT_EQUAL_UINT32(count, history.sampleCount());
+   TEST_ASSERT_TRUE(history.bytesInUse() < count * sizeof(TimeSeriesSample) / 4);
+   int i = 0, bad = 0;
+   uint32_t visited = history.query(0, UINT32_MAX, [&](const TimeSeriesSample &sample) {
+      if (!sameSample(testSample(i++), sample)) bad++;
+      return true;
+   });
+   TEST_ASSERT_EQUAL_UINT32(count, visited);
+   TEST_ASSERT_EQUAL_INT(0, bad);
+}
+
+//Both ends of the range are taken in
+static void test_timeseries_query_range()
+{
+   TimeSeries history;
+   history.begin(64 * 1024);
+   for (int i = 0; i < 1000; i++) history.append(testSample(i));
+   uint32_t from = testSample(100).time, to = testSample(200).time;
+   int first = -1, n = 0;
+   history.query(from, to, [&](const TimeSeriesSample &sample) {
+      if (n++ == 0) first = sample.time;
+      TEST_ASSERT_TRUE(sample.time >= from && sample.time <= to);
+      return true;
+   });
+   TEST_ASSERT_EQUAL_UINT32(from, first);
+   TEST_ASSERT_EQUAL_INT(101, n);
+   TEST_ASSERT_TRUE(history.countInRange(from, to) >= 101);
+}
+
+static void test_timeseries_drops_oldest_blocks()
+{
+   TimeSeries history;
+   history.begin(4 * sizeof(TimeSeriesBlock));
+   const int count = 2000;
+   for (int i = 0; i < count; i++) history.append(testSample(i));
+   TEST_ASSERT_TRUE(history.droppedBlocks() > 0);
+   TEST_ASSERT_EQUAL_UINT16(4, history.blocksInUse());
+   int i = count - history.sampleCount(), bad = 0;
+   history.query(0, UINT32_MAX, [&](const TimeSeriesSample &sample) {
+      if (!sameSample(testSample(i++), sample)) bad++;
+      return true;
+   });
+   TEST_ASSERT_EQUAL_INT(count, i);
+   TEST_ASSERT_EQUAL_INT(0, bad);
+}
+
+//A copy of a block decodes the same as the block, and a dropped block can not be copied any more
+static void test_timeseries_copy_block()
+{
+   TimeSeries history;
+   history.begin(4 * sizeof(TimeSeriesBlock));
+   for (int i = 0; i < 100; i++) history.append(testSample(i));
+   history.seal();
+   for (int i = 100; i < 150; i++) history.append(testSample(i));
+   uint32_t number = history.blockNumberAt(testSample(100).time);
+   TEST_ASSERT_EQUAL_UINT32(history.endBlockNumber() - 1, number);
+
+   TimeSeriesBlock copy;
+   TEST_ASSERT_TRUE(history.copyBlock(number, copy));
+   TEST_ASSERT_EQUAL_UINT32(testSample(100).time, copy.startTime);
+   int i = 100, bad = 0;
+   uint32_t visited = 0;
+   std::function<bool(const TimeSeriesSample &)> check = [&](const TimeSeriesSample &sample) {
+      if (!sameSample(testSample(i++), sample)) bad++;
+      return true;
+   };
+   TimeSeries::decodeBlock(copy, 0, UINT32_MAX, visited, check);
+   TEST_ASSERT_EQUAL_UINT32(50, visited);
+   TEST_ASSERT_EQUAL_INT(0, bad);
+
+   for (int i = 150; i < 2000; i++) history.append(testSample(i));
+   TEST_ASSERT_FALSE(history.copyBlock(0, copy));
+   TEST_ASSERT_FALSE(history.copyBlock(history.endBlockNumber(), copy));
+}
+
+//Setting the clock back throws the history away, the block numbers carry on
+static void test_timeseries_clock_set_back()
+{
+   TimeSeries history;
+   history.begin(64 * 1024);
+   for (int i = 0; i < 100; i++) history.append(testSample(i));
+   uint32_t end = history.endBlockNumber();
+   TimeSeriesSample early = testSample(0);
+   early.time -= 86400;
+   history.append(early);
+   TEST_ASSERT_EQUAL_UINT32(1, history.sampleCount());
+   TEST_ASSERT_EQUAL_UINT32(early.time, history.oldestTime());
+   TEST_ASSERT_EQUAL_UINT32(end, history.blockNumberAt(0));
+}
+
+//The open block is handed out as it grows without being closed, and only when it has something new
+static void test_timeseries_flush_keeps_block_open()
+{
+   TimeSeries history;
+   history.begin(64 * 1024);
+   std::vector<uint16_t> written;
+   history.onBlockWritten = [&](const TimeSeriesBlock &b) { written.push_back(b.count); };
+   for (int i = 0; i < 10; i++) history.append(testSample(i));
+   history.flush();
+   history.flush();
+   for (int i = 10; i < 20; i++) history.append(testSample(i));
+   history.flush();
+   for (int i = 20; i < 25; i++) history.append(testSample(i));
+   TEST_ASSERT_EQUAL_UINT16(1, history.blocksInUse());
+   history.seal();
+   history.seal();
+   history.append(testSample(25));
+   TEST_ASSERT_EQUAL_UINT16(2, history.blocksInUse());
+   TEST_ASSERT_EQUAL_INT(3, written.size());
+   TEST_ASSERT_EQUAL_UINT16(10, written[0]);
+   TEST_ASSERT_EQUAL_UINT16(20, written[1]);
+   TEST_ASSERT_EQUAL_UINT16(25, written[2]);
+}
+
+//A published sample seconds after noon of a UTC day
+static chargerDataForRelayControl derivedSample(uint32_t seconds, int soc, double batVoltage, double batCurrent)
+{
+   chargerDataForRelayControl cd;
+   cd.gatherMillis = 1000UL * seconds;
+   cd.timeDataWasGathered = 1700006400 + 12 * 3600 + seconds;
+   cd.SOC = soc;
+   cd.BatVoltage = batVoltage;
+   cd.BatCurrent = batCurrent;
+   return cd;
+}
+
+static DerivedMeasures derived;
+
+//A steady ramp gives its own rate whatever the weighting
+static void test_derived_slopes()
+{
+   derived.clear();
+   chargerDataForRelayControl cd;
+   for (int i = 0; i <= 30; i++)
+   {
+      cd = derivedSample(60 * i, 50 + i, 12.0 + 0.5 * i / 60, 0);
+      derived.update(cd);
+   }
+   TEST_ASSERT_FLOAT_WITHIN(0.01, 60, cd.values[DERIVED_FIELD_SOCSlope]);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 0.5, cd.values[DERIVED_FIELD_BatVoltageSlope]);
+
+   WeightedSlope slope;
+   slope.add(0, 3);
+   TEST_ASSERT_EQUAL_FLOAT(0, slope.perHour());
+   slope.add(1800, 2);
+   slope.add(1800, 1);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, -2, slope.perHour());
+}
+
+//A constant current for an hour is its amps in amp hours, the battery power is volts times amps
+static void test_derived_amp_hours()
+{
+   derived.clear();
+   chargerDataForRelayControl cd;
+   for (int i = 0; i <= 60; i++)
+   {
+      cd = derivedSample(60 * i, 80, 13.0, 10);
+      derived.update(cd);
+   }
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 10, cd.values[DERIVED_FIELD_NetAmpHours]);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 130, cd.values[DERIVED_FIELD_BatPower]);
+   TEST_ASSERT_TRUE(cd.changedFields & ((ClassicFieldSet)1 << DERIVED_FIELD_NetAmpHours));
+
+   //Nothing moved, nothing changed
+   cd = derivedSample(3600, 80, 13.0, 10);
+   derived.update(cd);
+   TEST_ASSERT_FALSE(cd.changedFields & ((ClassicFieldSet)1 << DERIVED_FIELD_BatPower));
+}
+
+//Over a gap longer than DERIVED_MAX_GAP nobody knows what the current did, and midnight starts the count again
+static void test_derived_gap_and_midnight()
+{
+   derived.clear();
+   chargerDataForRelayControl cd;
+   for (int i = 0; i <= 30; i++)
+   {
+      cd = derivedSample(60 * i, 80, 13.0, -4);
+      derived.update(cd);
+   }
+   uint32_t resume = 1800 + DERIVED_MAX_GAP + 1;
+   for (int i = 0; i <= 30; i++)
+   {
+      cd = derivedSample(resume + 60 * i, 80, 13.0, -4);
+      derived.update(cd);
+   }
+   TEST_ASSERT_FLOAT_WITHIN(0.001, -4, cd.values[DERIVED_FIELD_NetAmpHours]);
+
+   cd = derivedSample(12 * 3600 + 60, 80, 13.0, -4);
+   derived.update(cd);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 0, cd.values[DERIVED_FIELD_NetAmpHours]);
+   cd = derivedSample(12 * 3600 + 420, 80, 13.0, -4);
+   derived.update(cd);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, -0.4, cd.values[DERIVED_FIELD_NetAmpHours]);
+}
+
+#define ROLLUP_TEST_DAY 1700006400            //a midnight, the tests run in UTC
+
+static TimeSeriesSample rollupSample(uint32_t time, float value)
+{
+   TimeSeriesSample sample;
+   sample.time = time;
+   for (int ch = 0; ch < TIMESERIES_CHANNELS; ch++) sample.values[ch] = value;
+   return sample;
+}
+
+static Rollups rollups;                        //too big for the stack of a test
+
+//Samples every 30 s for two hours and a minute, then one the next day
+static void test_rollups_rollover()
+{
+   rollups.clear();
+   for (int i = 0; i < 242; i++) rollups.add(rollupSample(ROLLUP_TEST_DAY + 30 * i, i));
+   TEST_ASSERT_EQUAL_UINT16(ROLLUP_MINUTES, rollups.bucketCount(ROLLUP_MINUTE));
+   TEST_ASSERT_EQUAL_UINT16(3, rollups.bucketCount(ROLLUP_HOUR));
+   TEST_ASSERT_EQUAL_UINT16(1, rollups.bucketCount(ROLLUP_DAY));
+
+   const RollupBucket *minute = rollups.bucket(ROLLUP_MINUTE, 1);
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY + 7140, minute->start);
+   TEST_ASSERT_EQUAL_UINT32(2, minute->count);
+   TEST_ASSERT_NULL(rollups.bucket(ROLLUP_MINUTE, ROLLUP_MINUTES));
+
+   const RollupBucket *hour = rollups.bucket(ROLLUP_HOUR, 1);
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY + 3600, hour->start);
+   TEST_ASSERT_EQUAL_UINT32(120, hour->count);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 120, hour->min[TS_POWER]);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 239, hour->max[TS_POWER]);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 179.5, hour->average(TS_POWER));
+   TEST_ASSERT_EQUAL_UINT32(2, rollups.bucket(ROLLUP_HOUR, 0)->count);
+   TEST_ASSERT_EQUAL_UINT32(242, rollups.bucket(ROLLUP_DAY, 0)->count);
+
+   rollups.add(rollupSample(ROLLUP_TEST_DAY + 86400 + 5, 1));
+   TEST_ASSERT_EQUAL_UINT16(2, rollups.bucketCount(ROLLUP_DAY));
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY + 86400, rollups.bucket(ROLLUP_DAY, 0)->start);
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY, rollups.bucket(ROLLUP_DAY, 1)->start);
+
+   //The clock was set back, nothing kept lines up with it any more
+   rollups.add(rollupSample(ROLLUP_TEST_DAY + 100, 1));
+   TEST_ASSERT_EQUAL_UINT16(1, rollups.bucketCount(ROLLUP_MINUTE));
+   TEST_ASSERT_EQUAL_UINT16(1, rollups.bucketCount(ROLLUP_HOUR));
+   TEST_ASSERT_EQUAL_UINT16(1, rollups.bucketCount(ROLLUP_DAY));
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY + 60, rollups.bucket(ROLLUP_MINUTE, 0)->start);
+}
+
+//Only the buckets that start inside [from, to) are combined
+static void test_rollups_combine()
+{
+   rollups.clear();
+   for (int i = 0; i < 240; i++) rollups.add(rollupSample(ROLLUP_TEST_DAY + 30 * i, i));
+   RollupBucket out;
+   TEST_ASSERT_TRUE(rollups.combine(ROLLUP_MINUTE, ROLLUP_TEST_DAY + 6600, ROLLUP_TEST_DAY + 7200, out));
+   TEST_ASSERT_EQUAL_UINT32(20, out.count);
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY + 6600, out.start);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 220, out.min[TS_POWER]);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 239, out.max[TS_POWER]);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 229.5, out.average(TS_POWER));
+
+   TEST_ASSERT_TRUE(rollups.combine(ROLLUP_MINUTE, ROLLUP_TEST_DAY + 6630, ROLLUP_TEST_DAY + 6721, out));
+   TEST_ASSERT_EQUAL_UINT32(4, out.count);
+   TEST_ASSERT_EQUAL_UINT32(ROLLUP_TEST_DAY + 6660, out.start);
+
+   TEST_ASSERT_TRUE(rollups.combine(ROLLUP_HOUR, 0, ROLLUP_TEST_DAY + 86400, out));
+   TEST_ASSERT_EQUAL_UINT32(240, out.count);
+   TEST_ASSERT_FLOAT_WITHIN(0.001, 0, out.min[TS_POWER]);
+   TEST_ASSERT_FALSE(rollups.combine(ROLLUP_HOUR, ROLLUP_TEST_DAY + 7200, ROLLUP_TEST_DAY + 86400, out));
+   TEST_ASSERT_EQUAL_UINT32(0, out.count);
+}
+
+static TimerWheelPool<8> wheel;
+static uint32_t fired[4];                      //times each timer arg fired
+static uint64_t wheelNow;                      //the time the wheel is being run at
+static uint32_t rearms;                        //times rearm() may still start a timer
+
+static void countFired(uint32_t arg)
+{
+   fired[arg]++;
+}
+
+//Starts arg again 10 ms on, or at once when arg is 3, while rearms lasts
+static void rearm(uint32_t arg)
+{
+   fired[arg]++;
+   if (rearms == 0) return;
+   rearms--;
+   wheel.startAt(arg == 3 ? wheelNow : wheelNow + 10, rearm, arg);
+}
+
+//Runs every timer there is so the next test starts from an empty wheel
+static void startWheelTest()
+{
+   wheel.run(wheelNow + 100000000ULL);
+   wheelNow += 100000000ULL;
+   memset(fired, 0, sizeof(fired));
+   rearms = 0;
+   TEST_ASSERT_EQUAL_UINT16(0, wheel.active());
+}
+
+static void test_timer_one_shot()
+{
+   startWheelTest();
+   TimerId id = wheel.startAt(wheelNow + 100, countFired, 1);
+   TEST_ASSERT_TRUE(id != 0);
+   TEST_ASSERT_TRUE(wheel.pending(id));
+   wheel.run(wheelNow + 99);
+   TEST_ASSERT_EQUAL_UINT32(0, fired[1]);
+   wheel.run(wheelNow + 100);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   TEST_ASSERT_FALSE(wheel.pending(id));
+   wheel.run(wheelNow + 5000);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   TEST_ASSERT_EQUAL_UINT16(0, wheel.active());
+
+   //Timers fire on the first tick at or after their time, never before it
+   wheel.startAt(wheelNow + 5003, countFired, 1);
+   wheel.startAt(wheelNow + 5010, countFired, 2);
+   wheel.startAt(wheelNow + 5011, countFired, 3);
+   wheel.run(wheelNow + 5009);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   wheel.run(wheelNow + 5010);
+   TEST_ASSERT_EQUAL_UINT32(2, fired[1]);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[2]);
+   TEST_ASSERT_EQUAL_UINT32(0, fired[3]);
+   wheel.run(wheelNow + 5019);
+   TEST_ASSERT_EQUAL_UINT32(0, fired[3]);
+   wheel.run(wheelNow + 5020);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[3]);
+}
+
+//A periodic timer keeps its beat, and after falling behind fires once and carries on from then
+static void test_timer_periodic()
+{
+   startWheelTest();
+   TimerId id = wheel.startAt(wheelNow + 50, countFired, 2, 100);
+   wheel.run(wheelNow + 49);
+   TEST_ASSERT_EQUAL_UINT32(0, fired[2]);
+   wheel.run(wheelNow + 50);
+   wheel.run(wheelNow + 149);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[2]);
+   wheel.run(wheelNow + 150);
+   TEST_ASSERT_EQUAL_UINT32(2, fired[2]);
+   wheel.run(wheelNow + 1000);
+   TEST_ASSERT_EQUAL_UINT32(3, fired[2]);
+   wheel.run(wheelNow + 1099);
+   TEST_ASSERT_EQUAL_UINT32(3, fired[2]);
+   wheel.run(wheelNow + 1100);
+   TEST_ASSERT_EQUAL_UINT32(4, fired[2]);
+   TEST_ASSERT_TRUE(wheel.pending(id));
+   TEST_ASSERT_TRUE(wheel.cancel(id));
+   wheel.run(wheelNow + 5000);
+   TEST_ASSERT_EQUAL_UINT32(4, fired[2]);
+}
+
+//Ids of timers that fired or were cancelled do not touch the timer that reuses their place in the pool
+static void test_timer_stale_ids()
+{
+   startWheelTest();
+   TimerId first = wheel.startAt(wheelNow + 100, countFired, 1);
+   TEST_ASSERT_TRUE(wheel.cancel(first));
+   TEST_ASSERT_FALSE(wheel.cancel(first));
+   TimerId second = wheel.startAt(wheelNow + 100, countFired, 1);
+   TEST_ASSERT_TRUE(second != first);
+   TEST_ASSERT_EQUAL_HEX32(first & 0xFFFF, second & 0xFFFF);
+   TEST_ASSERT_FALSE(wheel.cancel(first));
+   TEST_ASSERT_FALSE(wheel.pending(first));
+   TEST_ASSERT_TRUE(wheel.pending(second));
+   wheel.run(wheelNow + 100);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   TEST_ASSERT_FALSE(wheel.cancel(second));
+   TEST_ASSERT_FALSE(wheel.cancel(0));
+
+   //Once the pool is used up start() says so
+   for (int i = 0; i < 8; i++) TEST_ASSERT_TRUE(wheel.startAt(wheelNow + 200, countFired, 0) != 0);
+   TEST_ASSERT_TRUE(wheel.full());
+   TEST_ASSERT_EQUAL_UINT32(0, wheel.startAt(wheelNow + 200, countFired, 0));
+   wheel.run(wheelNow + 200);
+   TEST_ASSERT_EQUAL_UINT32(8, fired[0]);
+   TEST_ASSERT_FALSE(wheel.full());
+}
+
+//A callback may start timers, one already due fires in the same run, a later one when its time comes
+static void test_timer_callback_starts_timers()
+{
+   startWheelTest();
+   rearms = 2;
+   wheel.startAt(wheelNow + 100, rearm, 1);
+   wheelNow += 100;
+   wheel.run(wheelNow);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   TEST_ASSERT_EQUAL_UINT16(1, wheel.active());
+   wheel.run(wheelNow + 9);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   wheelNow += 10;
+   wheel.run(wheelNow);
+   TEST_ASSERT_EQUAL_UINT32(2, fired[1]);
+   wheelNow += 10;
+   wheel.run(wheelNow);
+   TEST_ASSERT_EQUAL_UINT32(3, fired[1]);
+   TEST_ASSERT_EQUAL_UINT16(0, wheel.active());
+
+   startWheelTest();
+   rearms = 2;
+   wheelNow += 300;
+   wheel.startAt(wheelNow, rearm, 3);
+   wheel.run(wheelNow);
+   TEST_ASSERT_EQUAL_UINT32(3, fired[3]);
+   TEST_ASSERT_EQUAL_UINT16(0, wheel.active());
+}
+
+//A run that jumps more than a turn of the wheel still fires whatever is due, and only that
+static void test_timer_jump_past_a_turn()
+{
+   startWheelTest();
+   const uint64_t turn = (uint64_t)TIMER_WHEEL_SLOTS * TIMER_WHEEL_TICK;
+   wheel.startAt(wheelNow + 50, countFired, 0);
+   wheel.startAt(wheelNow + turn + 70, countFired, 1);
+   wheel.startAt(wheelNow + 2 * turn + 30, countFired, 2);
+   wheel.startAt(wheelNow + 3 * turn + 50, countFired, 3);
+   wheel.run(wheelNow + 2 * turn + 40);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[0]);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[1]);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[2]);
+   TEST_ASSERT_EQUAL_UINT32(0, fired[3]);
+   wheel.run(wheelNow + 3 * turn + 49);
+   TEST_ASSERT_EQUAL_UINT32(0, fired[3]);
+   wheel.run(wheelNow + 3 * turn + 50);
+   TEST_ASSERT_EQUAL_UINT32(1, fired[3]);
+   TEST_ASSERT_EQUAL_UINT16(0, wheel.active());
+}
+
+//What a gateway callback was answered with
+struct GatewayAnswer
+{
+   int calls = 0;
+   ModbusCacheStatus status = CACHE_NOT_READY;
+   uint16_t first = 0;          //first register of the answer, NULL data leaves it 0
+};
+
+static ModbusGatewayCallback gatewayAnswer(GatewayAnswer &answer)
+{
+   return [&answer](ModbusCacheStatus status, const uint8_t *data) {
+      answer.calls++;
+      answer.status = status;
+      if (data != NULL) answer.first = data[0] << 8 | data[1];
+   };
+}
+
+//Overlapping and touching reads share one upstream read, a covered one is then a hit
+static void test_gateway_coalesces_reads()
+{
+   GatewayAnswer a, b, c;
+   uint8_t out[2 * 20];
+   ModbusGatewayStats before = gatewayStats();
+   TEST_ASSERT_EQUAL_INT(CACHE_PENDING, gatewayRead(0, 4300, 10, out, gatewayAnswer(a), 1000));
+   TEST_ASSERT_EQUAL_INT(CACHE_PENDING, gatewayRead(0, 4310, 5, out, gatewayAnswer(b), 1000));
+   TEST_ASSERT_EQUAL_INT(CACHE_PENDING, gatewayRead(0, 4302, 2, out, gatewayAnswer(c), 1000));
+   TEST_ASSERT_EQUAL_UINT32(before.misses + 1, gatewayStats().misses);
+   TEST_ASSERT_EQUAL_UINT32(before.coalesced + 2, gatewayStats().coalesced);
+   TEST_ASSERT_EQUAL_INT(-1, gatewayNextQueued(1));
+
+   int entry = gatewayNextQueued(0);
+   TEST_ASSERT_TRUE(entry >= 0);
+   TEST_ASSERT_EQUAL_UINT16(4300, gatewayEntry(entry).address);
+   TEST_ASSERT_EQUAL_UINT16(15, gatewayEntry(entry).count);
+   gatewayIssued(entry, 1100);
+   TEST_ASSERT_EQUAL_INT(-1, gatewayNextQueued(0));
+
+   uint8_t data[2 * 15];
+   for (int i = 0; i < 15; i++)
+   {
+      data[2 * i] = (4300 + i) >> 8;
+      data[2 * i + 1] = (4300 + i) & 0xFF;
+   }
+   gatewayComplete(entry, data, 0, 1200);
+   TEST_ASSERT_EQUAL_INT(1, a.calls);
+   TEST_ASSERT_EQUAL_INT(1, b.calls);
+   TEST_ASSERT_EQUAL_INT(1, c.calls);
+   TEST_ASSERT_EQUAL_INT(CACHE_OK, b.status);
+   TEST_ASSERT_EQUAL_UINT16(4300, a.first);
+   TEST_ASSERT_EQUAL_UINT16(4310, b.first);
+   TEST_ASSERT_EQUAL_UINT16(4302, c.first);
+
+   GatewayAnswer d;
+   TEST_ASSERT_EQUAL_INT(CACHE_OK, gatewayRead(0, 4305, 3, out, gatewayAnswer(d), 1300));
+   TEST_ASSERT_EQUAL_UINT8(4305 & 0xFF, out[1]);
+   TEST_ASSERT_EQUAL_INT(0, d.calls);
+   //Another Classic's registers are never answered from it, nor are stale ones
+   TEST_ASSERT_EQUAL_INT(CACHE_PENDING, gatewayRead(1, 4305, 3, out, gatewayAnswer(d), 1300));
+   TEST_ASSERT_EQUAL_INT(CACHE_PENDING, gatewayRead(0, 4305, 3, out, gatewayAnswer(d), 1200 + gatewayTtl(4300, 15)));
+}
+
+//A read that never comes back answers its waiters with an error
+static void test_gateway_expires_lost_reads()
+{
+   GatewayAnswer a;
+   uint8_t out[2 * 4];
+   TEST_ASSERT_EQUAL_INT(CACHE_PENDING, gatewayRead(2, 4120, 4, out, gatewayAnswer(a), 5000));
+   int entry = gatewayNextQueued(2);
+   gatewayIssued(entry, 5000);
+   gatewayExpire(5000 + MODBUS_GATEWAY_TIMEOUT - 1);
+   TEST_ASSERT_EQUAL_INT(0, a.calls);
+   gatewayExpire(5000 + MODBUS_GATEWAY_TIMEOUT);
+   TEST_ASSERT_EQUAL_INT(1, a.calls);
+   TEST_ASSERT_EQUAL_INT(CACHE_UPSTREAM_ERROR, a.status);
+   TEST_ASSERT_EQUAL_INT(-1, gatewayNextQueued(2));
+}
+
+int main(int argc, char **argv)
+{
+   Serial.output = NULL;
+   setenv("TZ", "UTC0", 1);
+   tzset();
+   UNITY_BEGIN();
+   RUN_TEST(test_decode_identity_bank);
+   RUN_TEST(test_decode_live_bank);
+   RUN_TEST(test_decode_whizbang_bank);
+   RUN_TEST(test_field_decoder_matches_bank_decoder);
+   RUN_TEST(test_changed_fields);
+   RUN_TEST(test_plan_merges_close_banks);
+   RUN_TEST(test_plan_splits_at_the_read_limit);
+   RUN_TEST(test_plan_only_needed_banks);
+   RUN_TEST(test_plan_stops_at_max_spans);
+   RUN_TEST(test_auto_adjust_normal);
+   RUN_TEST(test_auto_adjust_opposite);
+   RUN_TEST(test_json_round_trip);
+   RUN_TEST(test_json_defaults);
+   RUN_TEST(test_near_margin);
+   RUN_TEST(test_switch_hold_off_dwell);
+   RUN_TEST(test_switch_hold_off_rate);
+   RUN_TEST(test_minute_of_day_text);
+   RUN_TEST(test_rule_compile);
+   RUN_TEST(test_rule_evaluate_hysteresis);
+   RUN_TEST(test_rule_evaluate_for);
+   RUN_TEST(test_timeseries_round_trip);
+   RUN_TEST(test_timeseries_query_range);
+   RUN_TEST(test_timeseries_drops_oldest_blocks);
+   RUN_TEST(test_timeseries_copy_block);
+   RUN_TEST(test_timeseries_clock_set_back);
+   RUN_TEST(test_timeseries_flush_keeps_block_open);
+   RUN_TEST(test_derived_slopes);
+   RUN_TEST(test_derived_amp_hours);
+   RUN_TEST(test_derived_gap_and_midnight);
+   RUN_TEST(test_rollups_rollover);
+   RUN_TEST(test_rollups_combine);
+   RUN_TEST(test_timer_one_shot);
+   RUN_TEST(test_timer_periodic);
+   RUN_TEST(test_timer_stale_ids);
+   RUN_TEST(test_timer_callback_starts_timers);
+   RUN_TEST(test_timer_jump_past_a_turn);
+   RUN_TEST(test_gateway_coalesces_reads);
+   RUN_TEST(test_gateway_expires_lost_reads);
+   return UNITY_END();
+}
@@ -0,0 +1,290 @@
+#!/usr/bin/env python3
+"""
+Midnite Classic Modbus TCP simulator.
+
+Serves the holding registers the firmware reads from a Classic (see src/ClassicRegisterMap.h, which this
+script parses so the two can not drift apart) so ModbusStuff.cpp can be exercised, benchmarked and
+regression tested on a plain Linux box instead of a real charge controller.
+
+    python3 tools/classic_simulator/classic_sim.py --port 1502 \
+        --scenario tools/classic_simulator/scenarios/discharge.json --latency 40 --jitter 20 --drop 0.02
+
+Point the relay board (classicip/classicport on the WiFi manager page) at the machine running it.
+
+Scenario files are JSON:
+    {
+      "name": "...",
+      "duration": 3600,             scenario seconds, the trajectories are clamped at the end (or wrap with "loop": true)
+      "timeScale": 60,              scenario seconds that pass per real second
+      "whizbang": true,             report a whizbang jr. on aux 2
+      "fields": {                   any numeric field of CLASSIC_REGISTER_MAP, in engineering units
+        "SOC": {"keyframes": [[0, 95], [3600, 40]]},       linear between [time, value] points
+        "BatVoltage": {"value": 52.1, "noise": 0.05}         constant, plus uniform noise
+      },
+      "faults": {"latencyMs": 30, "jitterMs": 10, "dropRate": 0.0, "errorRate": 0.0, "errorCode": 6,
+                 "events": [{"at": 600, "for": 60, "dropRate": 1.0}]}    fault overrides for a window of scenario time
+    }
+Command line options override the scenario's faults.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import re
+import signal
+import struct
+import sys
+import time
+
+MAP_HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "src", "ClassicRegisterMap.h")
+
+# Modbus exception codes
+ILLEGAL_FUNCTION = 0x01
+ILLEGAL_DATA_ADDRESS = 0x02
+ILLEGAL_DATA_VALUE = 0x03
+SERVER_DEVICE_BUSY = 0x06
+
+MAX_READ_REGISTERS = 125
+
+DEFAULT_VALUES = {
+    "BatVoltage": 52.4, "PVVoltage": 95.0, "BatCurrent": 12.0, "EnergyToday": 3.2, "Power": 630,
+    "ChargeState": 3, "PVCurrent": 6.6, "lastVOC": 120.0, "TotalEnergy": 12345.6, "InfoFlagsBits": 0,
+    "BatTemperature": 21.5, "FETTemperature": 35.0, "PCBTemperature": 33.0, "FloatTimeTodaySeconds": 0,
+    "AbsorbTime": 0, "EqualizeTime": 0, "mpptMode": 3, "VbattRegSetPTmpComp": 56.4, "nominalBatteryVoltage": 48,
+    "endingAmps": 4.0, "ReasonForResting": 0, "PositiveAmpHours": 1500, "NegativeAmpHours": 1200,
+    "WhizbangBatCurrent": 11.8, "ShuntTemperature": 22, "SOC": 85, "RemainingAmpHours": 340, "TotalAmpHours": 400,
+    "unitID": 123456, "appVersion": 2079, "netVersion": 2081,
+}
+
+
+def load_register_map(path):
+    """Parse the X(bank, address, type, scale, field) lines of CLASSIC_REGISTER_MAP."""
+    entries = []
+    pattern = re.compile(r"X\(\s*(\w+)\s*,\s*(\d+)\s*,\s*([\w<>]+)\s*,\s*([\d.]+)\s*,\s*(\w+)\s*\)")
+    with open(path) as f:
+        for m in pattern.finditer(f.read()):
+            entries.append({"bank": m.group(1), "address": int(m.group(2)), "type": m.group(3),
+                            "scale": float(m.group(4)), "field": m.group(5)})
+    if not entries:
+        sys.exit("No registers found in %s" % path)
+    return entries
+
+
+class Trajectory:
+    def __init__(self, spec, default):
+        if isinstance(spec, (int, float)):
+            spec = {"value": spec}
+        self.keyframes = spec.get("keyframes") or [[0, spec.get("value", default)]]
+        self.noise = spec.get("noise", 0.0)
+
+    def at(self, t):
+        k = self.keyframes
+        if t <= k[0][0]:
+            v = k[0][1]
+        elif t >= k[-1][0]:
+            v = k[-1][1]
+        else:
+            for (t0, v0), (t1, v1) in zip(k, k[1:]):
+                if t0 <= t <= t1:
+                    v = v0 + (v1 - v0) * (t - t0) / float(t1 - t0) if t1 != t0 else v1
+                    break
+        if self.noise:
+            v += random.uniform(-self.noise, self.noise)
+        return v
+
+
+class Classic:
+    """Register image of one simulated Classic, rebuilt from the scenario for the current scenario time."""
+
+    def __init__(self, entries, scenario):
+        self.entries = entries
+        self.scenario = scenario
+        self.start = time.monotonic()
+        fields = scenario.get("fields", {})
+        self.trajectories = {e["field"]: Trajectory(fields.get(e["field"], DEFAULT_VALUES.get(e["field"], 0)),
+                                                    DEFAULT_VALUES.get(e["field"], 0))
+                             for e in entries}
+
+    def scenario_time(self):
+        t = (time.monotonic() - self.start) * self.scenario.get("timeScale", 1.0)
+        duration = self.scenario.get("duration")
+        if duration and self.scenario.get("loop"):
+            t = t % duration
+        return t
+
+    def image(self):
+        t = self.scenario_time()
+        regs = {}
+        for e in self.entries:
+            self.encode(regs, e, self.trajectories[e["field"]].at(t))
+        return regs
+
+    def encode(self, regs, e, value):
+        a, kind, scale = e["address"], e["type"], e["scale"]
+        if kind == "RegS16":
+            regs[a] = int(round(value * scale)) & 0xFFFF
+        elif kind == "RegU16":
+            regs[a] = int(round(value * scale)) & 0xFFFF
+        elif kind in ("RegU32", "RegAbsU32", "RegVersion"):
+            raw = int(round(value * scale)) & 0xFFFFFFFF
+            regs[a], regs[a + 1] = raw & 0xFFFF, raw >> 16      # low word first
+        elif kind == "RegMSB":
+            regs[a] = (int(value) & 0xFF) << 8
+        elif kind == "RegShuntTemp":
+            regs[a] = (int(round(value)) + 50) & 0xFF
+        elif kind.startswith("RegFlag"):
+            pass                                                # taken from InfoFlagsBits
+        elif kind == "RegWhizbang":
+            regs[a] = (18 << 8) if self.scenario.get("whizbang", True) else 0
+        elif kind == "RegModel":
+            regs[a] = (1 << 8) | 150                             # Classic 150 rev 1
+        elif kind == "RegBuildDate":
+            regs[a], regs[a + 1] = 2023, (6 << 8) | 15
+        elif kind == "RegMacAddress":
+            regs[a], regs[a + 1], regs[a + 2] = 0x0405, 0x0203, 0x6001
+
+    def read(self, address, count):
+        regs = self.image()
+        return [regs.get(address + i, 0) for i in range(count)]
+
+
+class Faults:
+    def __init__(self, scenario, args):
+        self.base = dict(latencyMs=0, jitterMs=0, dropRate=0.0, errorRate=0.0, errorCode=SERVER_DEVICE_BUSY)
+        self.base.update({k: v for k, v in scenario.get("faults", {}).items() if k != "events"})
+        for key, arg in (("latencyMs", args.latency), ("jitterMs", args.jitter), ("dropRate", args.drop),
+                         ("errorRate", args.error_rate), ("errorCode", args.error_code)):
+            if arg is not None:
+                self.base[key] = arg
+        self.events = scenario.get("faults", {}).get("events", [])
+
+    def current(self, t):
+        f = dict(self.base)
+        for ev in self.events:
+            if ev["at"] <= t < ev["at"] + ev.get("for", 0):
+                f.update({k: v for k, v in ev.items() if k not in ("at", "for")})
+        return f
+
+
+class Stats:
+    def __init__(self):
+        self.requests = self.responses = self.dropped = self.errors = 0
+        self.latencies = []
+
+    def report(self):
+        lat = sorted(self.latencies)
+        pct = lambda p: lat[min(len(lat) - 1, int(len(lat) * p / 100.0))] if lat else 0
+        print("requests=%d responses=%d dropped=%d errors=%d latency ms p50=%.1f p95=%.1f p99=%.1f"
+              % (self.requests, self.responses, self.dropped, self.errors, pct(50), pct(95), pct(99)))
+
+
+async def handle_frame(classic, faults, stats, header, pdu, writer, lock):
+    transaction, protocol, _, unit = header
+    stats.requests += 1
+    t_received = time.monotonic()
+    f = faults.current(classic.scenario_time())
+
+    delay = max(0.0, f["latencyMs"] + random.uniform(-f["jitterMs"], f["jitterMs"])) / 1000.0
+    if delay:
+        await asyncio.sleep(delay)
+
+    if random.random() < f["dropRate"]:
+        stats.dropped += 1
+        return
+
+    function = pdu[0]
+    if random.random() < f["errorRate"]:
+        body = struct.pack(">BB", function | 0x80, f["errorCode"])
+    elif function not in (0x03, 0x04):
+        body = struct.pack(">BB", function | 0x80, ILLEGAL_FUNCTION)
+    elif len(pdu) < 5:
+        body = struct.pack(">BB", function | 0x80, ILLEGAL_DATA_VALUE)
+    else:
+        address, count = struct.unpack(">HH", pdu[1:5])
+        if count == 0 or count > MAX_READ_REGISTERS:
+            body = struct.pack(">BB", function | 0x80, ILLEGAL_DATA_VALUE)
+        else:
+            values = classic.read(address, count)
+            body = struct.pack(">BB", function, count * 2) + struct.pack(">%dH" % count, *values)
+
+    if body[0] & 0x80:
+        stats.errors += 1
+    async with lock:
+        writer.write(struct.pack(">HHHB", transaction, protocol, len(body) + 1, unit) + body)
+        await writer.drain()
+    stats.responses += 1
+    stats.latencies.append((time.monotonic() - t_received) * 1000.0)
+
+
+async def serve_client(reader, writer, classic, faults, stats, concurrent):
+    peer = writer.get_extra_info("peername")
+    print("client connected %s" % (peer,))
+    lock = asyncio.Lock()
+    pending = set()
+    try:
+        while True:
+            header = struct.unpack(">HHHB", await reader.readexactly(7))
+            pdu = await reader.readexactly(header[2] - 1)
+            job = handle_frame(classic, faults, stats, header, pdu, writer, lock)
+            if concurrent:
+                task = asyncio.ensure_future(job)
+                pending.add(task)
+                task.add_done_callback(pending.discard)
+            else:
+                await job                                        # a real Classic answers one request at a time
+    except (asyncio.IncompleteReadError, ConnectionError):
+        pass
+    finally:
+        for task in pending:
+            task.cancel()
+        writer.close()
+        print("client disconnected %s" % (peer,))
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="Midnite Classic Modbus TCP simulator")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=502)
+    parser.add_argument("--scenario", help="scenario JSON file")
+    parser.add_argument("--map", default=MAP_HEADER, help="path to ClassicRegisterMap.h")
+    parser.add_argument("--latency", type=float, help="response latency in ms")
+    parser.add_argument("--jitter", type=float, help="+/- ms added to the latency")
+    parser.add_argument("--drop", type=float, help="fraction of requests never answered")
+    parser.add_argument("--error-rate", type=float, help="fraction of requests answered with an exception")
+    parser.add_argument("--error-code", type=int, help="exception code used for --error-rate")
+    parser.add_argument("--no-whizbang", action="store_true", help="report no whizbang jr.")
+    parser.add_argument("--concurrent", action="store_true", help="answer pipelined requests concurrently")
+    parser.add_argument("--seed", type=int, help="random seed, for repeatable runs")
+    args = parser.parse_args()
+
+    if args.seed is not None:
+        random.seed(args.seed)
+    scenario = {}
+    if args.scenario:
+        with open(args.scenario) as f:
+            scenario = json.load(f)
+    if args.no_whizbang:
+        scenario["whizbang"] = False
+
+    classic = Classic(load_register_map(args.map), scenario)
+    faults = Faults(scenario, args)
+    stats = Stats()
+
+    server = await asyncio.start_server(
+        lambda r, w: serve_client(r, w, classic, faults, stats, args.concurrent), args.host, args.port)
+    print("Classic simulator '%s' listening on %s:%d, %d registers mapped"
+          % (scenario.get("name", "default"), args.host, args.port, len(classic.entries)))
+
+    stop = asyncio.Event()
+    loop = asyncio.get_running_loop()
+    for sig in (signal.SIGINT, signal.SIGTERM):
+        loop.add_signal_handler(sig, stop.set)
+    async with server:
+        await stop.wait()
+    stats.report()
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
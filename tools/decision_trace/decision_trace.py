@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""
+Decoder for the auto-control decision trace of the relay board.
+
+The firmware keeps what auto control decided for each relay it looked at as fixed size binary records (see
+src/DecisionTrace.h) and serves them from /decisiontrace. This fetches them, or reads a saved copy, and prints
+one line per decision. The measure names are parsed from AUTO_MEASURE_MAP in src/AutoData.h so the two can
+not drift apart.
+
+    python3 tools/decision_trace/decision_trace.py --host 192.168.1.50
+    python3 tools/decision_trace/decision_trace.py --host 192.168.1.50 --follow 5 --csv >> decisions.csv
+    curl -s http://192.168.1.50/decisiontrace > trace.bin && python3 tools/decision_trace/decision_trace.py --file trace.bin
+"""
+
+import argparse
+import datetime
+import math
+import os
+import re
+import struct
+import sys
+import time
+import urllib.request
+
+AUTO_DATA_HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "src", "AutoData.h")
+
+# DecisionTrace.h
+MAGIC = 0x43525444
+VERSION = 1
+HEADER = struct.Struct("<IHHIIII")
+RECORD = struct.Struct("<IIfffIBBBB")
+MEASURE_RULE = 0xFF
+STATE_BEFORE, STATE_WANTED, STATE_AFTER = 0x01, 0x02, 0x04
+OUTCOMES = {0: "kept", 1: "switched", 2: "held-dwell", 3: "held-rate"}
+
+
+def load_measures(path):
+    """Short names of the X(measure, shortName, longName, nearMargin, source) lines of AUTO_MEASURE_MAP, in enum order."""
+    pattern = re.compile(r"X\(\s*(\w+)\s*,\s*\"([^\"]*)\"")
+    try:
+        with open(path) as f:
+            return [m.group(2) for m in pattern.finditer(f.read())]
+    except OSError:
+        return []
+
+
+def decode(data):
+    """Returns the header fields and the list of records, each a dict."""
+    if len(data) < HEADER.size:
+        sys.exit("Trace too short for its header")
+    magic, version, record_size, first, count, millis, now = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        sys.exit("Not a decision trace (magic %08x)" % magic)
+    if version != VERSION or record_size != RECORD.size:
+        sys.exit("Trace version %d with %d byte records, this decodes version %d" % (version, record_size, VERSION))
+    header = {"first": first, "count": count, "millis": millis, "time": now}
+    records = []
+    expected = first
+    for offset in range(HEADER.size, min(len(data), HEADER.size + count * RECORD.size) - RECORD.size + 1, RECORD.size):
+        number, ms, reading, value, restore, hold_off, relay, measure, state, outcome = RECORD.unpack_from(data, offset)
+        # The writer went round the ring while the trace was being read, the slot holds a newer decision
+        if number != expected:
+            expected += 1
+            continue
+        expected += 1
+        records.append({"number": number, "millis": ms, "reading": reading, "value": value, "restore": restore,
+                        "holdOff": hold_off, "relay": relay, "measure": measure, "state": state, "outcome": outcome})
+    return header, records
+
+
+def timestamp(record, header):
+    """Wall clock time of the record when the board's clock was set, else seconds since boot."""
+    if header["time"] == 0:
+        return "%.3f" % (record["millis"] / 1000.0)
+    age = ((header["millis"] - record["millis"]) & 0xFFFFFFFF) / 1000.0
+    return datetime.datetime.fromtimestamp(header["time"] - age).isoformat(timespec="milliseconds")
+
+
+def number(v):
+    return "" if math.isnan(v) else "%g" % v
+
+
+def line(record, header, measures, csv):
+    if record["measure"] == MEASURE_RULE:
+        measure = "rule"
+    elif record["measure"] < len(measures):
+        measure = measures[record["measure"]]
+    else:
+        measure = str(record["measure"])
+    state = record["state"]
+    fields = [str(record["number"]), timestamp(record, header), str(record["relay"]), measure,
+              number(record["reading"]), number(record["value"]), number(record["restore"]),
+              "on" if state & STATE_BEFORE else "off", "on" if state & STATE_WANTED else "off",
+              "on" if state & STATE_AFTER else "off",
+              OUTCOMES.get(record["outcome"], str(record["outcome"])), str(record["holdOff"])]
+    if csv:
+        return ",".join(fields)
+    return "%6s %-23s relay %-2s %-12s reading %-8s value %-8s restore %-8s %-3s want %-3s now %-3s %s%s" % (
+        tuple(fields[:11]) + (" %ss" % fields[11] if record["holdOff"] else "",))
+
+
+def fetch(host, since):
+    url = host if host.startswith("http") else "http://" + host
+    with urllib.request.urlopen("%s/decisiontrace?since=%d" % (url.rstrip("/"), since), timeout=10) as response:
+        return response.read()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the relay board's auto-control decision trace")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--host", help="address of the relay board")
+    source.add_argument("--file", help="trace saved from /decisiontrace")
+    parser.add_argument("--since", type=int, default=0, help="number of the first decision wanted")
+    parser.add_argument("--follow", type=float, metavar="SECONDS", help="keep polling the board for new decisions")
+    parser.add_argument("--csv", action="store_true", help="comma separated output")
+    parser.add_argument("--map", default=AUTO_DATA_HEADER, help="path to AutoData.h")
+    args = parser.parse_args()
+
+    measures = load_measures(args.map)
+    if args.csv:
+        print("number,time,relay,measure,reading,value,restoreValue,before,wanted,after,outcome,holdOff")
+    since = args.since
+    while True:
+        if args.file:
+            with open(args.file, "rb") as f:
+                data = f.read()
+        else:
+            data = fetch(args.host, since)
+        header, records = decode(data)
+        if header["first"] > since and since != 0:
+            print("# %d decisions were dropped before they were read" % (header["first"] - since), file=sys.stderr)
+        for record in records:
+            print(line(record, header, measures, args.csv))
+        sys.stdout.flush()
+        since = header["first"] + header["count"]
+        if not args.follow or args.file:
+            break
+        time.sleep(args.follow)
+
+
+if __name__ == "__main__":
+    main()